@@ -0,0 +1,813 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+/* Benchmarks for the data path.  Run with "make bench".
+
+   The micro benchmarks time the per-sample kernels on their own.  The
+   macro benchmarks build a synthetic capture of each device, then time
+   "ethstream -p" replaying it in each output mode, so that everything
+   from the receive ring to the output writes is included.  Syscalls
+   are the read and write calls counted in /proc/<pid>/io.
+
+   The library client streams from ue9-sim and nerdjack-sim through
+   libethstream.h, checking the packet ranges and volts as it goes. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "debug.h"
+#include "ue9.h"
+#include "nerdjack.h"
+#include "simd.h"
+#include "util.h"
+#include "binary.h"
+#include "capture.h"
+#include "ring.h"
+#include "libethstream.h"
+
+#define BENCH_SAMPLES (1 << 16)
+#define BENCH_ROUNDS 200
+
+/* Size of the synthetic captures */
+#define BENCH_NERD_PACKETS 4000
+#define BENCH_NERD_CHANNELS 12
+#define BENCH_UE9_PACKETS 200000
+#define BENCH_UE9_CHANNELS 4
+
+/* Slow NerdJack stream for the output latency check, with packets
+   much further apart than the flush interval */
+#define BENCH_LATENCY_PACKETS 8
+#define BENCH_LATENCY_CHANNELS 6
+#define BENCH_LATENCY_RATE 400
+#define BENCH_LATENCY_FLUSH_MS 50
+#define BENCH_LATENCY_SLACK_MS 50
+
+/* Library client, against the simulators */
+#define BENCH_LIB_SCANS 200000
+#define BENCH_LIB_READ 64	/* scans per ethstream_read() */
+#define BENCH_LIB_CHANNELS 3
+
+static uint16_t samples[BENCH_SAMPLES];
+static volatile double sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double count, double seconds)
+{
+	printf("%-32s %12.0f samples/sec %8.2f ns/sample\n", name,
+	       count / seconds, seconds * 1e9 / count);
+}
+
+static void report_io(const char *name, double count, double seconds,
+		      double syscalls)
+{
+	printf("%-32s %12.0f samples/sec %8.2f ns/sample %10.0f syscalls/sec\n",
+	       name, count / seconds, seconds * 1e9 / count,
+	       syscalls / seconds);
+}
+
+/* Plausible calibration values, the benchmark doesn't need a device */
+static void fake_calibration(struct ue9Calibration *calib)
+{
+	int i;
+
+	memset(calib, 0, sizeof(*calib));
+	for (i = 0; i < 4; i++) {
+		calib->unipolarSlope[i] = (5.08 / 65536.0) / (1 << i);
+		calib->unipolarOffset[i] = 0.0001 * i;
+	}
+	calib->bipolarSlope = 10.25 / 65536.0;
+	calib->bipolarOffset = -5.1;
+	calib->tempSlope = 0.012683;
+}
+
+/* UE9 volts conversion, as done per sample before conversion tables */
+static void bench_ue9_convert(void)
+{
+	struct ue9Calibration calib;
+	struct ue9Conversion conv[4];
+	int channel_list[4] = { 0, 1, 2, 133 };
+	int gain_list[4] = { 0, 1, 8, 0 };
+	int channels = ARRAY_SIZE(channel_list);
+	double out[4];
+	double t, sum;
+	int r, i, j;
+
+	fake_calibration(&calib);
+	ue9_conversion_setup(&calib, channels, channel_list, channels,
+			     gain_list, 12, conv);
+
+	/* Both must give identical results */
+	for (i = 0; i < BENCH_SAMPLES; i += channels) {
+		ue9_convert_scan(conv, channels, samples + i, out);
+		for (j = 0; j < channels; j++) {
+			double v = (channel_list[j] <= UE9_MAX_ANALOG_CHANNEL) ?
+			    ue9_binary_to_analog(&calib, gain_list[j], 12,
+						 samples[i + j]) :
+			    ue9_binary_to_temperature(&calib, samples[i + j]);
+			if (v != out[j]) {
+				fprintf(stderr, "conversion mismatch\n");
+				exit(1);
+			}
+		}
+	}
+
+	t = now();
+	sum = 0;
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < BENCH_SAMPLES; i += channels) {
+			for (j = 0; j < channels; j++) {
+				if (channel_list[j] <= UE9_MAX_ANALOG_CHANNEL)
+					sum += ue9_binary_to_analog
+					    (&calib, gain_list[j], 12,
+					     samples[i + j]);
+				else if (channel_list[j] == 141 ||
+					 channel_list[j] == 133)
+					sum += ue9_binary_to_temperature
+					    (&calib, samples[i + j]);
+			}
+		}
+	}
+	sink = sum;
+	report("ue9_binary_to_analog", (double)BENCH_ROUNDS * BENCH_SAMPLES,
+	       now() - t);
+
+	t = now();
+	sum = 0;
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < BENCH_SAMPLES; i += channels) {
+			ue9_convert_scan(conv, channels, samples + i, out);
+			sum += out[0] + out[1] + out[2] + out[3];
+		}
+	}
+	sink = sum;
+	report("ue9_convert_scan", (double)BENCH_ROUNDS * BENCH_SAMPLES,
+	       now() - t);
+}
+
+/* NerdJack packet byte-swap and volts conversion kernels */
+static void bench_nerdjack_unpack(void)
+{
+	static int16_t in[NERDJACK_NUM_SAMPLES];
+	static uint16_t raw[2][NERDJACK_NUM_SAMPLES];
+	static double scale[NERDJACK_NUM_SAMPLES];
+	static double volts[2][NERDJACK_NUM_SAMPLES];
+	static float fscale[NERDJACK_NUM_SAMPLES];
+	static float fvolts[2][NERDJACK_NUM_SAMPLES];
+	double t, count = (double)BENCH_ROUNDS * 100 * NERDJACK_NUM_SAMPLES;
+	char name[64];
+	int r, i, v;
+
+	for (i = 0; i < NERDJACK_NUM_SAMPLES; i++) {
+		scale[i] = (i % 12 <= 5) ? 5.0 : 10.0;
+		fscale[i] = scale[i];
+	}
+
+	/* Every possible sample value must convert identically, at
+	   every alignment within the vector */
+	for (v = 0; v < 65536; v += NERDJACK_NUM_SAMPLES) {
+		for (i = 0; i < NERDJACK_NUM_SAMPLES; i++) {
+			uint16_t s = (v + i) & 0xffff;
+			s = (s << 8) | (s >> 8);
+			memcpy(&in[i], &s, 2);
+		}
+		simd_unpack_raw(in, raw[0], NERDJACK_NUM_SAMPLES);
+		simd_unpack_raw_scalar(in, raw[1], NERDJACK_NUM_SAMPLES);
+		simd_unpack_volts(in, scale, volts[0], NERDJACK_NUM_SAMPLES);
+		simd_unpack_volts_scalar(in, scale, volts[1],
+					 NERDJACK_NUM_SAMPLES);
+		simd_unpack_volts_float(in, fscale, fvolts[0],
+					NERDJACK_NUM_SAMPLES);
+		simd_unpack_volts_float_scalar(in, fscale, fvolts[1],
+					       NERDJACK_NUM_SAMPLES);
+		if (memcmp(raw[0], raw[1], sizeof(raw[0])) ||
+		    memcmp(volts[0], volts[1], sizeof(volts[0])) ||
+		    memcmp(fvolts[0], fvolts[1], sizeof(fvolts[0]))) {
+			fprintf(stderr, "%s kernel mismatch\n", simd_name());
+			exit(1);
+		}
+	}
+
+	memcpy(in, samples, sizeof(in));
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		simd_unpack_raw_scalar(in, raw[0], NERDJACK_NUM_SAMPLES);
+	report("nerdjack unpack raw (scalar)", count, now() - t);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		simd_unpack_raw(in, raw[0], NERDJACK_NUM_SAMPLES);
+	sprintf(name, "nerdjack unpack raw (%s)", simd_name());
+	report(name, count, now() - t);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		simd_unpack_volts_scalar(in, scale, volts[0],
+					 NERDJACK_NUM_SAMPLES);
+	report("nerdjack unpack volts (scalar)", count, now() - t);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		simd_unpack_volts(in, scale, volts[0], NERDJACK_NUM_SAMPLES);
+	sprintf(name, "nerdjack unpack volts (%s)", simd_name());
+	report(name, count, now() - t);
+}
+
+/* A UE9 stream packet holding 16 samples, starting at "sample" */
+static void ue9_packet(uint8_t * pkt, uint8_t counter, unsigned long sample)
+{
+	int i;
+
+	memset(pkt, 0, 46);
+	pkt[1] = 0xF9;
+	pkt[2] = 0x14;
+	pkt[3] = 0xC0;
+	pkt[10] = counter;
+	for (i = 0; i < 16; i++) {
+		uint16_t v = samples[(sample + i) % BENCH_SAMPLES] & 0xfff0;
+
+		pkt[12 + 2 * i] = v & 0xff;
+		pkt[13 + 2 * i] = v >> 8;
+	}
+	ue9_checksum_extended(pkt, 46);
+}
+
+/* UE9 stream packet checksums, as checked for every packet */
+static void bench_ue9_verify(void)
+{
+	static uint8_t pkt[1024][46];
+	double t, count = (double)BENCH_ROUNDS * 100 * ARRAY_SIZE(pkt) * 16;
+	int r, i, j, n, ok = 0;
+
+	for (i = 0; i < (int)ARRAY_SIZE(pkt); i++)
+		ue9_packet(pkt[i], i, i * 16);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		for (i = 0; i < (int)ARRAY_SIZE(pkt); i++)
+			ok += ue9_verify_extended(pkt[i], 46);
+	report("ue9_verify_extended", count, now() - t);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		for (i = 0; i < (int)ARRAY_SIZE(pkt); i++)
+			ok += ue9_verify_normal(pkt[i], 6);
+	report("ue9_verify_normal", count, now() - t);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		ok += simd_ue9_verify_scalar(pkt[0], ARRAY_SIZE(pkt));
+	report("ue9_verify_batch (scalar)", count, now() - t);
+
+	t = now();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+		ok += simd_ue9_verify(pkt[0], ARRAY_SIZE(pkt));
+	report("ue9_verify_batch", count, now() - t);
+
+	if (ok != 4 * BENCH_ROUNDS * 100 * (int)ARRAY_SIZE(pkt)) {
+		fprintf(stderr, "checksum mismatch\n");
+		exit(1);
+	}
+
+	/* Every single-bit error must be caught the same way */
+	for (i = 0; i < 46 * 8; i++) {
+		pkt[1][i / 8] ^= 1 << (i % 8);
+		j = ue9_verify_extended(pkt[1], 46) &&
+		    ue9_verify_normal(pkt[1], 6);
+		n = simd_ue9_verify(pkt[0], 3);
+		if (n != (j ? 3 : 1) ||
+		    simd_ue9_verify_scalar(pkt[0], 3) != n) {
+			fprintf(stderr, "checksum mismatch at bit %d\n", i);
+			exit(1);
+		}
+		pkt[1][i / 8] ^= 1 << (i % 8);
+	}
+}
+
+/* Append packets to a capture, as recvs of up to RECEIVER_BATCH bytes
+   arriving at the rate the device would send them */
+static int capture_packets(struct capture *c, uint8_t * buf, size_t size,
+			   int count, double interval)
+{
+	int per = RECEIVER_BATCH / size, i;
+	struct timeval tv;
+
+	for (i = 0; i < count; i += per) {
+		double t = 1e9 + i * interval;
+
+		tv.tv_sec = (long)t;
+		tv.tv_usec = (long)((t - tv.tv_sec) * 1e6);
+		if (capture_write_data(c, buf + i * size,
+				       size * ((count - i < per) ?
+					       count - i : per), &tv) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* NerdJack data packet number i, with samples from the table */
+static void nerdjack_packet(uint8_t * p, int i)
+{
+	int j;
+
+	memset(p, 0, NERDJACK_PACKET_SIZE);
+	p[0] = 0xF0;
+	p[1] = 0xAA;
+	p[2] = (i >> 8) & 0xff;	/* packet number, big-endian */
+	p[3] = i & 0xff;
+	for (j = 0; j < NERDJACK_NUM_SAMPLES; j++) {
+		uint16_t v = samples[(i * NERDJACK_NUM_SAMPLES + j) %
+				     BENCH_SAMPLES];
+
+		p[8 + 2 * j] = v >> 8;
+		p[9 + 2 * j] = v & 0xff;
+	}
+}
+
+/* Synthetic NerdJack capture: all channels at 16 kHz */
+static int make_nerdjack_capture(const char *path, double *count)
+{
+	struct capture c;
+	struct capture_stream cs = {
+		.device = BINARY_DEVICE_NERDJACK,
+		.channel_count = BENCH_NERD_CHANNELS,
+		.period = NERDJACK_CLOCK_RATE / 16000,
+	};
+	int groups = NERDJACK_NUM_SAMPLES / BENCH_NERD_CHANNELS;
+	size_t size = NERDJACK_PACKET_SIZE;
+	uint8_t *buf = malloc(BENCH_NERD_PACKETS * size);
+	int i, ret = -1;
+
+	if (buf == NULL)
+		return -1;
+	cs.rate = (double)NERDJACK_CLOCK_RATE / cs.period;
+	for (i = 0; i < BENCH_NERD_CHANNELS; i++)
+		cs.channel_list[i] = i;
+
+	for (i = 0; i < BENCH_NERD_PACKETS; i++)
+		nerdjack_packet(buf + i * size, i);
+
+	if (capture_create(&c, path) == 0) {
+		if (capture_write_stream(&c, &cs) == 0 &&
+		    capture_packets(&c, buf, size, BENCH_NERD_PACKETS,
+				    groups / cs.rate) == 0)
+			ret = 0;
+		capture_close(&c);
+	}
+	free(buf);
+
+	/* The first scan of a stream is dropped */
+	*count = ((double)BENCH_NERD_PACKETS * groups - 1) *
+	    BENCH_NERD_CHANNELS;
+	return ret;
+}
+
+/* Synthetic UE9 capture: four analog channels at 40 kHz */
+static int make_ue9_capture(const char *path, double *count)
+{
+	struct capture c;
+	struct capture_stream cs = {
+		.device = BINARY_DEVICE_UE9,
+		.channel_count = BENCH_UE9_CHANNELS,
+		.rate = 40000,
+		.calibrated = 1,
+	};
+	uint8_t *buf = malloc(BENCH_UE9_PACKETS * 46);
+	int i, ret = -1;
+
+	if (buf == NULL)
+		return -1;
+	fake_calibration(&cs.calib);
+	for (i = 0; i < BENCH_UE9_CHANNELS; i++)
+		cs.channel_list[i] = i;
+
+	for (i = 0; i < BENCH_UE9_PACKETS; i++)
+		ue9_packet(buf + i * 46, i, (unsigned long)i * 16);
+
+	if (capture_create(&c, path) == 0) {
+		if (capture_write_stream(&c, &cs) == 0 &&
+		    capture_packets(&c, buf, 46, BENCH_UE9_PACKETS,
+				    16.0 / BENCH_UE9_CHANNELS / cs.rate) == 0)
+			ret = 0;
+		capture_close(&c);
+	}
+	free(buf);
+
+	*count = (double)BENCH_UE9_PACKETS * 16;
+	return ret;
+}
+
+/* Synthetic slow NerdJack capture, one recv per packet */
+static int make_latency_capture(const char *path, double *interval)
+{
+	struct capture c;
+	struct capture_stream cs = {
+		.device = BINARY_DEVICE_NERDJACK,
+		.channel_count = BENCH_LATENCY_CHANNELS,
+		.period = NERDJACK_CLOCK_RATE / BENCH_LATENCY_RATE,
+	};
+	uint8_t buf[NERDJACK_PACKET_SIZE];
+	struct timeval tv;
+	int i, ret = -1;
+
+	cs.rate = (double)NERDJACK_CLOCK_RATE / cs.period;
+	for (i = 0; i < BENCH_LATENCY_CHANNELS; i++)
+		cs.channel_list[i] = i;
+	*interval = (NERDJACK_NUM_SAMPLES / BENCH_LATENCY_CHANNELS) / cs.rate;
+
+	if (capture_create(&c, path) < 0)
+		return -1;
+	if (capture_write_stream(&c, &cs) < 0)
+		goto out;
+	for (i = 0; i < BENCH_LATENCY_PACKETS; i++) {
+		double t = 1e9 + i * *interval;
+
+		nerdjack_packet(buf, i);
+		tv.tv_sec = (long)t;
+		tv.tv_usec = (long)((t - tv.tv_sec) * 1e6);
+		if (capture_write_data(&c, buf, sizeof(buf), &tv) < 0)
+			goto out;
+	}
+	ret = 0;
+ out:
+	capture_close(&c);
+	return ret;
+}
+
+/* Read and write syscalls made by a process that has exited but not
+   been reaped */
+static double proc_syscalls(pid_t pid)
+{
+	char path[64], line[128];
+	double count = 0;
+	unsigned long long n;
+	FILE *f;
+
+	sprintf(path, "/proc/%d/io", (int)pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "syscr: %llu", &n) == 1 ||
+		    sscanf(line, "syscw: %llu", &n) == 1)
+			count += n;
+	}
+	fclose(f);
+	return count;
+}
+
+/* Replay a capture through ethstream with the given output option */
+static void bench_replay(const char *ethstream, const char *name,
+			 const char *path, const char *mode, double count)
+{
+	siginfo_t si;
+	double t, syscalls;
+	int status, fd;
+	pid_t pid;
+
+	t = now();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		if (mode)
+			execl(ethstream, ethstream, "-p", path, mode, NULL);
+		else
+			execl(ethstream, ethstream, "-p", path, NULL);
+		_exit(127);
+	}
+
+	/* Leave it unreaped until its counters are read */
+	if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) < 0) {
+		perror("waitid");
+		exit(1);
+	}
+	t = now() - t;
+	syscalls = proc_syscalls(pid);
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s -p %s failed\n", ethstream, path);
+		exit(1);
+	}
+	report_io(name, count, t, syscalls);
+}
+
+/* Output latency: replay a slow stream at its recorded pace into a
+   pipe, and time when each packet's last line comes out.  With -F,
+   that has to follow the packet within the flush interval, not wait
+   for the next packet.  Latency is measured against the packet that
+   came out soonest after it was due, so process startup doesn't
+   count.  Exits on failure. */
+static void bench_latency(const char *ethstream)
+{
+	char path[] = "/tmp/ethstream-bench-XXXXXX";
+	char flush[16], name[64], buf[65536];
+	double arrival[BENCH_LATENCY_PACKETS];
+	double interval, t, first, worst = 0;
+	int groups = NERDJACK_NUM_SAMPLES / BENCH_LATENCY_CHANNELS;
+	int fd, pipefd[2], status, k = 0, i;
+	long lines = 0;
+	ssize_t len;
+	pid_t pid;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+	if (make_latency_capture(path, &interval) < 0) {
+		fprintf(stderr, "can't write capture\n");
+		unlink(path);
+		exit(1);
+	}
+
+	if (pipe(pipefd) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	sprintf(flush, "%d", BENCH_LATENCY_FLUSH_MS);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDERR_FILENO);
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		execl(ethstream, ethstream, "-p", path, "-P", "-F", flush,
+		      NULL);
+		_exit(127);
+	}
+	close(pipefd[1]);
+
+	/* The first scan of the stream is dropped */
+	while ((len = read(pipefd[0], buf, sizeof(buf))) > 0) {
+		t = now();
+		for (i = 0; i < len; i++)
+			lines += (buf[i] == '\n');
+		while (k < BENCH_LATENCY_PACKETS &&
+		       lines >= (long)(k + 1) * groups - 1)
+			arrival[k++] = t;
+	}
+	close(pipefd[0]);
+	waitpid(pid, &status, 0);
+	unlink(path);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    k < BENCH_LATENCY_PACKETS) {
+		fprintf(stderr, "%s -p %s -P failed\n", ethstream, path);
+		exit(1);
+	}
+
+	first = arrival[0];
+	for (i = 1; i < k; i++)
+		if (arrival[i] - i * interval < first)
+			first = arrival[i] - i * interval;
+	for (i = 0; i < k; i++)
+		if (arrival[i] - i * interval - first > worst)
+			worst = arrival[i] - i * interval - first;
+	sprintf(name, "nerdjack output latency -F %s", flush);
+	printf("%-32s %12.1f ms max, %.0f ms between packets\n", name,
+	       worst * 1e3, interval * 1e3);
+	if (worst * 1e3 > BENCH_LATENCY_FLUSH_MS + BENCH_LATENCY_SLACK_MS) {
+		fprintf(stderr, "output latency is over the flush interval\n");
+		exit(1);
+	}
+}
+
+/* Full streams, end to end */
+static void bench_streams(const char *ethstream)
+{
+	static const struct {
+		const char *name;
+		const char *mode;
+	} modes[] = {
+		{ "DEC", NULL },
+		{ "HEX", "-H" },
+		{ "VOLTS", "-c" },
+		{ "BINARY", "-B" },
+	};
+	char nerd[] = "/tmp/ethstream-bench-XXXXXX";
+	char ue9[] = "/tmp/ethstream-bench-XXXXXX";
+	double nerd_count, ue9_count;
+	char name[64];
+	int fd1, fd2, i;
+
+	fd1 = mkstemp(nerd);
+	fd2 = mkstemp(ue9);
+	if (fd1 < 0 || fd2 < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd1);
+	close(fd2);
+
+	if (make_nerdjack_capture(nerd, &nerd_count) < 0 ||
+	    make_ue9_capture(ue9, &ue9_count) < 0) {
+		fprintf(stderr, "can't write captures\n");
+		goto out;
+	}
+
+	for (i = 0; i < (int)ARRAY_SIZE(modes); i++) {
+		sprintf(name, "nerdjack stream %s", modes[i].name);
+		bench_replay(ethstream, name, nerd, modes[i].mode, nerd_count);
+	}
+	for (i = 0; i < (int)ARRAY_SIZE(modes); i++) {
+		sprintf(name, "ue9 stream %s", modes[i].name);
+		bench_replay(ethstream, name, ue9, modes[i].mode, ue9_count);
+	}
+
+ out:
+	unlink(nerd);
+	unlink(ue9);
+}
+
+/* Run a simulator in the background */
+static pid_t sim_start(const char *path)
+{
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execl(path, path, "-f", NULL);
+		_exit(127);
+	}
+	return pid;
+}
+
+static void sim_stop(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/* Read and convert "scans" scans.  Each read has to follow on from
+   the packets of the one before. */
+static void library_read(struct ethstream *es, const char *name,
+			 long scans)
+{
+	uint16_t buf[BENCH_LIB_READ * BENCH_LIB_CHANNELS];
+	double volts[BENCH_LIB_READ * BENCH_LIB_CHANNELS];
+	struct ethstream_info info;
+	unsigned long next = 0;
+	int n, i;
+
+	while (scans > 0) {
+		n = ethstream_read(es, buf, BENCH_LIB_READ, &info);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read returned %d\n", name, n);
+			exit(1);
+		}
+		if (info.first_packet != next &&
+		    info.first_packet != next + 1) {
+			fprintf(stderr, "%s: read of %d scans from packets "
+				"%lu-%lu after packet %lu\n", name, n,
+				info.first_packet, info.last_packet, next);
+			exit(1);
+		}
+		if (info.last_packet < info.first_packet ||
+		    info.last_packet - info.first_packet >
+		    (unsigned long)(n * BENCH_LIB_CHANNELS / 16 + 1)) {
+			fprintf(stderr, "%s: read of %d scans spans packets "
+				"%lu-%lu\n", name, n, info.first_packet,
+				info.last_packet);
+			exit(1);
+		}
+		next = info.last_packet;
+
+		ethstream_volts(es, buf, n, volts);
+		for (i = 0; i < n * BENCH_LIB_CHANNELS; i++) {
+			if (!isfinite(volts[i]) || fabs(volts[i]) > 11) {
+				fprintf(stderr, "%s: bad volts %f\n", name,
+					volts[i]);
+				exit(1);
+			}
+			sink += volts[i];
+		}
+		scans -= n;
+	}
+}
+
+/* Open, start, read, convert, restart and close, as a program using
+   the library would */
+static void library_client(const char *sim, const char *name, int device)
+{
+	struct ethstream_config cfg = {
+		.address = "127.0.0.1",
+		.device = device,
+		.channel_count = BENCH_LIB_CHANNELS,
+		.channel_list = (int[]) {0, 1, 2},
+		.rate = 8000,
+	};
+	struct ethstream *es;
+	double t;
+	int ret, tries;
+	pid_t pid;
+
+	pid = sim_start(sim);
+	ret = ethstream_open(&es, &cfg);
+	if (ret < 0) {
+		fprintf(stderr, "%s: open: %s\n", name, strerror(-ret));
+		sim_stop(pid);
+		exit(1);
+	}
+
+	/* Give the simulator time to listen */
+	for (tries = 0; (ret = ethstream_start(es)) == -ENOTCONN &&
+	     tries < 50; tries++)
+		usleep(100000);
+	if (ret < 0) {
+		fprintf(stderr, "%s: start: %s\n", name, strerror(-ret));
+		goto fail;
+	}
+
+	t = now();
+	library_read(es, name, BENCH_LIB_SCANS);
+	t = now() - t;
+	report(name, (double)BENCH_LIB_SCANS * BENCH_LIB_CHANNELS, t);
+
+	/* A restart counts packets from 0 again */
+	ethstream_stop(es);
+	ret = ethstream_start(es);
+	if (ret < 0) {
+		fprintf(stderr, "%s: restart: %s\n", name, strerror(-ret));
+		goto fail;
+	}
+	library_read(es, name, BENCH_LIB_SCANS / 10);
+
+	ethstream_close(es);
+	sim_stop(pid);
+	return;
+
+ fail:
+	ethstream_close(es);
+	sim_stop(pid);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *ethstream = (argc > 1) ? argv[1] : "./ethstream";
+	const char *ue9_sim = (argc > 2) ? argv[2] : "./ue9-sim";
+	const char *nerdjack_sim = (argc > 3) ? argv[3] : "./nerdjack-sim";
+	int i;
+
+	srand(1);
+	for (i = 0; i < BENCH_SAMPLES; i++)
+		samples[i] = rand() & 0xffff;
+
+	bench_ue9_verify();
+	bench_ue9_convert();
+	bench_nerdjack_unpack();
+	bench_streams(ethstream);
+	bench_latency(ethstream);
+	library_client(ue9_sim, "library ue9 read+volts",
+		       ETHSTREAM_DEVICE_UE9);
+	library_client(nerdjack_sim, "library nerdjack read+volts",
+		       ETHSTREAM_DEVICE_NERDJACK);
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "binary.h"
+
+static void put16(uint8_t * p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t * p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+/* Write a record header followed by its payload */
+static int write_record(struct output *out, int type, const uint8_t * payload,
+			size_t length)
+{
+	uint8_t hdr[4];
+
+	if (length > BINARY_MAX_PAYLOAD) {
+		verb("record too long (%d bytes)\n", (int)length);
+		return -1;
+	}
+
+	hdr[0] = type;
+	hdr[1] = out->tag;
+	put16(hdr + 2, length);
+
+	if (output_write(out, hdr, sizeof(hdr)) < 0)
+		return -1;
+	if (length && output_write(out, payload, length) < 0)
+		return -1;
+	return 0;
+}
+
+int binary_write_header(struct output *out, int device, int channels,
+			int *channel_list, double rate)
+{
+	uint8_t buf[20 + 2 * 256];
+	uint64_t bits;
+	size_t len;
+	int i;
+
+	if (channels > 256)
+		return -1;
+
+	memcpy(buf, "ETHS", 4);
+	put16(buf + 4, BINARY_VERSION);
+	buf[6] = device;
+	buf[7] = BINARY_FORMAT_U16;
+	put16(buf + 8, channels);
+	put16(buf + 10, 0);
+
+	/* IEEE-754 double, little-endian */
+	memcpy(&bits, &rate, sizeof(bits));
+	for (i = 0; i < 8; i++)
+		buf[12 + i] = (bits >> (8 * i)) & 0xff;
+
+	len = 20;
+	for (i = 0; i < channels; i++, len += 2)
+		put16(buf + len, channel_list[i]);
+
+	return write_record(out, BINARY_REC_HEADER, buf, len);
+}
+
+int binary_write_data(struct output *out, const uint16_t * data, int count)
+{
+	uint8_t buf[BINARY_MAX_PAYLOAD];
+	int i;
+
+	if (count * 2 > BINARY_MAX_PAYLOAD)
+		return -1;
+
+	for (i = 0; i < count; i++)
+		put16(buf + 2 * i, data[i]);
+
+	return write_record(out, BINARY_REC_DATA, buf, count * 2);
+}
+
+int binary_write_marker(struct output *out, int type)
+{
+	return write_record(out, type, NULL, 0);
+}
+
+int binary_write_gap(struct output *out, uint32_t packets, uint32_t scans,
+		     uint64_t span_us)
+{
+	uint8_t buf[16];
+
+	put32(buf, packets);
+	put32(buf + 4, scans);
+	put32(buf + 8, span_us & 0xffffffff);
+	put32(buf + 12, span_us >> 32);
+
+	return write_record(out, BINARY_REC_GAP, buf, sizeof(buf));
+}
@@ -0,0 +1,80 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef BINARY_H
+#define BINARY_H
+
+#include <stdint.h>
+
+#include "output.h"
+
+/* Packed binary output format.  All values are little-endian.  The
+   output is a sequence of records, each starting with a 4-byte header:
+
+     uint8_t  type     one of BINARY_REC_*
+     uint8_t  device   device number (0 when streaming a single device)
+     uint16_t length   number of payload bytes following the header
+
+   BINARY_REC_HEADER is written once before the first data record:
+
+     char     magic[4] "ETHS"
+     uint16_t version  BINARY_VERSION
+     uint8_t  type     BINARY_DEVICE_*
+     uint8_t  format   BINARY_FORMAT_*
+     uint16_t channels number of channels per scan
+     uint16_t reserved
+     double   rate     scan rate in Hz
+     uint16_t channel_list[channels]
+
+   BINARY_REC_DATA holds one or more complete scans, packed as
+   uint16_t values in channel_list order.  The number of scans is
+   length / (2 * channels).  Values are the same as the decimal text
+   output.
+
+   BINARY_REC_RESET marks a device reset and BINARY_REC_GAP marks a
+   restarted stream, where data was lost between the surrounding data
+   records.  A gap record may be empty, or measure the gap:
+
+     uint32_t packets  device packets lost
+     uint32_t scans    scans lost, i.e. samples per channel
+     uint64_t span_us  host time between the last packet before the
+                       gap and the first one after it, in microseconds
+
+   Scans written to fill the gap (see -G) follow the gap record as
+   ordinary data records.  Version 1 only had empty gap records. */
+
+#define BINARY_VERSION 2
+
+#define BINARY_REC_HEADER 0x01
+#define BINARY_REC_DATA 0x02
+#define BINARY_REC_RESET 0x03
+#define BINARY_REC_GAP 0x04
+
+#define BINARY_DEVICE_NERDJACK 1
+#define BINARY_DEVICE_UE9 2
+
+#define BINARY_FORMAT_U16 0
+
+#define BINARY_MAX_PAYLOAD 65535
+
+/* Write the stream header record.  Returns < 0 on error. */
+int binary_write_header(struct output *out, int device, int channels,
+			int *channel_list, double rate);
+
+/* Write a data record holding "count" samples.  Returns < 0 on error. */
+int binary_write_data(struct output *out, const uint16_t * data, int count);
+
+/* Write an empty marker record (reset or gap).  Returns < 0 on error. */
+int binary_write_marker(struct output *out, int type);
+
+/* Write a gap record with its measurements.  Returns < 0 on error. */
+int binary_write_gap(struct output *out, uint32_t packets, uint32_t scans,
+		     uint64_t span_us);
+
+#endif
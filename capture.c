@@ -0,0 +1,407 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "compat.h"
+#include "capture.h"
+
+#define CAPTURE_MAGIC "ETHSCAP"
+#define CAPTURE_HEADER 16
+#define CAPTURE_CALIB (sizeof(struct ue9Calibration) / sizeof(double))
+
+static void put16(uint8_t * p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t * p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t * p, uint64_t v)
+{
+	put32(p, v & 0xffffffff);
+	put32(p + 4, v >> 32);
+}
+
+static void put_double(uint8_t * p, double d)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &d, sizeof(bits));
+	put64(p, bits);
+}
+
+static uint16_t get16(const uint8_t * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t * p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t * p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static double get_double(const uint8_t * p)
+{
+	uint64_t bits = get64(p);
+	double d;
+
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+static uint64_t tv_to_us(struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void us_to_tv(uint64_t us, struct timeval *tv)
+{
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+int capture_create(struct capture *c, const char *path)
+{
+	uint8_t magic[8];
+
+	memset(c, 0, sizeof(*c));
+	c->f = fopen(path, "wb");
+	if (c->f == NULL) {
+		info("Can't create %s: %s\n", path, compat_strerror(errno));
+		return -1;
+	}
+	setvbuf(c->f, NULL, _IOFBF, 256 * 1024);
+
+	memcpy(magic, CAPTURE_MAGIC, 7);
+	magic[7] = CAPTURE_VERSION;
+	if (fwrite(magic, sizeof(magic), 1, c->f) != 1) {
+		info("Can't write %s: %s\n", path, compat_strerror(errno));
+		fclose(c->f);
+		c->f = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Read the header of the next record.  At the end of the file, the
+   type is 0. */
+static int read_header(struct capture *c)
+{
+	uint8_t hdr[CAPTURE_HEADER];
+	size_t n = fread(hdr, 1, sizeof(hdr), c->f);
+
+	if (n != sizeof(hdr)) {
+		if (n != 0)
+			info("Capture file is truncated\n");
+		c->type = 0;
+		return (n == 0) ? 0 : -1;
+	}
+	c->type = hdr[0];
+	c->length = get32(hdr + 4);
+	c->time_us = get64(hdr + 8);
+	return 0;
+}
+
+int capture_open(struct capture *c, const char *path, int paced)
+{
+	uint8_t magic[8];
+
+	memset(c, 0, sizeof(*c));
+	c->replay = 1;
+	c->paced = paced;
+	c->end = 1;
+	c->f = fopen(path, "rb");
+	if (c->f == NULL) {
+		info("Can't open %s: %s\n", path, compat_strerror(errno));
+		return -1;
+	}
+	setvbuf(c->f, NULL, _IOFBF, 256 * 1024);
+
+	if (fread(magic, sizeof(magic), 1, c->f) != 1 ||
+	    memcmp(magic, CAPTURE_MAGIC, 7) != 0) {
+		info("%s is not a capture file\n", path);
+		goto fail;
+	}
+	if (magic[7] != CAPTURE_VERSION) {
+		info("%s has unsupported capture version %d\n", path,
+		     magic[7]);
+		goto fail;
+	}
+	if (read_header(c) < 0)
+		goto fail;
+	return 0;
+
+ fail:
+	fclose(c->f);
+	c->f = NULL;
+	return -1;
+}
+
+void capture_close(struct capture *c)
+{
+	if (c->f == NULL)
+		return;
+	if (fclose(c->f) != 0 && !c->replay && !c->failed)
+		info("Capture write failed: %s\n", compat_strerror(errno));
+	c->f = NULL;
+	free(c->data);
+	c->data = NULL;
+}
+
+static int write_record(struct capture *c, int type, const void *payload,
+			size_t length, struct timeval *tv)
+{
+	uint8_t hdr[CAPTURE_HEADER];
+
+	if (c->failed)
+		return -1;
+
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = type;
+	put32(hdr + 4, length);
+	put64(hdr + 8, tv_to_us(tv));
+
+	if (fwrite(hdr, sizeof(hdr), 1, c->f) != 1 ||
+	    (length && fwrite(payload, length, 1, c->f) != 1)) {
+		info("Capture write failed: %s\n", compat_strerror(errno));
+		c->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+int capture_write_stream(struct capture *c, struct capture_stream *cs)
+{
+	uint8_t buf[16 + 4 * CAPTURE_MAX_CHANNELS + 8 * CAPTURE_CALIB];
+	double *calib = (double *)&cs->calib;
+	struct timeval now;
+	size_t len, i;
+
+	if (cs->channel_count > CAPTURE_MAX_CHANNELS ||
+	    cs->gain_count > CAPTURE_MAX_CHANNELS)
+		return -1;
+
+	buf[0] = cs->device;
+	buf[1] = cs->precision;
+	buf[2] = cs->reset;
+	buf[3] = cs->calibrated;
+	put16(buf + 4, cs->channel_count);
+	put16(buf + 6, cs->gain_count);
+	put32(buf + 8, cs->period);
+	put_double(buf + 12, cs->rate);
+
+	len = 20;
+	for (i = 0; i < (size_t)cs->channel_count; i++, len += 2)
+		put16(buf + len, cs->channel_list[i]);
+	for (i = 0; i < (size_t)cs->gain_count; i++, len += 2)
+		put16(buf + len, cs->gain_list[i]);
+	if (cs->calibrated)
+		for (i = 0; i < CAPTURE_CALIB; i++, len += 8)
+			put_double(buf + len, calib[i]);
+
+	/* An update for the last stream is no use to this one */
+	if (cs->calibrated != CAPTURE_CALIB_UPDATE)
+		__atomic_store_n(&c->update_pending, 0, __ATOMIC_RELEASE);
+
+	gettimeofday(&now, NULL);
+	return write_record(c, CAPTURE_REC_STREAM, buf, len, &now);
+}
+
+int capture_update_stream(struct capture *c, struct capture_stream *cs)
+{
+	if (__atomic_load_n(&c->update_pending, __ATOMIC_ACQUIRE))
+		return -1;
+	c->update = *cs;
+	c->update.calibrated = CAPTURE_CALIB_UPDATE;
+	__atomic_store_n(&c->update_pending, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int capture_write_data(struct capture *c, const void *data, size_t len,
+		       struct timeval *tv)
+{
+	/* Updates are written here, so that records only ever come from
+	   the thread receiving the data */
+	if (__atomic_load_n(&c->update_pending, __ATOMIC_ACQUIRE)) {
+		capture_write_stream(c, &c->update);
+		__atomic_store_n(&c->update_pending, 0, __ATOMIC_RELEASE);
+	}
+	return write_record(c, CAPTURE_REC_DATA, data, len, tv);
+}
+
+/* Read the payload of the current record into c->data */
+static int read_payload(struct capture *c)
+{
+	if (c->length > c->size) {
+		uint8_t *p = realloc(c->data, c->length);
+
+		if (p == NULL)
+			return -1;
+		c->data = p;
+		c->size = c->length;
+	}
+	if (c->length && fread(c->data, c->length, 1, c->f) != 1) {
+		info("Capture file is truncated\n");
+		c->type = 0;
+		return -1;
+	}
+	c->len = c->length;
+	c->pos = 0;
+	return 0;
+}
+
+/* Read the payload of the current stream record into cs.  Returns < 0
+   on error. */
+static int read_stream(struct capture *c, struct capture_stream *cs)
+{
+	double *calib = (double *)&cs->calib;
+	uint8_t *p;
+	size_t need, i;
+
+	if (read_payload(c) < 0)
+		return -1;
+	p = c->data;
+	if (c->len < 20)
+		goto bad;
+
+	memset(cs, 0, sizeof(*cs));
+	cs->device = p[0];
+	cs->precision = p[1];
+	cs->reset = p[2];
+	cs->calibrated = p[3];
+	cs->channel_count = get16(p + 4);
+	cs->gain_count = get16(p + 6);
+	cs->period = get32(p + 8);
+	cs->rate = get_double(p + 12);
+
+	need = 20 + 2 * (cs->channel_count + cs->gain_count) +
+	    (cs->calibrated ? 8 * CAPTURE_CALIB : 0);
+	if (cs->channel_count < 1 ||
+	    cs->channel_count > CAPTURE_MAX_CHANNELS ||
+	    cs->gain_count > CAPTURE_MAX_CHANNELS || c->len < need)
+		goto bad;
+
+	p += 20;
+	for (i = 0; i < (size_t)cs->channel_count; i++, p += 2)
+		cs->channel_list[i] = get16(p);
+	for (i = 0; i < (size_t)cs->gain_count; i++, p += 2)
+		cs->gain_list[i] = get16(p);
+	if (cs->calibrated)
+		for (i = 0; i < CAPTURE_CALIB; i++, p += 8)
+			calib[i] = get_double(p);
+	c->len = c->pos = 0;
+	return 0;
+
+ bad:
+	info("Bad stream record in capture file\n");
+	return -1;
+}
+
+int capture_next_stream(struct capture *c, struct capture_stream *cs)
+{
+	for (;;) {
+		/* Skip what is left of the current stream */
+		while (c->type != 0 && c->type != CAPTURE_REC_STREAM) {
+			if (fseek(c->f, c->length, SEEK_CUR) < 0 ||
+			    read_header(c) < 0)
+				return -1;
+		}
+		if (c->type == 0)
+			return 0;
+
+		if (read_stream(c, cs) < 0 || read_header(c) < 0)
+			return -1;
+		if (cs->calibrated != CAPTURE_CALIB_UPDATE)
+			break;
+	}
+
+	/* The stream's data follows */
+	c->end = 0;
+	c->first_us = 0;
+	return 1;
+}
+
+/* Apply the calibration updates at the current record.  A stream
+   record that starts a new stream is left to be read again by
+   capture_next_stream().  Returns < 0 on error. */
+static int read_updates(struct capture *c)
+{
+	struct capture_stream cs;
+
+	while (c->type == CAPTURE_REC_STREAM) {
+		if (read_stream(c, &cs) < 0)
+			return -1;
+		if (cs.calibrated != CAPTURE_CALIB_UPDATE) {
+			if (fseek(c->f, -(long)c->length, SEEK_CUR) < 0)
+				return -1;
+			break;
+		}
+		if (c->calib_changed)
+			c->calib_changed(&cs.calib, c->context);
+		if (read_header(c) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+ssize_t capture_read(struct capture *c, void *buf, size_t len,
+		     struct timeval *tv)
+{
+	if (c->pos == c->len) {
+		if (!c->end && read_updates(c) < 0)
+			return -1;
+		if (c->end || c->type != CAPTURE_REC_DATA) {
+			c->end = 1;
+			return 0;
+		}
+		c->stamp = c->time_us;
+		if (read_payload(c) < 0 || read_header(c) < 0)
+			return -1;
+		if (c->first_us == 0) {
+			c->first_us = c->stamp;
+			gettimeofday(&c->start, NULL);
+		}
+	}
+
+	if (len > c->len - c->pos)
+		len = c->len - c->pos;
+	memcpy(buf, c->data + c->pos, len);
+	c->pos += len;
+	us_to_tv(c->stamp, tv);
+	return len;
+}
+
+long capture_due(struct capture *c, struct timeval *tv)
+{
+	struct timeval now;
+	int64_t due;
+
+	if (!c->paced || c->first_us == 0)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	due = (int64_t)(tv_to_us(tv) - c->first_us) -
+	    (int64_t)(tv_to_us(&now) - tv_to_us(&c->start));
+	return (due > 0) ? (long)due : 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "ue9.h"
+
+/* Raw capture of the data connection, so that a stream can be
+   processed again later.  All values are little-endian.  The file
+   starts with the 8 bytes "ETHSCAP" and CAPTURE_VERSION, followed by
+   records with a 16-byte header:
+
+     uint8_t  type     one of CAPTURE_REC_*
+     uint8_t  reserved[3]
+     uint32_t length   number of payload bytes following the header
+     uint64_t time_us  host time the record was written, in
+                       microseconds since the epoch
+
+   CAPTURE_REC_STREAM starts each data connection, and describes
+   everything needed to make sense of the data that follows:
+
+     uint8_t  device     BINARY_DEVICE_*
+     uint8_t  precision  NerdJack range bits
+     uint8_t  reset      NerdJack was reset before this stream
+     uint8_t  calibrated UE9 calibration follows the lists
+     uint16_t channels
+     uint16_t gains
+     uint32_t period     NerdJack clock ticks per scan
+     double   rate       scan rate in Hz
+     uint16_t channel_list[channels]
+     uint16_t gain_list[gains]
+     double   calib[]    struct ue9Calibration, in field order
+
+   A stream record with calibrated set to CAPTURE_CALIB_UPDATE does
+   not start a stream: the UE9 calibration in it replaces that of the
+   stream in progress, whose data carries on after it.
+
+   CAPTURE_REC_DATA holds exactly the bytes of one recv() on the data
+   connection, with the time they were received. */
+
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_REC_STREAM 0x01
+#define CAPTURE_REC_DATA 0x02
+
+#define CAPTURE_MAX_CHANNELS 256
+
+#define CAPTURE_CALIB_UPDATE 2
+
+/* Parameters of one recorded stream */
+struct capture_stream {
+	int device;
+	int precision;
+	int reset;
+	int calibrated;
+	int channel_count;
+	int channel_list[CAPTURE_MAX_CHANNELS];
+	int gain_count;
+	int gain_list[CAPTURE_MAX_CHANNELS];
+	unsigned long period;
+	double rate;
+	struct ue9Calibration calib;
+};
+
+struct capture {
+	FILE *f;
+	int replay;		/* reading, not writing */
+	int paced;		/* replay at the recorded pace */
+	int failed;		/* a write failed, stop recording */
+	struct capture_stream update;	/* written before the next data */
+	int update_pending;
+
+	/* Replay state */
+	int type;		/* next record, 0 at the end of the file */
+	uint32_t length;
+	uint64_t time_us;
+	uint8_t *data;		/* payload of the current data record */
+	size_t size, len, pos;
+	uint64_t stamp;		/* its time */
+	int end;		/* current stream has no more data */
+	uint64_t first_us;	/* pacing: first record of the stream */
+	struct timeval start;	/* and when it was replayed */
+
+	/* Called with each calibration update as it is replayed, from
+	   the thread calling capture_read() */
+	void (*calib_changed) (struct ue9Calibration * calib, void *context);
+	void *context;
+};
+
+/* Create a capture file.  Returns < 0 on error. */
+int capture_create(struct capture *c, const char *path);
+
+/* Open a capture file for replay.  Returns < 0 on error. */
+int capture_open(struct capture *c, const char *path, int paced);
+
+void capture_close(struct capture *c);
+
+/* Record the start of a stream.  Returns < 0 on error. */
+int capture_write_stream(struct capture *c, struct capture_stream *cs);
+
+/* Record a calibration update for the stream in progress, from any
+   thread.  It is written just before the data that follows, or
+   dropped if the stream ends first.  Returns < 0 if the last update
+   hasn't been written yet. */
+int capture_update_stream(struct capture *c, struct capture_stream *cs);
+
+/* Record bytes received at time tv.  After the first error, nothing
+   more is written.  Returns < 0 on error. */
+int capture_write_data(struct capture *c, const void *data, size_t len,
+		       struct timeval *tv);
+
+/* Skip to the next recorded stream and read its parameters.  Returns
+   1 if there is one, 0 at the end of the file, or < 0 on error. */
+int capture_next_stream(struct capture *c, struct capture_stream *cs);
+
+/* Read up to len bytes of the current stream, with the time they were
+   received.  Calibration updates on the way go to calib_changed.
+   Returns the number of bytes, 0 at the end of the stream, or < 0 on
+   error. */
+ssize_t capture_read(struct capture *c, void *buf, size_t len,
+		     struct timeval *tv);
+
+/* Microseconds until data received at tv is due, when pacing */
+long capture_due(struct capture *c, struct timeval *tv);
+
+#endif
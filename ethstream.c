@@ -12,11 +12,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <signal.h>
 #include <unistd.h>
+#ifndef __WIN32__
+#include <pthread.h>
+#else
+#include <io.h>
+#endif
 #include "debug.h"
 #include "ue9.h"
 #include "ue9error.h"
@@ -25,23 +31,103 @@
 #include "version.h"
 #include "compat.h"
 #include "ethstream.h"
+#include "binary.h"
+#include "format.h"
+#include "output.h"
+#include "ue9cache.h"
+#include "watchdog.h"
+#include "capture.h"
+#include "prof.h"
+#include "metrics.h"
+#include "shmring.h"
 
 #include "example.inc"
 
 #define DEFAULT_HOST "192.168.1.209"
-#define UE9_COMMAND_PORT 52360
-#define UE9_DATA_PORT 52361
 
 #define MAX_CHANNELS 256
+#define MAX_DEVICES 16
+
+/* How long to wait for the other devices after a signal, in 100 ms
+   steps, before giving up on them */
+#define STOP_WAIT 20
+
+/* Acquisition options, shared by all devices */
+struct config {
+	double desired_rate;
+	int lines;
+	int oneshot;
+	int forceretry;
+	int convert;
+	int showmem;
+	int precision;
+	int fill;
+	uint16_t fill_value;
+	int timer_mode_list[UE9_TIMERS];
+	int timer_value_list[UE9_TIMERS];
+	int timer_mode_count;
+	int timer_divisor;
+	int gain_list[MAX_CHANNELS];
+	int gain_count;
+	int channel_list[MAX_CHANNELS];
+	int channel_count;
+};
+
+/* One device being streamed, and everything that has to survive a
+   retry of its stream */
+struct stream {
+	int index;		/* device number */
+	char *address;
+	int addressSpecified;
+	int nerdjack;		/* device type forced with -N or N: */
+	int labjack;		/* device type forced with -L or L: */
+	int detect;
+	struct output out;
+	struct capture capture;	/* recorded with -w or replayed with -p */
+	struct capture *cap;	/* &capture, or NULL if not used */
+	struct metrics metrics;
+	char shm_name[256];	/* ring to publish to with -s, or "" */
+	struct shmring shm;
+	struct shmring *ring;	/* &shm once created, or NULL */
+
+	/* NerdJack */
+	struct nerd_session nerd_cmd;
+	int nerd_first_call;
+	int nerd_started;
+	struct nerd_state nerd;
+
+	/* LabJack, visible to handle_sig for a clean shutdown */
+	int ue9_first_call;
+	int fd_cmd, fd_data;
+	int ue9_running;	/* currently streaming data */
+	struct ue9_refresh ue9_refresh;
+	int ue9_refreshing;	/* ue9_refresh may be using fd_cmd */
+	int ue9_lines;
+	int columns_left;
+
+	int binary_started;
+	int stop;		/* asked to finish by the main thread */
+	int result;
+#ifndef __WIN32__
+	pthread_t thread;
+	int done;
+#endif
+};
 
 struct callbackInfo {
 	struct ue9Calibration calib;
+	struct ue9Conversion *conv;	/* one of conv_buf */
+	struct ue9Conversion conv_buf[2][UE9_MAX_CHANNEL_COUNT];
+	struct ue9_setup setup;
+	int setup_reported;
 	int convert;
 	int maxlines;
+	struct stream *stream;
 };
 
 struct options opt[] = {
-	{'a', "address", "string", "host/address of device (192.168.1.209)"},
+	{'a', "address", "string", "host/address of device (192.168.1.209); "
+	 "repeat for more devices, prefix with N: or L: to force the type"},
 	{'n', "numchannels", "n", "sample the first N ADC channels (2)"},
 	{'C', "channels", "a,b,c", "sample channels a, b, and c"},
 	{'r', "rate", "hz", "sample each channel at this rate (8000.0)"},
@@ -59,8 +145,26 @@ struct options opt[] = {
 	{'f', "forceretry", NULL, "retry no matter what happens"},
 	{'c', "convert", NULL, "convert output to volts/temperature"},
 	{'H', "converthex", NULL, "convert output to hex"},
+	{'B', "binary", NULL, "output packed little-endian binary records"},
+	{'G', "gapfill", "n", "fill samples lost to a NerdJack reset with "
+	 "raw value n (nan with -c)"},
 	{'m', "showmem", NULL, "output memory stats with data (NJ only)"},
 	{'l', "lines", "num", "if set, output this many lines and quit"},
+	{'F', "flush-ms", "ms", "flush output at least this often, 0 when full (50)"},
+	{'O', "output", "file", "write to file instead of stdout; %d becomes the "
+	 "device number"},
+	{'w', "record", "file", "also record the raw data received to file; "
+	 "%d becomes the device number"},
+	{'p', "replay", "file", "process data recorded with -w instead of "
+	 "streaming from a device"},
+	{'P', "pace", NULL, "replay at the recorded pace, not as fast as "
+	 "possible"},
+	{'S', "profile", NULL, "time each stage of the data path, report on "
+	 "exit and SIGUSR1"},
+	{'M', "metrics", "path", "serve counters for each device on a Unix "
+	 "socket at path"},
+	{'s', "shm", "name", "also publish raw scans to a POSIX shared memory "
+	 "ring; %d becomes the device number"},
 	{'h', "help", NULL, "this help"},
 	{'v', "verbose", NULL, "be verbose"},
 	{'V', "version", NULL, "show version number and exit"},
@@ -69,50 +173,192 @@ struct options opt[] = {
 	{0, NULL, NULL, NULL}
 };
 
-int doStream(const char *address, uint8_t scanconfig, uint16_t scaninterval,
-	     int *channel_list, int channel_count, 
-	     int *timer_mode_list, int *timer_value_list,
-	     int timer_mode_count, int timer_divisor,
-	     int *gain_list, int gain_count,  
-	     int convert, int maxlines);
-int nerdDoStream(const char *address, int *channel_list, int channel_count,
-		 int precision, unsigned long period, int convert, int lines,
-		 int showmem);
-int data_callback(int channels,  int *channel_list, int gain_count, int *gain_list, 
-		uint16_t * data, void *context);
-
-int columns_left = 0;
-
-////////EXTRA GLOBAL VARS///////////
-//  for clean shutdown            //
-//  added by John Donnal 2015     //
-////////////////////////////////////
-int fd_cmd, fd_data;
-int ue9_running = 0; //flag if labjack is currently streaming data
+int stream_run(struct stream *s);
+int replay_run(struct stream *s);
+int doStream(struct stream *s, uint8_t scanconfig, uint16_t scaninterval);
+int nerdDoStream(struct stream *s, unsigned long period);
+int data_callback(struct ue9_scan_block *block, void *context);
+void calibration_changed(struct ue9Calibration *calib, void *context);
+
+struct config cfg = {
+	.desired_rate = 8000.0,
+	.convert = CONVERT_DEC,
+	.timer_divisor = 1,
+};
+struct stream streams[MAX_DEVICES];
+int stream_count = 0;
+
+/******************************************************
+ *         added by John Donnal 2015                  *
+ * Close out connection to LabJack, firmware glitches *
+ * if the stream is not closed correctly              *
+ ******************************************************/
+void stream_shutdown(struct stream *s)
+{
+	if (s->ue9_running == 1) {
+		info("Performing clean shutdown of LabJack\n");
+		if (__atomic_load_n(&s->ue9_refreshing, __ATOMIC_ACQUIRE))
+			ue9_refresh_release(&s->ue9_refresh);
+		ue9_stream_stop(s->fd_cmd);
+		ue9_buffer_flush(s->fd_cmd);
+		ue9_close(s->fd_data);
+		ue9_close(s->fd_cmd);
+	}
+}
 
+/* Used when streaming a single device on the main thread */
 void handle_sig(int sig)
 {
-	while (columns_left--) {
-		printf(" 0");
-	}
-
-	/******************************************************
-	 *         added by John Donnal 2015                  *
-	 * Close out connection to LabJack, firmware glitches *
-	 * if the stream is not closed correctly              *
-	 ******************************************************/
-	if(ue9_running==1){
-	  printf("Performing clean shutdown of LabJack\n");
-	  ue9_stream_stop(fd_cmd);
-	  ue9_buffer_flush(fd_cmd);
-	  ue9_close(fd_data);
-	  ue9_close(fd_cmd);
-	}
-	/******************************************************/
-	fflush(stdout);
+	struct stream *s = &streams[0];
+
+	while (s->columns_left--) {
+		output_write(&s->out, " 0", 2);
+	}
+
+	stream_shutdown(s);
+	output_flush(&s->out);
 	exit(0);
 }
 
+/* Per-stage timing report, with -S */
+static void prof_signal(int sig)
+{
+	prof_report(STDERR_FILENO);
+}
+
+static void prof_exit(void)
+{
+	prof_report(STDERR_FILENO);
+}
+
+/* Create the shared memory ring for s, with the channels now in
+   cfg.  Returns < 0 on error. */
+static int stream_ring(struct stream *s)
+{
+	if (s->ring || s->shm_name[0] == '\0')
+		return 0;
+	if (shmring_create(&s->shm, s->shm_name, cfg.channel_count,
+			   cfg.channel_list, SHMRING_SCANS) < 0)
+		return -1;
+	s->ring = &s->shm;
+	s->nerd.shm = s->ring;
+	return 0;
+}
+
+/* Remove the shared memory rings, also when exiting from a signal */
+static void shm_exit(void)
+{
+	int i;
+
+	for (i = 0; i < stream_count; i++)
+		shmring_close(&streams[i].shm);
+}
+
+#ifndef __WIN32__
+static void *stream_thread(void *arg)
+{
+	struct stream *s = arg;
+
+	s->result = stream_run(s);
+	__atomic_store_n(&s->done, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/* Stream every device on its own thread.  Signals are taken here
+   instead of in handle_sig, and ask the threads to finish at the end
+   of their current packet.  Returns the first error from stream_run. */
+static int run_threads(void)
+{
+	sigset_t set;
+	struct timespec ts = {.tv_sec = 0,.tv_nsec = 100000000 };
+	int i, running, stopping = 0, waited = 0;
+	int retval = 0;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; i < stream_count; i++) {
+		if (pthread_create(&streams[i].thread, NULL, stream_thread,
+				   &streams[i]) != 0) {
+			info("Can't create thread for %s\n",
+			     streams[i].address);
+			streams[i].result = -1;
+			streams[i].done = 1;
+			streams[i].thread = pthread_self();
+		}
+	}
+
+	for (;;) {
+		running = 0;
+		for (i = 0; i < stream_count; i++)
+			if (!__atomic_load_n(&streams[i].done,
+					     __ATOMIC_SEQ_CST))
+				running++;
+		if (running == 0)
+			break;
+
+		if (sigtimedwait(&set, NULL, &ts) > 0 && !stopping) {
+			info("Stopping %d device%s\n", running,
+			     running == 1 ? "" : "s");
+			stopping = 1;
+			for (i = 0; i < stream_count; i++) {
+				__atomic_store_n(&streams[i].stop, 1,
+						 __ATOMIC_SEQ_CST);
+				__atomic_store_n(&streams[i].nerd.stop, 1,
+						 __ATOMIC_SEQ_CST);
+			}
+		}
+
+		if (stopping && ++waited > STOP_WAIT) {
+			/* Devices that stopped sending can't be waited
+			   for, but their output up to the last retry has
+			   already been written */
+			for (i = 0; i < stream_count; i++)
+				if (!__atomic_load_n(&streams[i].done,
+						     __ATOMIC_SEQ_CST))
+					stream_shutdown(&streams[i]);
+			exit(0);
+		}
+	}
+
+	for (i = 0; i < stream_count; i++) {
+		if (!pthread_equal(streams[i].thread, pthread_self()))
+			pthread_join(streams[i].thread, NULL);
+		if (streams[i].result < 0 && retval == 0)
+			retval = streams[i].result;
+	}
+	return retval;
+}
+#endif
+
+/* File name for device "index", replacing the first %d in name with
+   the device number */
+static void device_path(char *path, size_t len, const char *name, int index)
+{
+	const char *p = strstr(name, "%d");
+
+	if (p == NULL)
+		snprintf(path, len, "%s", name);
+	else
+		snprintf(path, len, "%.*s%d%s", (int)(p - name), name, index,
+			 p + 2);
+}
+
+/* Open the output file for device "index" */
+static int open_output(const char *name, int index)
+{
+	char path[4096];
+	int fd;
+
+	device_path(path, sizeof(path), name, index);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		info("Can't open %s: %s\n", path, compat_strerror(errno));
+	return fd;
+}
+
 int main(int argc, char *argv[])
 {
 	int optind;
@@ -120,54 +366,50 @@ int main(int argc, char *argv[])
 	char c;
 	int tmp, i;
 	FILE *help = stderr;
-	char *address = strdup(DEFAULT_HOST);
-	double desired_rate = 8000.0;
-	int lines = 0;
-	double actual_rate;
-	int oneshot = 0;
-	int forceretry = 0;
-	int convert = CONVERT_DEC;
-	int showmem = 0;
+	char *address_list[MAX_DEVICES];
+	int address_count = 0;
+	char *outname = NULL;
+	char *recordname = NULL;
+	char *replayname = NULL;
+	char *metricsname = NULL;
+	char *shmname = NULL;
+	struct metrics *metrics_list[MAX_DEVICES];
+	int paced = 0;
+	int flush_ms = OUTPUT_FLUSH_MS;
 	int inform = 0;
-	uint8_t scanconfig;
-	uint16_t scaninterval;
-	int timer_mode_list[UE9_TIMERS];
-	int timer_value_list[UE9_TIMERS];
-	int timer_mode_count = 0;
-	int timer_divisor = 1;
-	int gain_list[MAX_CHANNELS];
-	int gain_count = 0;
-	int channel_list[MAX_CHANNELS];
-	int channel_count = 0;
 	int nerdjack = 0;
 	int labjack = 0;
 	int detect = 0;
-	int precision = 0;
-	int addressSpecified = 0;
-	int donerdjack = 0;
-	unsigned long period = NERDJACK_CLOCK_RATE / desired_rate;
+	int addressSpecified;
+	int fd, shared;
+	int ret = 0;
+#ifndef __WIN32__
+	pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 	/* Parse arguments */
 	opt_init(&optind);
 	while ((c = opt_parse(argc, argv, &optind, &optarg, opt)) != 0) {
 		switch (c) {
 		case 'a':
-			free(address);
-			address = strdup(optarg);
-			addressSpecified = 1;
+			if (address_count >= MAX_DEVICES) {
+				info("error: too many devices specified\n");
+				goto printhelp;
+			}
+			address_list[address_count++] = optarg;
 			break;
 		case 'n':
-			channel_count = 0;
+			cfg.channel_count = 0;
 			tmp = strtol(optarg, &endp, 0);
 			if (*endp || tmp < 1 || tmp > MAX_CHANNELS) {
 				info("bad number of channels: %s\n", optarg);
 				goto printhelp;
 			}
 			for (i = 0; i < tmp; i++)
-				channel_list[channel_count++] = i;
+				cfg.channel_list[cfg.channel_count++] = i;
 			break;
 		case 'C':
-			channel_count = 0;
+			cfg.channel_count = 0;
 			do {
 				tmp = strtol(optarg, &endp, 0);
 				if (*endp != '\0' && *endp != ',') {
@@ -179,17 +421,17 @@ int main(int argc, char *argv[])
 				//The rest of the sanity checking can come later after we know
 				//whether this is a 
 				//LabJack or a NerdJack
-				if (channel_count >= MAX_CHANNELS) {
+				if (cfg.channel_count >= MAX_CHANNELS) {
 					info("error: too many channels specified\n");
 					goto printhelp;
 				}
-				channel_list[channel_count++] = tmp;
+				cfg.channel_list[cfg.channel_count++] = tmp;
 				optarg = endp + 1;
 			}
 			while (*endp);
 			break;
 		case 'g':	/* labjack only */
-			gain_count = 0;
+			cfg.gain_count = 0;
 			do {
 				tmp = strtol(optarg, &endp, 0);
 				if (*endp != '\0' && *endp != ',') {
@@ -197,7 +439,7 @@ int main(int argc, char *argv[])
 					     optarg);
 					goto printhelp;
 				}
-				if (gain_count >= MAX_CHANNELS) {
+				if (cfg.gain_count >= MAX_CHANNELS) {
 					info("error: too many gains specified\n");
 					goto printhelp;
 				}
@@ -206,13 +448,13 @@ int main(int argc, char *argv[])
 					goto printhelp;
 				}
 								
-				gain_list[gain_count++] = tmp;
+				cfg.gain_list[cfg.gain_count++] = tmp;
 				optarg = endp + 1;
 			}
 			while (*endp);
 			break;
 		case 't':	/* labjack only */
-			timer_mode_count = 0;
+			cfg.timer_mode_count = 0;
 			do {
 				/* get mode */
 				tmp = strtol(optarg, &endp, 0);
@@ -220,11 +462,11 @@ int main(int argc, char *argv[])
 					info("bad timer mode: %s\n", optarg);
 					goto printhelp;
 				}
-				if (timer_mode_count >= UE9_TIMERS) {
+				if (cfg.timer_mode_count >= UE9_TIMERS) {
 					info("error: too many timers specified\n");
 					goto printhelp;
 				}
-				timer_mode_list[timer_mode_count] = tmp;
+				cfg.timer_mode_list[cfg.timer_mode_count] = tmp;
 
 				/* get optional value */
 				if (*endp == ':') {
@@ -234,37 +476,74 @@ int main(int argc, char *argv[])
 						info("bad timer value: %s\n", optarg);
 						goto printhelp;
 					}
-					timer_value_list[timer_mode_count] = tmp;
+					cfg.timer_value_list[cfg.timer_mode_count] = tmp;
 				} else {
-					timer_value_list[timer_mode_count] = 0;
+					cfg.timer_value_list[cfg.timer_mode_count] = 0;
 				}
 
-				timer_mode_count++;					
+				cfg.timer_mode_count++;					
 				optarg = endp + 1;
 			}
 			while (*endp);
 			break;
 		case 'T':	/* labjack only */
-			timer_divisor = strtod(optarg, &endp);
-			if (*endp || timer_divisor < 0 || timer_divisor > 255) {
+			cfg.timer_divisor = strtod(optarg, &endp);
+			if (*endp || cfg.timer_divisor < 0 || cfg.timer_divisor > 255) {
 				info("bad timer divisor: %s\n", optarg);
 				goto printhelp;
 			}
 			break;
 		case 'r':
-			desired_rate = strtod(optarg, &endp);
-			if (*endp || desired_rate <= 0) {
+			cfg.desired_rate = strtod(optarg, &endp);
+			if (*endp || cfg.desired_rate <= 0) {
 				info("bad rate: %s\n", optarg);
 				goto printhelp;
 			}
 			break;
 		case 'l':
-			lines = strtol(optarg, &endp, 0);
-			if (*endp || lines <= 0) {
+			cfg.lines = strtol(optarg, &endp, 0);
+			if (*endp || cfg.lines <= 0) {
 				info("bad number of lines: %s\n", optarg);
 				goto printhelp;
 			}
 			break;
+		case 'F':
+			flush_ms = strtol(optarg, &endp, 0);
+			if (*endp || flush_ms < 0) {
+				info("bad flush interval: %s\n", optarg);
+				goto printhelp;
+			}
+			break;
+		case 'O':
+			outname = optarg;
+			break;
+		case 'w':
+			recordname = optarg;
+			break;
+		case 'p':
+			replayname = optarg;
+			break;
+		case 'P':
+			paced++;
+			break;
+		case 'S':
+			prof_enable();
+			break;
+		case 'M':
+			metricsname = optarg;
+			break;
+		case 's':
+			shmname = optarg;
+			break;
+		case 'G':
+			tmp = strtol(optarg, &endp, 0);
+			if (*endp || tmp < 0 || tmp > 65535) {
+				info("bad gap fill value: %s\n", optarg);
+				goto printhelp;
+			}
+			cfg.fill = 1;
+			cfg.fill_value = tmp;
+			break;
 		case 'R':
 			tmp = strtol(optarg, &endp, 0);
 			if (*endp != ',') {
@@ -276,7 +555,7 @@ int main(int argc, char *argv[])
 				goto printhelp;
 			}
 			if (tmp == 5)
-				precision = precision + 1;
+				cfg.precision = cfg.precision + 1;
 
 			optarg = endp + 1;
 			if (*endp == '\0') {
@@ -293,7 +572,7 @@ int main(int argc, char *argv[])
 				goto printhelp;
 			}
 			if (tmp == 5)
-				precision = precision + 2;
+				cfg.precision = cfg.precision + 2;
 			break;
 		case 'N':
 			nerdjack++;
@@ -305,27 +584,34 @@ int main(int argc, char *argv[])
 			detect++;
 			break;
 		case 'o':
-			oneshot++;
+			cfg.oneshot++;
 			break;
 		case 'f':
-			forceretry++;
+			cfg.forceretry++;
 			break;
 		case 'c':
-			if (convert != 0) {
+			if (cfg.convert != 0) {
 				info("specify only one conversion type\n");
 				goto printhelp;
 			}
-			convert = CONVERT_VOLTS;
+			cfg.convert = CONVERT_VOLTS;
 			break;
 		case 'H':
-			if (convert != 0) {
+			if (cfg.convert != 0) {
 				info("specify only one conversion type\n");
 				goto printhelp;
 			}
-			convert = CONVERT_HEX;
+			cfg.convert = CONVERT_HEX;
+			break;
+		case 'B':
+			if (cfg.convert != 0) {
+				info("specify only one conversion type\n");
+				goto printhelp;
+			}
+			cfg.convert = CONVERT_BINARY;
 			break;
 		case 'm':
-			showmem++;
+			cfg.showmem++;
 		case 'v':
 			verb_count++;
 			break;
@@ -356,6 +642,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	addressSpecified = (address_count > 0);
+
 	if (detect && labjack) {
 		info("The LabJack does not support autodetection\n");
 		goto printhelp;
@@ -376,23 +664,48 @@ int main(int argc, char *argv[])
 		goto printhelp;
 	}
 
-	donerdjack = nerdjack;
-
-	//First if no options were supplied try the Nerdjack
-	//The second time through, donerdjack will be true and this will not fire
-	if (!nerdjack && !labjack) {
-		info("No device specified...Defaulting to Nerdjack\n");
-		donerdjack = 1;
+	if (address_count == 0)
+		address_list[address_count++] = DEFAULT_HOST;
+
+	/* Set up a stream for each device */
+	for (i = 0; i < address_count; i++) {
+		struct stream *s = &streams[stream_count++];
+		char *a = address_list[i];
+
+		memset(s, 0, sizeof(*s));
+		s->index = i;
+		s->nerdjack = nerdjack;
+		s->labjack = labjack;
+		if (strncmp(a, "N:", 2) == 0) {
+			s->nerdjack = 1;
+			s->labjack = 0;
+			a += 2;
+		} else if (strncmp(a, "L:", 2) == 0) {
+			s->nerdjack = 0;
+			s->labjack = 1;
+			a += 2;
+		}
+		s->address = strdup(a);
+		s->addressSpecified = addressSpecified;
+		s->detect = detect;
+		s->nerd_first_call = 1;
+		s->ue9_first_call = 1;
+		s->nerd.fill = cfg.fill;
+		s->nerd.fill_value = cfg.fill_value;
+		nerd_session_init(&s->nerd_cmd);
 	}
 
- doneparse:
-
 	if (inform) {
+		char *address = streams[0].address;
+		char version[200];
+
 		//We just want information from NerdJack
 		if (!detect) {
-			if (nerd_get_version(address) < 0) {
+			if (nerd_get_version(address, version,
+					     sizeof(version)) < 0) {
 				info("Could not find NerdJack at specified address\n");
 			} else {
+				printf("%s\n", version);
 				return 0;
 			}
 		}
@@ -403,209 +716,461 @@ int main(int argc, char *argv[])
 			goto printhelp;
 		} else {
 			info("Found NerdJack at address: %s\n", address);
-			if (nerd_get_version(address) < 0) {
+			if (nerd_get_version(address, version,
+					     sizeof(version)) < 0) {
 				info("Error getting NerdJack version\n");
 				goto printhelp;
 			}
+			printf("%s\n", version);
 			return 0;
 		}
 	}
 
-	if (donerdjack) {
-		if (channel_count > NERDJACK_CHANNELS) {
-			info("Too many channels for NerdJack\n");
-			goto printhelp;
-		}
-		for (i = 0; i < channel_count; i++) {
-			if (channel_list[i] >= NERDJACK_CHANNELS) {
-				info("Channel is out of NerdJack range: %d\n",
-				     channel_list[i]);
-				goto printhelp;
-			}
-		}
-	} else {
-		if (channel_count > UE9_MAX_CHANNEL_COUNT) {
-			info("Too many channels for LabJack\n");
-			goto printhelp;
-		}
-		for (i = 0; i < channel_count; i++) {
-			if (channel_list[i] > UE9_MAX_CHANNEL) {
-				info("Channel is out of LabJack range: %d\n",
-				     channel_list[i]);
-				goto printhelp;
-			}
-		}
+	if (optind < argc) {
+		info("error: too many arguments (%s)\n\n", argv[optind]);
+		goto printhelp;
 	}
-	
-	/* Timer requires Labjack */
-	if (timer_mode_count && !labjack) {
-		info("Can't use timers on NerdJack\n");
+
+	if (cfg.showmem && cfg.convert == CONVERT_BINARY) {
+		info("showmem and binary options are mutually exclusive\n");
 		goto printhelp;
 	}
 
-	/* Individual Analog Channel Gain Set requires Labjack*/
-	if (gain_count && !labjack) {
-		info("Can't use Individual Gain Set on NerdJack\n");
+	if (cfg.forceretry && cfg.oneshot) {
+		info("forceretry and oneshot options are mutually exclusive\n");
 		goto printhelp;
 	}
 
-	if (optind < argc) {
-		info("error: too many arguments (%s)\n\n", argv[optind]);
+	if (replayname && (recordname || stream_count > 1)) {
+		info("replay is for a single capture, without recording\n");
 		goto printhelp;
 	}
 
-	if (forceretry && oneshot) {
-		info("forceretry and oneshot options are mutually exclusive\n");
+	if (paced && !replayname) {
+		info("pace only applies to replay\n");
 		goto printhelp;
 	}
 
+	if (recordname && stream_count > 1 && !strstr(recordname, "%d")) {
+		info("Several devices need a capture file each (-w name%%d)\n");
+		goto printhelp;
+	}
+
+	if (shmname && stream_count > 1 && !strstr(shmname, "%d")) {
+		info("Several devices need a shared memory ring each "
+		     "(-s name%%d)\n");
+		goto printhelp;
+	}
+
+	/* Several devices either get a file each, or share one output,
+	   which only works for the tagged binary records */
+	shared = (stream_count > 1 &&
+		  (outname == NULL || strstr(outname, "%d") == NULL));
+	if (shared && cfg.convert != CONVERT_BINARY) {
+		info("Several devices need binary output (-B) or an "
+		     "output file per device (-O name%%d)\n");
+		goto printhelp;
+	}
+#ifdef __WIN32__
+	if (stream_count > 1) {
+		info("Streaming several devices is not supported on Windows\n");
+		goto printhelp;
+	}
+#endif
+
 	/* Two channels if none specified */
-	if (channel_count == 0) {
-		channel_list[channel_count++] = 0;
-		channel_list[channel_count++] = 1;
+	if (cfg.channel_count == 0) {
+		cfg.channel_list[cfg.channel_count++] = 0;
+		cfg.channel_list[cfg.channel_count++] = 1;
 	}
 
 	if (verb_count) {
 		info("Scanning channels:");
-		for (i = 0; i < channel_count; i++)
-			info_no_timestamp(" AIN%d", channel_list[i]);
+		for (i = 0; i < cfg.channel_count; i++)
+			info_no_timestamp(" AIN%d", cfg.channel_list[i]);
 		info_no_timestamp("\n");
 	}
 
+	for (i = 0; i < stream_count; i++) {
+		struct stream *s = &streams[i];
+
+		if (outname == NULL)
+			fd = STDOUT_FILENO;
+		else if (i > 0 && shared)
+			fd = streams[0].out.fd;
+		else if ((fd = open_output(outname, i)) < 0)
+			return 1;
+#ifdef __WIN32__
+		/* Text mode would turn every 0x0a in the records into
+		   CR LF */
+		if (cfg.convert == CONVERT_BINARY)
+			_setmode(fd, _O_BINARY);
+#endif
+
+		if (output_init(&s->out, fd, flush_ms) < 0) {
+			info("error: can't allocate output buffers\n");
+			return 1;
+		}
+#ifndef __WIN32__
+		if (shared)
+			output_share(&s->out, &output_lock, i);
+#endif
+		metrics_init(&s->metrics, i, s->address, &s->out);
+		s->nerd.metrics = &s->metrics;
+		metrics_list[i] = &s->metrics;
+	}
+
+	if (metricsname &&
+	    metrics_serve(metricsname, metrics_list, stream_count) < 0)
+		return 1;
+
+	for (i = 0; i < stream_count; i++) {
+		struct stream *s = &streams[i];
+		char path[4096];
+
+		if (replayname) {
+			if (capture_open(&s->capture, replayname, paced) < 0)
+				return 1;
+		} else if (recordname) {
+			device_path(path, sizeof(path), recordname, i);
+			if (capture_create(&s->capture, path) < 0)
+				return 1;
+		} else {
+			continue;
+		}
+		s->cap = &s->capture;
+		s->nerd.capture = s->cap;
+	}
+
+	/* A replay only knows its channels once it starts */
+	for (i = 0; shmname && i < stream_count; i++) {
+		struct stream *s = &streams[i];
+
+		device_path(s->shm_name, sizeof(s->shm_name), shmname, i);
+		if (!replayname && stream_ring(s) < 0)
+			return 1;
+	}
+	if (shmname)
+		atexit(shm_exit);
+
+	if (prof_enabled) {
+		atexit(prof_exit);
+#ifdef SIGUSR1
+		signal(SIGUSR1, prof_signal);
+#endif
+	}
+
+#ifdef SIGPIPE /* not on Windows */
+	/* Ignore SIGPIPE so I/O errors to the network device won't kill the process */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	if (stream_count == 1) {
+		signal(SIGINT, handle_sig);
+		signal(SIGTERM, handle_sig);
+		if (replayname)
+			ret = replay_run(&streams[0]);
+		else
+			ret = stream_run(&streams[0]);
+	} else {
+#ifndef __WIN32__
+		ret = run_threads();
+#endif
+	}
+
+	debug("Done loop\n");
+
+	for (i = 0; i < stream_count; i++) {
+		nerd_session_close(&streams[i].nerd_cmd);
+		output_flush(&streams[i].out);
+		output_free(&streams[i].out);
+		capture_close(&streams[i].capture);
+	}
+
+	if (ret == -EINVAL)
+		goto printhelp;
+
+	return 0;
+}
+
+/* Packets or scans received so far, to tell whether a retry got
+   anywhere */
+static unsigned long stream_progress(struct stream *s)
+{
+	return s->nerd.packets + s->ue9_lines;
+}
+
+/* Wait before reconnecting, in short steps so that a request to stop
+   isn't held up */
+static void stream_backoff(struct stream *s, int ms)
+{
+	while (ms > 0 && !__atomic_load_n(&s->stop, __ATOMIC_SEQ_CST)) {
+		int step = (ms > 100) ? 100 : ms;
+		usleep(step * 1000);
+		ms -= step;
+	}
+}
+
+/* Stream one device until it is done, retrying and falling back to
+   other device types as the options allow.  Returns 0 when finished,
+   or -EINVAL if the options don't suit the device. */
+int stream_run(struct stream *s)
+{
+	int donerdjack;
+	double actual_rate;
+	uint8_t scanconfig;
+	uint16_t scaninterval;
+	unsigned long period = NERDJACK_CLOCK_RATE / cfg.desired_rate;
+	unsigned long progress;
+	struct backoff backoff;
+	int i, delay;
+
+	backoff_reset(&backoff);
+
+	/* Timer requires Labjack */
+	if (cfg.timer_mode_count && !s->labjack) {
+		info("Can't use timers on NerdJack\n");
+		return -EINVAL;
+	}
+
+	/* Individual Analog Channel Gain Set requires Labjack*/
+	if (cfg.gain_count && !s->labjack) {
+		info("Can't use Individual Gain Set on NerdJack\n");
+		return -EINVAL;
+	}
+
+	donerdjack = s->nerdjack;
+
+	//First if no options were supplied try the Nerdjack
+	//The second time through, donerdjack will be true and this will not fire
+	if (!s->nerdjack && !s->labjack) {
+		info("No device specified...Defaulting to Nerdjack\n");
+		donerdjack = 1;
+	}
+
+ doneparse:
+
+	if (donerdjack) {
+		if (cfg.channel_count > NERDJACK_CHANNELS) {
+			info("Too many channels for NerdJack\n");
+			return -EINVAL;
+		}
+		for (i = 0; i < cfg.channel_count; i++) {
+			if (cfg.channel_list[i] >= NERDJACK_CHANNELS) {
+				info("Channel is out of NerdJack range: %d\n",
+				     cfg.channel_list[i]);
+				return -EINVAL;
+			}
+		}
+	} else {
+		if (cfg.channel_count > UE9_MAX_CHANNEL_COUNT) {
+			info("Too many channels for LabJack\n");
+			return -EINVAL;
+		}
+		for (i = 0; i < cfg.channel_count; i++) {
+			if (cfg.channel_list[i] > UE9_MAX_CHANNEL) {
+				info("Channel is out of LabJack range: %d\n",
+				     cfg.channel_list[i]);
+				return -EINVAL;
+			}
+		}
+	}
+
 	/* Figure out actual rate. */
 	if (donerdjack) {
-		if (nerdjack_choose_scan(desired_rate, &actual_rate, &period) <
-		    0) {
-			info("error: can't achieve requested scan rate (%lf Hz)\n", desired_rate);
+		if (nerdjack_choose_scan(cfg.desired_rate, &actual_rate,
+					 &period) < 0) {
+			info("error: can't achieve requested scan rate (%lf Hz)\n", cfg.desired_rate);
 		}
 	} else {
-		if (ue9_choose_scan(desired_rate, &actual_rate,
+		if (ue9_choose_scan(cfg.desired_rate, &actual_rate,
 				    &scanconfig, &scaninterval) < 0) {
-			info("error: can't achieve requested scan rate (%lf Hz)\n", desired_rate);
+			info("error: can't achieve requested scan rate (%lf Hz)\n", cfg.desired_rate);
 		}
 	}
 
-	if ((desired_rate != actual_rate) || verb_count) {
+	if ((cfg.desired_rate != actual_rate) || verb_count) {
 		info("Actual scanrate is %lf Hz\n", actual_rate);
 		info("Period is %ld\n", period);
 	}
 
-	if (verb_count && lines) {
-		info("Stopping capture after %d lines\n", lines);
+	if (verb_count && cfg.lines) {
+		info("Stopping capture after %d lines\n", cfg.lines);
 	}
 
-	signal(SIGINT, handle_sig);
-	signal(SIGTERM, handle_sig);
-
-#ifdef SIGPIPE /* not on Windows */
-	/* Ignore SIGPIPE so I/O errors to the network device won't kill the process */
-	signal(SIGPIPE, SIG_IGN);
-#endif
-
-	if (detect) {
+	if (s->detect) {
 		info("Autodetecting NerdJack address\n");
-		free(address);
-		if (nerdjack_detect(address) < 0) {
+		free(s->address);
+		if (nerdjack_detect(s->address) < 0) {
 			info("Error with autodetection\n");
-			goto printhelp;
+			return -EINVAL;
 		} else {
-			info("Found NerdJack at address: %s\n", address);
+			info("Found NerdJack at address: %s\n", s->address);
 		}
 	}
 
 	for (;;) {
 		int ret;
+		progress = stream_progress(s);
 		if (donerdjack) {
-			ret =
-			    nerdDoStream(address, channel_list, channel_count,
-					 precision, period, convert, lines,
-					 showmem);
+			ret = nerdDoStream(s, period);
 			verb("nerdDoStream returned %d\n", ret);
 
 		} else {
-			ret = doStream(address, scanconfig, scaninterval,
-				       channel_list, channel_count,
-				       timer_mode_list, timer_value_list, 
-				       timer_mode_count, timer_divisor,
-				       gain_list, gain_count,
-				       convert, lines);
+			ret = doStream(s, scanconfig, scaninterval);
 			verb("doStream returned %d\n", ret);
 		}
-		if (oneshot)
+		if (output_flush(&s->out) < 0)
+			info("Output error (disk full?)\n");
+		if (cfg.oneshot)
 			break;
 
-		if (ret == 0)
+		if (ret == 0 || __atomic_load_n(&s->stop, __ATOMIC_SEQ_CST))
 			break;
 
+		/* A stream that got data before it failed starts the
+		   backoff over */
+		if (stream_progress(s) != progress)
+			backoff_reset(&backoff);
+
 		//Neither options specified at command line and first time through.
 		//Try LabJack
-		if (ret == -ENOTCONN && donerdjack && !labjack && !nerdjack) {
+		if (ret == -ENOTCONN && donerdjack && !s->labjack && !s->nerdjack) {
 			info("Could not connect NerdJack...Trying LabJack\n");
 			donerdjack = 0;
 			goto doneparse;
 		}
 		//Neither option supplied, no address, and second time through.
 		//Try autodetection
-		if (ret == -ENOTCONN && !donerdjack && !labjack && !nerdjack
-		    && !addressSpecified) {
+		if (ret == -ENOTCONN && !donerdjack && !s->labjack && !s->nerdjack
+		    && !s->addressSpecified) {
 			info("Could not connect LabJack...Trying to autodetect Nerdjack\n");
-			detect = 1;
+			s->detect = 1;
 			donerdjack = 1;
 			goto doneparse;
 		}
 
-		if (ret == -ENOTCONN && nerdjack && !detect
-		    && !addressSpecified) {
+		if (ret == -ENOTCONN && s->nerdjack && !s->detect
+		    && !s->addressSpecified) {
 			info("Could not reach NerdJack...Trying to autodetect\n");
-			detect = 1;
+			s->detect = 1;
 			goto doneparse;
 		}
 
-		if (ret == -ENOTCONN && !forceretry) {
+		if (ret == -ENOTCONN && !cfg.forceretry) {
 			info("Initial connection failed, giving up\n");
 			break;
 		}
 
-		if (ret == -EAGAIN || ret == -ENOTCONN) {
-			/* Some transient error.  Wait a tiny bit, then retry */
-			info("Retrying in 5 secs.\n");
-			sleep(5);
-		} else {
-			info("Retrying now.\n");
-		}
+		/* Reconnect quickly at first, then back off while the
+		   device stays unreachable */
+		delay = backoff_next(&backoff);
+		info("Retrying in %d ms.\n", delay);
+		stream_backoff(s, delay);
+		metrics_reconnect(&s->metrics);
 	}
 
-	debug("Done loop\n");
+	return 0;
+}
+
+/* Note a NerdJack reset in the output, and start counting packets
+   over */
+static void nerd_reset(struct stream *s)
+{
+	info("NerdJack was reset\n");
+	if (cfg.convert == CONVERT_BINARY)
+		binary_write_marker(&s->out, BINARY_REC_RESET);
+	else
+		output_printf(&s->out, "# NerdJack was reset here\n");
+	s->nerd.currentcount = 0;
+	s->nerd.wasreset = 1;
+}
+
+/* Write the binary header before the first data.  A UE9 stream that
+   is restarted after that has lost samples, which gets a gap marker.
+   Returns < 0 on error. */
+static int binary_start(struct stream *s, int device, double rate)
+{
+	int ret = 0;
+
+	if (cfg.convert != CONVERT_BINARY)
+		return 0;
 
+	if (!s->binary_started)
+		ret = binary_write_header(&s->out, device, cfg.channel_count,
+					  cfg.channel_list, rate);
+	else if (device == BINARY_DEVICE_UE9)
+		ret = binary_write_marker(&s->out, BINARY_REC_GAP);
+	if (ret < 0) {
+		info("Output error (disk full?)\n");
+		return ret;
+	}
+	s->binary_started = 1;
 	return 0;
 }
 
-int
-nerdDoStream(const char *address, int *channel_list, int channel_count,
-	     int precision, unsigned long period, int convert, int lines,
-	     int showmem)
+/* Fill in the capture stream record for the stream s */
+static void record_fill(struct capture_stream *cs, struct stream *s,
+			int device, double rate, unsigned long period,
+			struct ue9Calibration *calib)
+{
+	*cs = (struct capture_stream) {
+		.device = device,
+		.precision = cfg.precision,
+		.reset = s->nerd.wasreset,
+		.channel_count = cfg.channel_count,
+		.gain_count = cfg.gain_count,
+		.period = period,
+		.rate = rate,
+	};
+
+	memcpy(cs->channel_list, cfg.channel_list,
+	       cfg.channel_count * sizeof(int));
+	memcpy(cs->gain_list, cfg.gain_list, cfg.gain_count * sizeof(int));
+	if (calib) {
+		cs->calib = *calib;
+		cs->calibrated = 1;
+	}
+}
+
+/* Describe the stream about to start in the capture file, so that it
+   can be replayed on its own.  A failed write is reported, and
+   streaming carries on. */
+static void record_stream(struct stream *s, int device, double rate,
+			  unsigned long period, struct ue9Calibration *calib)
+{
+	struct capture_stream cs;
+
+	record_fill(&cs, s, device, rate, period, calib);
+	capture_write_stream(s->cap, &cs);
+}
+
+int nerdDoStream(struct stream *s, unsigned long period)
 {
 	int retval = -EAGAIN;
 	int fd_data;
-	static int first_call = 1;
-	static int started = 0;
-	static int wasreset = 0;
+	int failed;
 	getPacket command;
-	static unsigned short currentcount = 0;
  tryagain:
 
 	//If this is the first time, set up acquisition
 	//Otherwise try to resume the previous one
-	if (started == 0) {
+	if (s->nerd_started == 0) {
 		if (nerd_generate_command
-		    (&command, channel_list, channel_count, precision,
-		     period) < 0) {
+		    (&command, cfg.channel_list, cfg.channel_count,
+		     cfg.precision, period) < 0) {
 			info("Failed to create configuration command\n");
 			goto out;
 		}
 
-		if (nerd_send_command(address, "STOP", 4) < 0) {
-			if (first_call) {
+		/* STOP and GETD go out together on one connection */
+		if (nerd_session_commands(&s->nerd_cmd, s->address, 2,
+					  (void *[]) {"STOP", &command},
+					  (int[]) {4, sizeof(command)},
+					  &failed) < 0) {
+			if (failed > 0) {
+				info("Failed to send GET command\n");
+			} else if (s->nerd_first_call) {
 				retval = -ENOTCONN;
 				if (verb_count)
 					info("Failed to send STOP command\n");
@@ -615,24 +1180,17 @@ nerdDoStream(const char *address, int *channel_list, int channel_count,
 			goto out;
 		}
 
-		if (nerd_send_command(address, &command, sizeof(command)) < 0) {
-			info("Failed to send GET command\n");
-			goto out;
-		}
-
 	} else {
 		//If we had a transmission in progress, send a command to resume from there
 		char cmdbuf[10];
-		sprintf(cmdbuf, "SETC%05hd", currentcount);
-		retval = nerd_send_command(address, cmdbuf, strlen(cmdbuf));
+		sprintf(cmdbuf, "SETC%05hd", s->nerd.currentcount);
+		retval = nerd_session_command(&s->nerd_cmd, s->address,
+					      cmdbuf, strlen(cmdbuf));
 		if (retval == -4) {
-			info("NerdJack was reset\n");
 			//Assume we have not started yet, reset on this side.
 			//If this routine is retried, start over
-			printf("# NerdJack was reset here\n");
-			currentcount = 0;
-			started = 0;
-			wasreset = 1;
+			nerd_reset(s);
+			s->nerd_started = 0;
 			goto tryagain;
 		} else if (retval < 0) {
 			info("Failed to send SETC command\n");
@@ -641,19 +1199,33 @@ nerdDoStream(const char *address, int *channel_list, int channel_count,
 	}
 
 	//The transmission has begun
-	started = 1;
+	s->nerd_started = 1;
+
+	if (binary_start(s, BINARY_DEVICE_NERDJACK,
+			 (double)NERDJACK_CLOCK_RATE / period) < 0) {
+		retval = -3;
+		goto out;
+	}
 
 	/* Open connection */
-	fd_data = nerd_open(address, NERDJACK_DATA_PORT);
+	fd_data = nerd_open(s->address, NERDJACK_DATA_PORT);
 	if (fd_data < 0) {
-		info("Connect failed: %s:%d\n", address, NERDJACK_DATA_PORT);
+		info("Connect failed: %s:%d\n", s->address, NERDJACK_DATA_PORT);
 		goto out;
 	}
 
+	s->metrics.device = BINARY_DEVICE_NERDJACK;
+	if (s->ring)
+		shmring_start(s->ring, BINARY_DEVICE_NERDJACK,
+			      (double)NERDJACK_CLOCK_RATE / period);
+	if (s->cap)
+		record_stream(s, BINARY_DEVICE_NERDJACK,
+			      (double)NERDJACK_CLOCK_RATE / period, period,
+			      NULL);
+
 	retval = nerd_data_stream
-	    (fd_data, channel_count, channel_list, precision, convert, lines,
-	     showmem, &currentcount, period, wasreset);
-	wasreset = 0;
+	    (fd_data, cfg.channel_count, cfg.channel_list, cfg.precision,
+	     cfg.convert, cfg.lines, cfg.showmem, period, &s->nerd, &s->out);
 	if (retval == -3) {
 		retval = 0;
 	}
@@ -669,92 +1241,123 @@ nerdDoStream(const char *address, int *channel_list, int channel_count,
 	nerd_close_conn(fd_data);
  out:
 	//We've tried communicating, so this is not the first call anymore
-	first_call = 0;
+	s->nerd_first_call = 0;
 	return retval;
 }
 
-int
-doStream(const char *address, uint8_t scanconfig, uint16_t scaninterval,
-	 int *channel_list, int channel_count, 
-	 int *timer_mode_list, int *timer_value_list,
-	 int timer_mode_count, int timer_divisor,
-	 int *gain_list, int gain_count,
-	 int convert, int lines)
+int doStream(struct stream *s, uint8_t scanconfig, uint16_t scaninterval)
 {
 	int retval = -EAGAIN;
-	//	int fd_cmd, fd_data; *these are now globals so sighandler can use them*
 	int ret;
-	static int first_call = 1;
+	int cached = 0;
+	struct ue9CommConfig comm;
 	struct callbackInfo ci = {
-		.convert = convert,
-		.maxlines = lines,
+		.convert = cfg.convert,
+		.maxlines = cfg.lines,
+		.stream = s,
 	};
 
-	/* Open command connection.  If this fails, and this is the
-	   first attempt, return a different error code so we give up. */
-	fd_cmd = ue9_open(address, UE9_COMMAND_PORT);
-	if (fd_cmd < 0) {
-		info("Connect failed: %s:%d\n", address, UE9_COMMAND_PORT);
-		if (first_call)
+	ci.setup = (struct ue9_setup) {
+		.channel_list = cfg.channel_list,
+		.channel_count = cfg.channel_count,
+		.gain_list = cfg.gain_list,
+		.gain_count = cfg.gain_count,
+		.scanconfig = scanconfig,
+		.scaninterval = scaninterval,
+		.timer_mode_list = cfg.timer_mode_list,
+		.timer_value_list = cfg.timer_value_list,
+		.timer_mode_count = cfg.timer_mode_count,
+		.timer_divisor = cfg.timer_divisor,
+	};
+
+	/* Open command and data connections.  If the command connection
+	   fails, and this is the first attempt, return a different
+	   error code so we give up. */
+	ue9_setup_connect(&ci.setup, s->address, UE9_COMMAND_PORT,
+			  UE9_DATA_PORT, &s->fd_cmd, &s->fd_data);
+	if (s->fd_cmd < 0) {
+		info("Connect failed: %s:%d\n", s->address, UE9_COMMAND_PORT);
+		if (s->ue9_first_call)
 			retval = -ENOTCONN;
 		goto out;
 	}
-	first_call = 0;
-
-	/* Make sure nothing is left over from a previous stream */
-	if (ue9_stream_stop(fd_cmd) == 0)
-		verb("Stopped previous stream.\n");
-	ue9_buffer_flush(fd_cmd);
-
-	/* Open data connection */
-	fd_data = ue9_open(address, UE9_DATA_PORT);
-	if (fd_data < 0) {
-		info("Connect failed: %s:%d\n", address, UE9_DATA_PORT);
+	s->ue9_first_call = 0;
+	if (s->fd_data < 0) {
+		info("Connect failed: %s:%d\n", s->address, UE9_DATA_PORT);
 		goto out1;
 	}
 
-	/* Get calibration */
-	if (ue9_get_calibration(fd_cmd, &ci.calib) < 0) {
-		info("Failed to get device calibration\n");
+	/* Make sure nothing is left over from a previous stream */
+	if (ue9_setup_prepare(&ci.setup, s->fd_cmd, s->fd_data) < 0) {
+		info("Failed to prepare device\n");
 		goto out2;
 	}
 
-	/* Set timer configuration */
-	if (timer_mode_count &&
-	    ue9_timer_config(fd_cmd, timer_mode_list, timer_value_list,
-			     timer_mode_count, timer_divisor) < 0) {
-		info("Failed to set timer configuration\n");
-		goto out2;
-	}		
-
-	if (gain_count) {
-		/* Set stream configuration */
-		if (ue9_streamconfig(fd_cmd, channel_list, channel_count,
-						scanconfig, scaninterval,
-						gain_list, gain_count) < 0) {
-			info("Failed to set stream configuration\n");
-			goto out2;
-		}
-	} else 	{
-		/* Set stream configuration */
-		if (ue9_streamconfig_simple(fd_cmd, channel_list, channel_count,
-						scanconfig, scaninterval,
-						UE9_BIPOLAR_GAIN1) < 0) {
-			info("Failed to set stream configuration\n");
-			goto out2;
-		}
+	/* Get calibration from the cache if this device is in it, or
+	   else along with starting the stream.  The cached copy is
+	   checked against the device once streaming. */
+	comm = ci.setup.comm;
+	if (ue9_cache_load(&comm, &ci.calib) == 0) {
+		verb("using cached calibration\n");
+		cached = 1;
 	}
 
-	/* Start stream */
-	if (ue9_stream_start(fd_cmd) < 0) {
+	if (ue9_setup_start(&ci.setup, s->fd_cmd,
+			    cached ? NULL : &ci.calib) < 0) {
 		info("Failed to start stream\n");
-		goto out2;
+		goto out3;
+	}
+
+	if (!cached && (comm.mac_address[0] || comm.mac_address[1] ||
+			comm.mac_address[2] || comm.mac_address[3] ||
+			comm.mac_address[4] || comm.mac_address[5]))
+		ue9_cache_save(&comm, &ci.calib);
+
+	/* Only volts need the calibration to make sense; raw output
+	   streams regardless */
+	ci.conv = ci.conv_buf[0];
+	if (cfg.convert == CONVERT_VOLTS &&
+	    ue9_conversion_setup(&ci.calib, cfg.channel_count,
+				 cfg.channel_list, cfg.gain_count,
+				 cfg.gain_list, 12, ci.conv) < 0) {
+		info("Failed to set up conversions\n");
+		goto out3;
+	}
+
+	if (binary_start(s, BINARY_DEVICE_UE9,
+			 ue9_compute_rate(scanconfig, scaninterval)) < 0)
+		goto out3;
+
+	if (s->cap)
+		record_stream(s, BINARY_DEVICE_UE9,
+			      ue9_compute_rate(scanconfig, scaninterval), 0,
+			      &ci.calib);
+
+	/* A restart after data has come in loses some */
+	s->metrics.device = BINARY_DEVICE_UE9;
+	if (s->ue9_lines)
+		metrics_gap(&s->metrics);
+	if (s->ring) {
+		shmring_start(s->ring, BINARY_DEVICE_UE9,
+			      ue9_compute_rate(scanconfig, scaninterval));
+		if (s->ue9_lines)
+			shmring_gap(s->ring);
 	}
 
+	/* The command connection is idle while streaming.  Started only
+	   now, so that nothing above sees calibration_changed(). */
+	if (cached && ue9_refresh_start(&s->ue9_refresh, s->fd_cmd, &comm,
+					&ci.calib, calibration_changed,
+					&ci) == 0)
+		__atomic_store_n(&s->ue9_refreshing, 1, __ATOMIC_RELEASE);
+
 	/* Stream data */
-	ue9_running = 1;
-	ret =
-	    ue9_stream_data(fd_data, channel_count, channel_list, gain_count, gain_list, data_callback, (void *)&ci);
+	s->ue9_running = 1;
+	ret = ue9_stream_batch(s->fd_data, s->cap, &s->metrics, &s->out,
+			       ue9_compute_rate(scanconfig, scaninterval),
+			       cfg.channel_count, cfg.channel_list,
+			       cfg.gain_count, cfg.gain_list, data_callback,
+			       (void *)&ci);
 	if (ret < 0) {
 		info("Data stream failed with error %d\n", ret);
 		goto out3;
@@ -765,71 +1368,269 @@ doStream(const char *address, uint8_t scanconfig, uint16_t scaninterval,
 
  out3:
 	/* Stop stream and clean up */
-	ue9_stream_stop(fd_cmd);
-	ue9_buffer_flush(fd_cmd);
+	if (__atomic_load_n(&s->ue9_refreshing, __ATOMIC_ACQUIRE)) {
+		ue9_refresh_finish(&s->ue9_refresh);
+		__atomic_store_n(&s->ue9_refreshing, 0, __ATOMIC_RELEASE);
+	}
+	ue9_stream_stop(s->fd_cmd);
+	ue9_buffer_flush(s->fd_cmd);
  out2:
-	ue9_close(fd_data);
+	ue9_close(s->fd_data);
  out1:
-	ue9_close(fd_cmd);
+	ue9_close(s->fd_cmd);
  out:
-	ue9_running = 0;
+	s->ue9_running = 0;
 	return retval;
 }
 
-int data_callback(int channels, int *channel_list, int gain_count, int *gain_list, uint16_t * data, void *context)
+/* Process one recorded NerdJack stream, as if it had been resumed or
+   restarted like the original */
+static int replay_nerdjack(struct stream *s, struct capture_stream *cs)
 {
-	int i;
-	struct callbackInfo *ci = (struct callbackInfo *)context;
-	static int lines = 0;
-
-	columns_left = channels;
-	for (i = 0; i < channels; i++) {
-		if (ci->convert == CONVERT_VOLTS &&
-		    channel_list[i] <= UE9_MAX_ANALOG_CHANNEL) {
-			/* CONVERT_VOLTS */
-			if (i < gain_count)
-			{
-				if (printf("%lf", ue9_binary_to_analog(
-						   &ci->calib, gain_list[i],
-						   12, data[i])) < 0)
-					goto bad;
-			} else {
-				if (printf("%lf", ue9_binary_to_analog(
-						   &ci->calib, 0,
-						   12, data[i])) < 0)
-					goto bad;
-			}
-		} else if (ci->convert == CONVERT_VOLTS &&
-			   (channel_list[i] == 141 || channel_list[i] == 133)) {
-			/* CONVERT_VOLTS but output temperature */
-			if (printf("%lf", ue9_binary_to_temperature(
-					   &ci->calib, data[i])) < 0)
-				goto bad;
-		} else if (ci->convert == CONVERT_HEX) {
-			/* CONVERT_HEX */
-			if (printf("%04X", data[i]) < 0)
-				goto bad;
-		} else {
-			/* CONVERT_DEC */
-			if (printf("%d", data[i]) < 0)
-				goto bad;
+	int ret;
+
+	if (cs->reset)
+		nerd_reset(s);
+
+	if (binary_start(s, BINARY_DEVICE_NERDJACK, cs->rate) < 0)
+		return -3;
+	s->metrics.device = BINARY_DEVICE_NERDJACK;
+	if (s->ring)
+		shmring_start(s->ring, BINARY_DEVICE_NERDJACK, cs->rate);
+
+	ret = nerd_data_stream(-1, cfg.channel_count, cfg.channel_list,
+			       cs->precision, cfg.convert, cfg.lines,
+			       cfg.showmem, cs->period, &s->nerd, &s->out);
+	if (ret == -3)
+		return ret;
+	return 0;
+}
+
+/* Process one recorded UE9 stream, with the calibration it was
+   recorded with */
+static int replay_ue9(struct stream *s, struct capture_stream *cs)
+{
+	struct callbackInfo ci = {
+		.convert = cfg.convert,
+		.maxlines = cfg.lines,
+		.stream = s,
+		.setup_reported = 1,
+	};
+	int ret;
+
+	if (cfg.convert == CONVERT_VOLTS && !cs->calibrated) {
+		info("Capture has no calibration, can't convert\n");
+		return -1;
+	}
+	ci.calib = cs->calib;
+	ci.conv = ci.conv_buf[0];
+	if (cfg.convert == CONVERT_VOLTS &&
+	    ue9_conversion_setup(&ci.calib, cfg.channel_count,
+				 cfg.channel_list, cfg.gain_count,
+				 cfg.gain_list, 12, ci.conv) < 0) {
+		info("Failed to set up conversions\n");
+		return -1;
+	}
+
+	if (binary_start(s, BINARY_DEVICE_UE9, cs->rate) < 0)
+		return -3;
+
+	s->metrics.device = BINARY_DEVICE_UE9;
+	if (s->ue9_lines)
+		metrics_gap(&s->metrics);
+	if (s->ring) {
+		shmring_start(s->ring, BINARY_DEVICE_UE9, cs->rate);
+		if (s->ue9_lines)
+			shmring_gap(s->ring);
+	}
+
+	/* Calibration the original stream switched to on the way */
+	s->cap->calib_changed = calibration_changed;
+	s->cap->context = &ci;
+	ret = ue9_stream_batch(-1, s->cap, &s->metrics, &s->out, cs->rate,
+			       cfg.channel_count, cfg.channel_list,
+			       cfg.gain_count, cfg.gain_list, data_callback,
+			       (void *)&ci);
+	s->cap->calib_changed = NULL;
+
+	/* Running out of recorded data (-1) is the normal end; anything
+	   else happened to the original stream too, which was then
+	   retried */
+	if (ret < -1)
+		info("Data stream failed with error %d\n", ret);
+	return 0;
+}
+
+/* Process a capture recorded with -w instead of streaming from a
+   device.  The channels, gains and rate are the recorded ones; the
+   output options apply as usual. */
+int replay_run(struct stream *s)
+{
+	struct capture_stream cs;
+	int ret;
+
+	while ((ret = capture_next_stream(s->cap, &cs)) > 0) {
+		memcpy(cfg.channel_list, cs.channel_list,
+		       cs.channel_count * sizeof(int));
+		cfg.channel_count = cs.channel_count;
+		memcpy(cfg.gain_list, cs.gain_list,
+		       cs.gain_count * sizeof(int));
+		cfg.gain_count = cs.gain_count;
+		if (stream_ring(s) < 0) {
+			ret = -1;
+			break;
 		}
-		columns_left--;
-		if (i < (channels - 1)) {
-			if (ci->convert != CONVERT_HEX && putchar(' ') < 0)
-				goto bad;
+
+		if (cs.device == BINARY_DEVICE_NERDJACK) {
+			ret = replay_nerdjack(s, &cs);
+		} else if (cs.device == BINARY_DEVICE_UE9) {
+			ret = replay_ue9(s, &cs);
 		} else {
-			if (putchar('\n') < 0)
+			info("Unknown device %d in capture\n", cs.device);
+			ret = -1;
+		}
+		if (output_flush(&s->out) < 0)
+			info("Output error (disk full?)\n");
+		if (ret < 0)
+			break;
+
+		/* Done once the requested lines are out */
+		if (cfg.lines && (s->ue9_lines >= cfg.lines ||
+				  (cs.device == BINARY_DEVICE_NERDJACK &&
+				   s->nerd.linesleft == 0)))
+			break;
+	}
+
+	if (ret == 0)
+		info("Replay finished\n");
+	return (ret < 0) ? ret : 0;
+}
+
+/* Convert and write a block of scans */
+int data_callback(struct ue9_scan_block *block, void *context)
+{
+	int i, n;
+	struct callbackInfo *ci = (struct callbackInfo *)context;
+	struct stream *s = ci->stream;
+	struct output *out = &s->out;
+	struct ue9Conversion *conv;
+	int channels = block->channels;
+	const uint16_t *data = block->data;
+	double volts[channels];
+	char *line;
+	size_t len;
+	uint64_t t;
+
+	/* Asked to stop from the main thread */
+	if (__atomic_load_n(&s->stop, __ATOMIC_RELAXED))
+		return -1;
+
+	if (!ci->setup_reported) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		ue9_setup_report(&ci->setup, &now);
+		ci->setup_reported = 1;
+	}
+
+	/* Stop at the requested number of lines */
+	n = block->scans;
+	if (ci->maxlines && n > ci->maxlines - s->ue9_lines)
+		n = ci->maxlines - s->ue9_lines;
+
+	/* Local readers get the raw scans, whatever the output format */
+	if (s->ring)
+		shmring_publish(s->ring, data, n);
+
+	t = prof_start();
+	switch (ci->convert) {
+	case CONVERT_BINARY:
+		/* One record holds the whole block */
+		if (binary_write_data(out, data, n * channels) < 0)
+			goto bad;
+		s->ue9_lines += n;
+		break;
+
+	case CONVERT_DEC:
+	case CONVERT_HEX:
+		/* Format each scan straight into the output buffer */
+		for (; n > 0; n--, data += channels, s->ue9_lines++) {
+			line = output_reserve(out, FORMAT_LINE_SIZE(channels));
+			if (line == NULL)
 				goto bad;
-			lines++;
-			if (ci->maxlines && lines >= ci->maxlines)
-				return -1;
+			if (ci->convert == CONVERT_HEX)
+				len = format_scan_hex(line, data, channels);
+			else
+				len = format_scan_dec(line, data, channels, 0);
+			output_commit(out, len);
 		}
+		break;
+
+	default:		/* CONVERT_VOLTS */
+		conv = __atomic_load_n(&ci->conv, __ATOMIC_ACQUIRE);
+		for (; n > 0; n--, data += channels, s->ue9_lines++) {
+			ue9_convert_scan(conv, channels, data, volts);
+
+			s->columns_left = channels;
+			for (i = 0; i < channels; i++) {
+				if (conv[i].type != UE9_CONVERSION_NONE) {
+					/* Volts or temperature */
+					if (output_printf(out, "%lf",
+							  volts[i]) < 0)
+						goto bad;
+				} else {
+					/* Non-analog channels stay decimal */
+					if (output_printf(out, "%d",
+							  data[i]) < 0)
+						goto bad;
+				}
+				s->columns_left--;
+				if (output_write(out, (i < channels - 1) ?
+						 " " : "\n", 1) < 0)
+					goto bad;
+			}
+		}
+		break;
 	}
+	prof_end(PROF_CONVERT, t);
 
+	if (output_poll(out) < 0)
+		goto bad;
+	if (ci->maxlines && s->ue9_lines >= ci->maxlines)
+		return -1;
 	return 0;
 
  bad:
 	info("Output error (disk full?)\n");
 	return -3;
 }
+
+/* The device had different calibration than the cache.  Called on the
+   refresh thread, or the receiver thread when replaying: record the
+   new calibration, build conversions in the spare buffer and switch
+   the callback over to it. */
+void calibration_changed(struct ue9Calibration *calib, void *context)
+{
+	struct callbackInfo *ci = (struct callbackInfo *)context;
+	struct stream *s = ci->stream;
+	struct ue9Conversion *spare = (ci->conv == ci->conv_buf[0]) ?
+	    ci->conv_buf[1] : ci->conv_buf[0];
+	struct capture_stream cs;
+
+	ci->calib = *calib;
+	if (s->cap && !s->cap->replay) {
+		record_fill(&cs, s, BINARY_DEVICE_UE9,
+			    ue9_compute_rate(ci->setup.scanconfig,
+					     ci->setup.scaninterval), 0,
+			    &ci->calib);
+		capture_update_stream(s->cap, &cs);
+	}
+
+	if (ci->convert != CONVERT_VOLTS)
+		return;
+	if (ue9_conversion_setup(calib, cfg.channel_count, cfg.channel_list,
+				 cfg.gain_count, cfg.gain_list, 12,
+				 spare) < 0)
+		return;
+	__atomic_store_n(&ci->conv, spare, __ATOMIC_RELEASE);
+}
@@ -4,6 +4,7 @@
 #define CONVERT_DEC 0
 #define CONVERT_VOLTS 1
 #define CONVERT_HEX 2
+#define CONVERT_BINARY 3
 
 #define TIMEOUT 5		/* Timeout for connect/send/recv, in seconds */
 
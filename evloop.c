@@ -0,0 +1,262 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "netutil.h"
+#include "evloop.h"
+
+#if defined(EVLOOP_EPOLL)
+#include <sys/epoll.h>
+#elif defined(EVLOOP_POLL)
+#include <poll.h>
+#endif
+
+static struct evloop_source *find(struct evloop *ev, int fd)
+{
+	int i;
+
+	for (i = 0; i < ev->count; i++)
+		if (ev->src[i].fd == fd)
+			return &ev->src[i];
+	return NULL;
+}
+
+int evloop_init(struct evloop *ev)
+{
+	memset(ev, 0, sizeof(*ev));
+#ifdef EVLOOP_EPOLL
+	ev->epfd = epoll_create(EVLOOP_MAX_FDS);
+	if (ev->epfd < 0)
+		return -1;
+#endif
+	return 0;
+}
+
+void evloop_free(struct evloop *ev)
+{
+#ifdef EVLOOP_EPOLL
+	close(ev->epfd);
+#endif
+	ev->count = 0;
+}
+
+int evloop_add(struct evloop *ev, int fd, int events)
+{
+	struct evloop_source *src;
+
+	if (ev->count >= EVLOOP_MAX_FDS || find(ev, fd) != NULL)
+		return -1;
+
+#ifdef EVLOOP_EPOLL
+	{
+		struct epoll_event e;
+
+		memset(&e, 0, sizeof(e));
+		if (events & EVLOOP_READ)
+			e.events |= EPOLLIN;
+		if (events & EVLOOP_WRITE)
+			e.events |= EPOLLOUT;
+		e.data.fd = fd;
+		if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) < 0)
+			return -1;
+	}
+#endif
+
+	src = &ev->src[ev->count++];
+	memset(src, 0, sizeof(*src));
+	src->fd = fd;
+	src->events = events;
+	return 0;
+}
+
+int evloop_remove(struct evloop *ev, int fd)
+{
+	struct evloop_source *src = find(ev, fd);
+
+	if (src == NULL)
+		return -1;
+
+#ifdef EVLOOP_EPOLL
+	epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+	*src = ev->src[--ev->count];
+	return 0;
+}
+
+int evloop_set_timeout(struct evloop *ev, int fd, struct timeval *timeout)
+{
+	struct evloop_source *src = find(ev, fd);
+
+	if (src == NULL)
+		return -1;
+
+	if (timeout == NULL) {
+		src->has_deadline = 0;
+		return 0;
+	}
+
+	gettimeofday(&src->deadline, NULL);
+	src->deadline.tv_sec += timeout->tv_sec;
+	src->deadline.tv_usec += timeout->tv_usec;
+	src->deadline.tv_sec += src->deadline.tv_usec / 1000000;
+	src->deadline.tv_usec %= 1000000;
+	src->has_deadline = 1;
+	return 0;
+}
+
+/* Milliseconds until the earliest deadline, rounded up, or -1 if
+   there is none */
+static int next_timeout(struct evloop *ev, struct timeval *now)
+{
+	long ms, best = -1;
+	int i;
+
+	for (i = 0; i < ev->count; i++) {
+		struct evloop_source *src = &ev->src[i];
+		if (!src->has_deadline)
+			continue;
+		ms = (src->deadline.tv_sec - now->tv_sec) * 1000 +
+		    (src->deadline.tv_usec - now->tv_usec + 999) / 1000;
+		if (ms < 0)
+			ms = 0;
+		if (best < 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+/* Report sources whose deadline has passed */
+static int expired(struct evloop *ev, struct evloop_event *events, int max)
+{
+	struct timeval now;
+	int i, n = 0;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < ev->count && n < max; i++) {
+		struct evloop_source *src = &ev->src[i];
+		if (!src->has_deadline || timercmp(&now, &src->deadline, <))
+			continue;
+		events[n].fd = src->fd;
+		events[n].events = EVLOOP_TIMEOUT;
+		n++;
+	}
+	return n;
+}
+
+int evloop_wait(struct evloop *ev, struct evloop_event *events, int max)
+{
+	struct timeval now;
+	int timeout, ret, i, n;
+
+	for (;;) {
+		gettimeofday(&now, NULL);
+		timeout = next_timeout(ev, &now);
+
+#if defined(EVLOOP_EPOLL)
+		struct epoll_event e[EVLOOP_MAX_FDS];
+
+		ret = epoll_wait(ev->epfd, e, EVLOOP_MAX_FDS, timeout);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		for (i = 0, n = 0; i < ret && n < max; i++, n++) {
+			events[n].fd = e[i].data.fd;
+			events[n].events = 0;
+			if (e[i].events & EPOLLIN)
+				events[n].events |= EVLOOP_READ;
+			if (e[i].events & EPOLLOUT)
+				events[n].events |= EVLOOP_WRITE;
+			if (e[i].events & (EPOLLERR | EPOLLHUP))
+				events[n].events |= EVLOOP_ERROR;
+		}
+#elif defined(EVLOOP_POLL)
+		struct pollfd p[EVLOOP_MAX_FDS];
+
+		for (i = 0; i < ev->count; i++) {
+			p[i].fd = ev->src[i].fd;
+			p[i].events = 0;
+			p[i].revents = 0;
+			if (ev->src[i].events & EVLOOP_READ)
+				p[i].events |= POLLIN;
+			if (ev->src[i].events & EVLOOP_WRITE)
+				p[i].events |= POLLOUT;
+		}
+		ret = poll(p, ev->count, timeout);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		for (i = 0, n = 0; i < ev->count && n < max; i++) {
+			if (p[i].revents == 0)
+				continue;
+			events[n].fd = p[i].fd;
+			events[n].events = 0;
+			if (p[i].revents & POLLIN)
+				events[n].events |= EVLOOP_READ;
+			if (p[i].revents & POLLOUT)
+				events[n].events |= EVLOOP_WRITE;
+			if (p[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+				events[n].events |= EVLOOP_ERROR;
+			n++;
+		}
+#else
+		fd_set readfds, writefds, exceptfds;
+		struct timeval tv, *tvp = NULL;
+		int maxfd = 0;
+
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_ZERO(&exceptfds);
+		for (i = 0; i < ev->count; i++) {
+			int fd = ev->src[i].fd;
+			if (ev->src[i].events & EVLOOP_READ)
+				FD_SET(fd, &readfds);
+			if (ev->src[i].events & EVLOOP_WRITE)
+				FD_SET(fd, &writefds);
+			FD_SET(fd, &exceptfds);
+			if (fd > maxfd)
+				maxfd = fd;
+		}
+		if (timeout >= 0) {
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+			tvp = &tv;
+		}
+		ret = select(maxfd + 1, &readfds, &writefds, &exceptfds, tvp);
+		if (ret < 0)
+			return -1;
+		for (i = 0, n = 0; ret > 0 && i < ev->count && n < max; i++) {
+			int fd = ev->src[i].fd;
+			events[n].fd = fd;
+			events[n].events = 0;
+			if (FD_ISSET(fd, &readfds))
+				events[n].events |= EVLOOP_READ;
+			if (FD_ISSET(fd, &writefds))
+				events[n].events |= EVLOOP_WRITE;
+			if (FD_ISSET(fd, &exceptfds))
+				events[n].events |= EVLOOP_ERROR;
+			if (events[n].events)
+				n++;
+		}
+#endif
+		if (n > 0)
+			return n;
+
+		/* Nothing ready, so a deadline must have passed */
+		n = expired(ev, events, max);
+		if (n > 0)
+			return n;
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <sys/time.h>
+
+/* Wait for readiness on several sockets at once, each with its own
+   deadline.  Uses epoll on Linux, poll(2) on other Unix systems and
+   select(2) on Windows. */
+
+#if defined(__linux__)
+#define EVLOOP_EPOLL 1
+#elif !defined(__WIN32__)
+#define EVLOOP_POLL 1
+#endif
+
+#define EVLOOP_READ 0x01
+#define EVLOOP_WRITE 0x02
+#define EVLOOP_ERROR 0x04	/* error or hangup */
+#define EVLOOP_TIMEOUT 0x08	/* deadline passed first */
+
+#define EVLOOP_MAX_FDS 8
+
+struct evloop_source {
+	int fd;
+	int events;
+	int has_deadline;
+	struct timeval deadline;
+};
+
+struct evloop {
+#ifdef EVLOOP_EPOLL
+	int epfd;
+#endif
+	int count;
+	struct evloop_source src[EVLOOP_MAX_FDS];
+};
+
+struct evloop_event {
+	int fd;
+	int events;
+};
+
+/* Set up and tear down.  evloop_init returns < 0 on error. */
+int evloop_init(struct evloop *ev);
+void evloop_free(struct evloop *ev);
+
+/* Watch fd for EVLOOP_READ and/or EVLOOP_WRITE.  Returns < 0 on
+   error. */
+int evloop_add(struct evloop *ev, int fd, int events);
+int evloop_remove(struct evloop *ev, int fd);
+
+/* Set the deadline for fd to "timeout" from now, or clear it if
+   timeout is NULL.  Returns < 0 if fd isn't watched. */
+int evloop_set_timeout(struct evloop *ev, int fd, struct timeval *timeout);
+
+/* Wait until at least one fd is ready or reaches its deadline, and
+   fill in up to max events.  Returns the number of events, or < 0 on
+   error. */
+int evloop_wait(struct evloop *ev, struct evloop_event *events, int max);
+
+#endif
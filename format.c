@@ -0,0 +1,109 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "format.h"
+
+/* Two decimal digits for each value 0-99 */
+static const char dec_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Two uppercase hex digits for each byte */
+static const char hex_pairs[512] =
+	"000102030405060708090A0B0C0D0E0F"
+	"101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F"
+	"303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F"
+	"505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F"
+	"707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F"
+	"909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+	"B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+	"D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+	"F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+char *format_dec(char *p, uint16_t value)
+{
+	unsigned int v = value;
+
+	if (v < 10) {
+		*p++ = '0' + v;
+	} else if (v < 100) {
+		memcpy(p, dec_pairs + 2 * v, 2);
+		p += 2;
+	} else if (v < 1000) {
+		*p++ = '0' + v / 100;
+		memcpy(p, dec_pairs + 2 * (v % 100), 2);
+		p += 2;
+	} else if (v < 10000) {
+		memcpy(p, dec_pairs + 2 * (v / 100), 2);
+		memcpy(p + 2, dec_pairs + 2 * (v % 100), 2);
+		p += 4;
+	} else {
+		*p++ = '0' + v / 10000;
+		v %= 10000;
+		memcpy(p, dec_pairs + 2 * (v / 100), 2);
+		memcpy(p + 2, dec_pairs + 2 * (v % 100), 2);
+		p += 4;
+	}
+	return p;
+}
+
+char *format_hex(char *p, uint16_t value)
+{
+	memcpy(p, hex_pairs + 2 * (value >> 8), 2);
+	memcpy(p + 2, hex_pairs + 2 * (value & 0xff), 2);
+	return p + 4;
+}
+
+size_t format_scan_dec(char *buf, const uint16_t * data, int count,
+		       int trailing)
+{
+	char *p = buf;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		p = format_dec(p, data[i]);
+		*p++ = ' ';
+	}
+	if (count && !trailing)
+		p--;
+	*p++ = '\n';
+	return p - buf;
+}
+
+size_t format_scan_hex(char *buf, const uint16_t * data, int count)
+{
+	char *p = buf;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(p, hex_pairs + 2 * (data[i] >> 8), 2);
+		memcpy(p + 2, hex_pairs + 2 * (data[i] & 0xff), 2);
+		p += 4;
+	}
+	*p++ = '\n';
+	return p - buf;
+}
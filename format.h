@@ -0,0 +1,36 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Longest formatted value, including one separator */
+#define FORMAT_MAX_DEC 6
+#define FORMAT_MAX_HEX 4
+
+/* Buffer size needed to format a scan of n values plus newline */
+#define FORMAT_LINE_SIZE(n) ((n) * FORMAT_MAX_DEC + 1)
+
+/* Format one value as "%hu" or "%04hX".  Returns a pointer just past
+   the last character written; no terminating NUL is added. */
+char *format_dec(char *p, uint16_t value);
+char *format_hex(char *p, uint16_t value);
+
+/* Format a scan as a complete line, returning its length.  Decimal
+   values are separated by spaces, and also followed by one if
+   "trailing" is set.  Hex values are not separated.  Both end with a
+   newline and are byte-identical to the equivalent printf output. */
+size_t format_scan_dec(char *buf, const uint16_t * data, int count,
+		       int trailing);
+size_t format_scan_hex(char *buf, const uint16_t * data, int count);
+
+#endif
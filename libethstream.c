@@ -0,0 +1,358 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ue9.h"
+#include "nerdjack.h"
+#include "libethstream.h"
+
+struct ethstream {
+	char *address;
+	int device;
+	int channel_count;
+	int channel_list[UE9_MAX_CHANNEL_COUNT];
+	int gain_count;
+	int gain_list[UE9_MAX_CHANNEL_COUNT];
+	int precision;
+	double rate;		/* actual scan rate */
+
+	/* UE9 */
+	uint8_t scanconfig;
+	uint16_t scaninterval;
+	int fd_cmd;
+	struct ue9Calibration calib;
+	struct ue9Conversion conv[UE9_MAX_CHANNEL_COUNT];
+	struct ue9_stream *ue9;
+	unsigned long long ue9_scans;	/* scans read since the start */
+
+	/* NerdJack */
+	unsigned long period;
+	struct nerd_session session;
+	struct nerd_state state;
+	struct nerd_stream *nerd;
+	struct nerd_block *nerd_block;
+
+	int fd_data;
+	int running;
+
+	/* Scans of the current block not yet read */
+	const uint16_t *pending;
+	int pending_scans;
+	struct ethstream_info info;
+};
+
+int ethstream_open(struct ethstream **esp, const struct ethstream_config *cfg)
+{
+	struct ethstream *es;
+	int i, max_count, max_channel;
+
+	*esp = NULL;
+
+	if (cfg->device == ETHSTREAM_DEVICE_UE9) {
+		max_count = UE9_MAX_CHANNEL_COUNT;
+		max_channel = UE9_MAX_CHANNEL;
+	} else if (cfg->device == ETHSTREAM_DEVICE_NERDJACK) {
+		max_count = NERDJACK_CHANNELS;
+		max_channel = NERDJACK_CHANNELS - 1;
+		if (cfg->gain_count) {
+			verb("NerdJack has no gains\n");
+			return -EINVAL;
+		}
+	} else {
+		verb("unknown device type %d\n", cfg->device);
+		return -EINVAL;
+	}
+
+	if (cfg->address == NULL || cfg->channel_count < 1 ||
+	    cfg->channel_count > max_count || cfg->gain_count < 0 ||
+	    cfg->gain_count > cfg->channel_count || cfg->rate <= 0) {
+		verb("bad configuration\n");
+		return -EINVAL;
+	}
+	for (i = 0; i < cfg->channel_count; i++) {
+		if (cfg->channel_list[i] < 0 ||
+		    cfg->channel_list[i] > max_channel) {
+			verb("channel %d is out of range\n",
+			     cfg->channel_list[i]);
+			return -EINVAL;
+		}
+	}
+
+	es = calloc(1, sizeof(*es));
+	if (es == NULL)
+		return -ENOMEM;
+	es->address = strdup(cfg->address);
+	if (es->address == NULL) {
+		free(es);
+		return -ENOMEM;
+	}
+
+	es->device = cfg->device;
+	es->channel_count = cfg->channel_count;
+	memcpy(es->channel_list, cfg->channel_list,
+	       cfg->channel_count * sizeof(int));
+	es->gain_count = cfg->gain_count;
+	if (cfg->gain_count)
+		memcpy(es->gain_list, cfg->gain_list,
+		       cfg->gain_count * sizeof(int));
+	es->precision = cfg->precision;
+	es->fd_cmd = -1;
+	es->fd_data = -1;
+	nerd_session_init(&es->session);
+
+	if (es->device == ETHSTREAM_DEVICE_UE9 ?
+	    ue9_choose_scan(cfg->rate, &es->rate, &es->scanconfig,
+			    &es->scaninterval) < 0 :
+	    nerdjack_choose_scan(cfg->rate, &es->rate, &es->period) < 0) {
+		verb("can't achieve scan rate %lf Hz\n", cfg->rate);
+		ethstream_close(es);
+		return -EINVAL;
+	}
+
+	*esp = es;
+	return 0;
+}
+
+double ethstream_rate(struct ethstream *es)
+{
+	return es->rate;
+}
+
+/* Same sequence as ethstream's doStream(), without the calibration
+   cache */
+static int start_ue9(struct ethstream *es)
+{
+	struct ue9_setup setup = {
+		.channel_list = es->channel_list,
+		.channel_count = es->channel_count,
+		.gain_list = es->gain_list,
+		.gain_count = es->gain_count,
+		.scanconfig = es->scanconfig,
+		.scaninterval = es->scaninterval,
+		.timer_divisor = 1,
+	};
+
+	ue9_setup_connect(&setup, es->address, UE9_COMMAND_PORT,
+			  UE9_DATA_PORT, &es->fd_cmd, &es->fd_data);
+	if (es->fd_cmd < 0 || es->fd_data < 0) {
+		verb("can't connect to %s\n", es->address);
+		return -ENOTCONN;
+	}
+	es->running = 1;
+
+	if (ue9_setup_prepare(&setup, es->fd_cmd, es->fd_data) < 0 ||
+	    ue9_setup_start(&setup, es->fd_cmd, &es->calib) < 0 ||
+	    ue9_conversion_setup(&es->calib, es->channel_count,
+				 es->channel_list, es->gain_count,
+				 es->gain_list, 12, es->conv) < 0)
+		return -EIO;
+
+	es->ue9_scans = 0;
+	es->ue9 = ue9_stream_begin(es->fd_data, NULL, NULL, NULL, es->rate,
+				   es->channel_count, es->channel_list,
+				   es->gain_count, es->gain_list);
+	if (es->ue9 == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Same sequence as ethstream's nerdDoStream(), for a new stream */
+static int start_nerdjack(struct ethstream *es)
+{
+	getPacket command;
+	int failed;
+
+	if (nerd_generate_command(&command, es->channel_list,
+				  es->channel_count, es->precision,
+				  es->period) < 0)
+		return -EINVAL;
+
+	if (nerd_session_commands(&es->session, es->address, 2,
+				  (void *[]) {"STOP", &command},
+				  (int[]) {4, sizeof(command)},
+				  &failed) < 0)
+		return (failed > 0) ? -EIO : -ENOTCONN;
+	es->running = 1;
+
+	es->fd_data = nerd_open(es->address, NERDJACK_DATA_PORT);
+	if (es->fd_data < 0) {
+		verb("can't connect to %s\n", es->address);
+		return -ENOTCONN;
+	}
+
+	memset(&es->state, 0, sizeof(es->state));
+	es->nerd = nerd_stream_begin(es->fd_data, es->channel_count,
+				     es->channel_list, es->precision, 0, 0,
+				     es->period, &es->state);
+	if (es->nerd == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+int ethstream_start(struct ethstream *es)
+{
+	int ret;
+
+	ethstream_stop(es);
+
+	if (es->device == ETHSTREAM_DEVICE_UE9)
+		ret = start_ue9(es);
+	else
+		ret = start_nerdjack(es);
+
+	if (ret < 0)
+		ethstream_stop(es);
+	return ret;
+}
+
+/* Get the next block of scans.  Returns < 0 on error, 0 at the end. */
+static int next_block(struct ethstream *es)
+{
+	struct ue9_scan_block *ub;
+	struct nerd_block *nb;
+	int ret;
+
+	if (es->ue9) {
+		/* A UE9 doesn't end the stream by itself */
+		ret = ue9_stream_next(es->ue9, &ub);
+		if (ret <= 0)
+			return -EIO;
+		es->pending = ub->data;
+		es->pending_scans = ub->scans;
+		es->info.backlog[0] = ub->comm_backlog;
+		es->info.backlog[1] = ub->control_backlog;
+		return 1;
+	}
+
+	if (es->nerd) {
+		ret = nerd_stream_next(es->nerd, &nb);
+		if (ret <= 0)
+			return (ret == 0) ? 0 : -EIO;
+		es->pending = nb->raw;
+		es->pending_scans = nb->scans;
+		es->info.first_packet = es->state.packets - 1;
+		es->info.last_packet = es->state.packets - 1;
+		es->info.backlog[0] = nb->adcused;
+		es->info.backlog[1] = nb->packetsready;
+		return 1;
+	}
+
+	return -EINVAL;
+}
+
+int ethstream_read(struct ethstream *es, uint16_t * buf, int max_scans,
+		   struct ethstream_info *info)
+{
+	int ret, n;
+
+	while (es->pending_scans == 0) {
+		ret = next_block(es);
+		if (ret <= 0)
+			return ret;
+	}
+
+	n = (max_scans < es->pending_scans) ? max_scans : es->pending_scans;
+	memcpy(buf, es->pending, n * es->channel_count * sizeof(*buf));
+	es->pending += n * es->channel_count;
+	es->pending_scans -= n;
+
+	/* A NerdJack block is one packet.  UE9 packets hold 16 samples
+	   each from the start of the stream, so these n scans come from
+	   the packets holding their first and last samples, even though
+	   the block spans more. */
+	if (es->ue9) {
+		es->info.first_packet = es->ue9_scans * es->channel_count / 16;
+		es->info.last_packet = ((es->ue9_scans + n) *
+					es->channel_count - 1) / 16;
+		es->ue9_scans += n;
+	}
+
+	if (info)
+		*info = es->info;
+	return n;
+}
+
+int ethstream_volts(struct ethstream *es, const uint16_t * raw, int scans,
+		    double *volts)
+{
+	int i, n = es->channel_count;
+	double scale[NERDJACK_CHANNELS];
+
+	if (es->device == ETHSTREAM_DEVICE_UE9) {
+		for (i = 0; i < scans; i++)
+			ue9_convert_scan(es->conv, n, raw + i * n,
+					 volts + i * n);
+		return 0;
+	}
+
+	/* NerdJack samples are offset binary, with the range set for
+	   each half of the channels */
+	for (i = 0; i < n; i++) {
+		if (es->channel_list[i] <= 5)
+			scale[i] = (es->precision & 0x01) ? 5.0 : 10.0;
+		else
+			scale[i] = (es->precision & 0x02) ? 5.0 : 10.0;
+	}
+	for (i = 0; i < scans * n; i++)
+		volts[i] = (double)(((int)raw[i] - 32768) / 32767.0) *
+		    scale[i % n];
+	return 0;
+}
+
+void ethstream_stop(struct ethstream *es)
+{
+	if (es->ue9) {
+		ue9_stream_end(es->ue9);
+		es->ue9 = NULL;
+	}
+	if (es->nerd) {
+		nerd_stream_end(es->nerd);
+		es->nerd = NULL;
+	}
+	es->pending_scans = 0;
+
+	/* Leave the device idle */
+	if (es->running) {
+		if (es->device == ETHSTREAM_DEVICE_UE9) {
+			ue9_stream_stop(es->fd_cmd);
+			ue9_buffer_flush(es->fd_cmd);
+		} else {
+			nerd_session_command(&es->session, es->address,
+					     "STOP", 4);
+		}
+		es->running = 0;
+	}
+
+	if (es->fd_data >= 0) {
+		if (es->device == ETHSTREAM_DEVICE_UE9)
+			ue9_close(es->fd_data);
+		else
+			nerd_close_conn(es->fd_data);
+		es->fd_data = -1;
+	}
+	if (es->fd_cmd >= 0) {
+		ue9_close(es->fd_cmd);
+		es->fd_cmd = -1;
+	}
+	nerd_session_close(&es->session);
+}
+
+void ethstream_close(struct ethstream *es)
+{
+	if (es == NULL)
+		return;
+	ethstream_stop(es);
+	free(es->address);
+	free(es);
+}
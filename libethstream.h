@@ -0,0 +1,108 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef LIBETHSTREAM_H
+#define LIBETHSTREAM_H
+
+#include <stdint.h>
+
+/* Streaming interface to a LabJack UE9 or NerdJack, for programs that
+   want the samples themselves rather than ethstream's output.
+
+     struct ethstream_config cfg = {
+             .address = "192.168.1.209",
+             .device = ETHSTREAM_DEVICE_UE9,
+             .channel_count = 2,
+             .channel_list = (int[]) {0, 1},
+             .rate = 8000,
+     };
+     struct ethstream *es;
+     uint16_t buf[1024 * 2];
+     int n;
+
+     if (ethstream_open(&es, &cfg) < 0 || ethstream_start(es) < 0)
+             ...
+     while ((n = ethstream_read(es, buf, 1024, NULL)) > 0)
+             ... n scans of 2 samples each in buf ...
+     ethstream_close(es);
+
+   All state lives in the handle, so each thread can stream its own
+   device.  Nothing is written to stdout; diagnostics go to stderr,
+   as they do for ethstream.  Functions return a negative errno value
+   on error:
+
+     -EINVAL    the configuration can't be used with the device
+     -ENOTCONN  the device can't be reached
+     -EIO       a command failed, or the stream broke off
+     -ENOMEM    out of memory */
+
+#define ETHSTREAM_DEVICE_NERDJACK 1
+#define ETHSTREAM_DEVICE_UE9 2
+
+struct ethstream_config {
+	const char *address;	/* host name or IP address */
+	int device;		/* ETHSTREAM_DEVICE_* */
+	int channel_count;
+	const int *channel_list;
+	int gain_count;		/* UE9 only; 0 for bipolar gain 1 */
+	const int *gain_list;
+	int precision;		/* NerdJack range: bit 0 for 5 V on channels
+				   0-5, bit 1 on 6-11, else 10 V */
+	double rate;		/* desired scans per second */
+};
+
+/* Where the scans from ethstream_read() came from */
+struct ethstream_info {
+	/* Device packets holding the first and last sample of the scans
+	   that were returned, counted from 0 at the start of the stream.
+	   A UE9 scan can span two packets. */
+	unsigned long first_packet;
+	unsigned long last_packet;
+	/* Backlogs reported by the most recent packet received, which
+	   may be later than last_packet: CommBacklog and ControlBacklog
+	   in bytes for a UE9, adcused and packetsready for a NerdJack */
+	int backlog[2];
+};
+
+struct ethstream;
+
+/* Check the configuration and allocate a handle for it.  The device
+   isn't contacted yet. */
+int ethstream_open(struct ethstream **es, const struct ethstream_config *cfg);
+
+/* Scan rate the device will actually use, which is as close to the
+   requested one as it can get */
+double ethstream_rate(struct ethstream *es);
+
+/* Configure the device and start streaming */
+int ethstream_start(struct ethstream *es);
+
+/* Wait for data and copy up to max_scans complete scans to buf, which
+   holds max_scans * channel_count samples.  Returns the number of
+   scans, or 0 once a NerdJack has closed the data connection.  Raw
+   samples are unsigned 16-bit values, as ethstream writes them in
+   decimal.  If info is not NULL, it describes where the scans came
+   from. */
+int ethstream_read(struct ethstream *es, uint16_t * buf, int max_scans,
+		   struct ethstream_info *info);
+
+/* Convert scans from ethstream_read() to volts, or degrees Kelvin for
+   the UE9 temperature sensor; UE9 digital and timer channels keep
+   their value.  For a UE9, this uses the calibration read from the
+   device by ethstream_start(). */
+int ethstream_volts(struct ethstream *es, const uint16_t * raw, int scans,
+		    double *volts);
+
+/* Stop streaming.  ethstream_start() can then start over. */
+void ethstream_stop(struct ethstream *es);
+
+/* Stop streaming and free the handle */
+void ethstream_close(struct ethstream *es);
+
+#endif
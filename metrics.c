@@ -0,0 +1,202 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef __WIN32__
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "debug.h"
+#include "compat.h"
+#include "binary.h"
+#include "metrics.h"
+
+/* Only the streaming thread writes, so plain read-modify-write is
+   fine; the stores just have to be whole for the server */
+#define SET(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+void metrics_init(struct metrics *m, int index, const char *address,
+		  struct output *out)
+{
+	memset(m, 0, sizeof(*m));
+	m->index = index;
+	m->address = address;
+	m->out = out;
+}
+
+static void gauge_add(struct metrics_gauge *g, unsigned long v)
+{
+	if (g->count == 0 || v < g->min)
+		SET(g->min, v);
+	if (v > g->max)
+		SET(g->max, v);
+	SET(g->last, v);
+	SET(g->sum, g->sum + v);
+	SET(g->count, g->count + 1);
+}
+
+void metrics_packet(struct metrics *m, unsigned int samples,
+		    unsigned long backlog0, unsigned long backlog1)
+{
+	SET(m->packets, m->packets + 1);
+	SET(m->samples, m->samples + samples);
+	gauge_add(&m->backlog[0], backlog0);
+	gauge_add(&m->backlog[1], backlog1);
+}
+
+void metrics_gap(struct metrics *m)
+{
+	SET(m->gaps, m->gaps + 1);
+}
+
+void metrics_reconnect(struct metrics *m)
+{
+	SET(m->reconnects, m->reconnects + 1);
+}
+
+static size_t gauge_format(struct metrics_gauge *g, const char *name,
+			   char *buf, size_t len)
+{
+	unsigned long count = GET(g->count);
+	unsigned long long sum = GET(g->sum);
+
+	return snprintf(buf, len, " %s_last=%lu %s_min=%lu %s_avg=%.1f "
+			"%s_max=%lu", name, GET(g->last), name, GET(g->min),
+			name, count ? (double)sum / count : 0.0, name,
+			GET(g->max));
+}
+
+size_t metrics_format(struct metrics *m, char *buf, size_t len)
+{
+	static const char *names[][2] = {
+		{ "backlog0", "backlog1" },
+		{ "adcused", "packetsready" },	/* BINARY_DEVICE_NERDJACK */
+		{ "comm_backlog", "control_backlog" },	/* BINARY_DEVICE_UE9 */
+	};
+	int device = GET(m->device);
+	const char *type = (device == BINARY_DEVICE_UE9) ? "ue9" :
+	    (device == BINARY_DEVICE_NERDJACK) ? "nerdjack" : "none";
+	size_t n;
+	int i;
+
+	if (device != BINARY_DEVICE_UE9 && device != BINARY_DEVICE_NERDJACK)
+		device = 0;
+
+	n = snprintf(buf, len, "device=%d address=%s type=%s packets=%lu "
+		     "samples=%llu bytes=%llu reconnects=%lu gaps=%lu",
+		     m->index, m->address, type, GET(m->packets),
+		     GET(m->samples), m->out ? GET(m->out->written) : 0ULL,
+		     GET(m->reconnects), GET(m->gaps));
+	for (i = 0; i < 2 && n < len; i++)
+		n += gauge_format(&m->backlog[i], names[device][i], buf + n,
+				  len - n);
+	if (n < len - 1) {
+		buf[n++] = '\n';
+		buf[n] = '\0';
+	}
+	return (n < len) ? n : len - 1;
+}
+
+#ifndef __WIN32__
+
+static struct {
+	int fd;
+	char path[108];
+	struct metrics **list;
+	int count;
+	pthread_t thread;
+} server;
+
+static void metrics_unlink(void)
+{
+	unlink(server.path);
+}
+
+/* Answer each client with a snapshot, one at a time */
+static void *metrics_thread(void *arg)
+{
+	char buf[1024];
+	size_t len;
+	int fd, i;
+
+	for (;;) {
+		fd = accept(server.fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			verb("metrics server stopped: %s\n",
+			     compat_strerror(errno));
+			return NULL;
+		}
+		for (i = 0; i < server.count; i++) {
+			len = metrics_format(server.list[i], buf,
+					     sizeof(buf));
+			if (send(fd, buf, len, MSG_NOSIGNAL) !=
+			    (ssize_t)len)
+				break;
+		}
+		close(fd);
+	}
+}
+
+int metrics_serve(const char *path, struct metrics **list, int count)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		info("Metrics socket path is too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	strcpy(server.path, path);
+	server.list = list;
+	server.count = count;
+
+	server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server.fd < 0)
+		goto fail;
+
+	/* A socket left behind by an earlier run is in the way */
+	unlink(path);
+	if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(server.fd, 4) < 0)
+		goto fail_close;
+	atexit(metrics_unlink);
+
+	if (pthread_create(&server.thread, NULL, metrics_thread, NULL) != 0)
+		goto fail_close;
+	pthread_detach(server.thread);
+	return 0;
+
+ fail_close:
+	close(server.fd);
+ fail:
+	info("Can't serve metrics on %s: %s\n", path, compat_strerror(errno));
+	return -1;
+}
+
+#else				/* __WIN32__ */
+
+int metrics_serve(const char *path, struct metrics **list, int count)
+{
+	info("Metrics socket is not supported on Windows\n");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+#include "output.h"
+
+/* Running counters and gauges for one device.  They are updated by
+   the thread streaming the device, and can be read at any time by the
+   metrics server without disturbing it.
+
+   The two backlog gauges are what the device reports in every packet:
+   CommBacklog and ControlBacklog in bytes for a UE9, adcused and
+   packetsready for a NerdJack. */
+struct metrics_gauge {
+	unsigned long last;
+	unsigned long min;
+	unsigned long max;
+	unsigned long count;
+	unsigned long long sum;
+};
+
+struct metrics {
+	int index;		/* device number */
+	const char *address;
+	int device;		/* BINARY_DEVICE_*, 0 before streaming */
+	unsigned long packets;
+	unsigned long long samples;
+	unsigned long reconnects;
+	unsigned long gaps;
+	struct metrics_gauge backlog[2];
+	struct output *out;	/* for the bytes written */
+};
+
+void metrics_init(struct metrics *m, int index, const char *address,
+		  struct output *out);
+
+/* Count a packet holding "samples" samples, with the device's two
+   backlog values */
+void metrics_packet(struct metrics *m, unsigned int samples,
+		    unsigned long backlog0, unsigned long backlog1);
+
+void metrics_gap(struct metrics *m);
+void metrics_reconnect(struct metrics *m);
+
+/* Format one line of key=value pairs for m.  Returns its length. */
+size_t metrics_format(struct metrics *m, char *buf, size_t len);
+
+/* Listen on a Unix-domain socket at path.  Each client that connects
+   gets one line per device, and is then disconnected, e.g.:
+
+     device=0 address=192.168.1.209 type=ue9 packets=N samples=N
+       bytes=N reconnects=N gaps=N comm_backlog_last=N
+       comm_backlog_min=N comm_backlog_avg=X comm_backlog_max=N ...
+
+   The socket is removed at exit.  Returns < 0 on error. */
+int metrics_serve(const char *path, struct metrics **list, int count);
+
+#endif
@@ -0,0 +1,489 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+/* NerdJack simulator.  Listens on the NerdJack command and data ports
+   and speaks enough of the protocol for ethstream: STOP, GETD, SETC
+   and VERS on the command port, and a stream of 1460-byte data
+   packets on the data port.  Faults can be injected to exercise the
+   recovery paths. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "opt.h"
+#include "netutil.h"
+#include "evloop.h"
+#include "nerdjack.h"
+
+#define SIM_VERSION "NerdJack simulator 1.0"
+#define SIM_WAVE 4096		/* entries in one cycle of the test signal */
+#define SIM_HZ 60.0		/* frequency of the test signal */
+#define SIM_BURST 64		/* most packets sent per wakeup */
+
+struct options opt[] = {
+	{'a', "address", "string", "address to listen on (127.0.0.1)"},
+	{'f', "fast", NULL, "send packets as fast as possible"},
+	{'r', "reset", "n", "reset the device after every n packets"},
+	{'d', "drop", "n", "drop the data connection after every n packets"},
+	{'s', "skip", "n", "skip a packet number after every n packets"},
+	{'c', "count", "n", "exit after sending n packets"},
+	{'v', "verbose", NULL, "be verbose"},
+	{'h', "help", NULL, "this help"},
+	{0, NULL, NULL, NULL}
+};
+
+struct sim {
+	const char *address;
+	int fast;
+	unsigned long reset_every;
+	unsigned long drop_every;
+	unsigned long skip_every;
+	unsigned long max_packets;
+
+	struct evloop ev;
+	int fd_cmd_listen, fd_data_listen;
+	int fd_cmd, fd_data;	/* -1 if not connected */
+	uint8_t cmdbuf[64];
+	int cmdlen;
+
+	/* Acquisition */
+	int started;
+	int sampled;		/* channels per scan */
+	int groups;		/* scans per packet */
+	unsigned long period;
+	double interval;	/* seconds per packet */
+	unsigned short count;	/* next packet number */
+	unsigned long scan;	/* scans generated so far */
+	unsigned long sent;	/* packets sent, over all streams */
+	struct timeval next;	/* when the next packet is due */
+
+	int16_t wave[SIM_WAVE];
+};
+
+static void tv_add(struct timeval *tv, double seconds)
+{
+	long usec = (long)(seconds * 1e6);
+
+	tv->tv_sec += usec / 1000000;
+	tv->tv_usec += usec % 1000000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+static int sim_listen(struct sim *sim, int port)
+{
+	struct sockaddr_in sa;
+	int fd, one = 1;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = inet_addr(sim->address);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(fd, 4) < 0) {
+		info("can't listen on %s:%d: %s\n", sim->address, port,
+		     strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Replace *fd with a newly accepted connection */
+static void sim_accept(struct sim *sim, int listen_fd, int *fd)
+{
+	int newfd = accept(listen_fd, NULL, NULL);
+
+	if (newfd < 0)
+		return;
+	if (*fd >= 0) {
+		evloop_remove(&sim->ev, *fd);
+		close(*fd);
+	}
+	*fd = newfd;
+	evloop_add(&sim->ev, newfd, EVLOOP_READ);
+}
+
+static void sim_close(struct sim *sim, int *fd)
+{
+	if (*fd < 0)
+		return;
+	evloop_remove(&sim->ev, *fd);
+	close(*fd);
+	*fd = -1;
+}
+
+/* Close with a reset instead of a FIN, like a device that went
+   away.  A clean close would look like the end of the stream. */
+static void sim_abort(struct sim *sim, int *fd)
+{
+	struct linger lg = { 1, 0 };
+
+	if (*fd >= 0)
+		setsockopt(*fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	sim_close(sim, fd);
+}
+
+static void sim_reply(struct sim *sim, int ok)
+{
+	if (send(sim->fd_cmd, ok ? "OK" : "NO", 3, 0) != 3)
+		sim_close(sim, &sim->fd_cmd);
+}
+
+/* Start sending packets on the data connection, one packet time from
+   now, since the device has to fill the first one */
+static void sim_schedule(struct sim *sim)
+{
+	struct timeval timeout = { 0, 0 };
+
+	if (sim->fd_data < 0)
+		return;
+	gettimeofday(&sim->next, NULL);
+	if (!sim->fast) {
+		tv_add(&sim->next, sim->interval);
+		tv_add(&timeout, sim->interval);
+	}
+	evloop_set_timeout(&sim->ev, sim->fd_data, &timeout);
+}
+
+static void sim_getd(struct sim *sim, getPacket * cmd)
+{
+	unsigned short channelbit = ntohs(cmd->channelbit);
+	int i;
+
+	sim->period = ntohl(cmd->period);
+	sim->sampled = 0;
+	for (i = 0; i < NERDJACK_CHANNELS; i++)
+		if (channelbit & (1 << i))
+			sim->sampled = i + 1;
+	if (sim->sampled == 0 || sim->period == 0) {
+		sim_reply(sim, 0);
+		return;
+	}
+
+	sim->groups = NERDJACK_NUM_SAMPLES / sim->sampled;
+	sim->interval = (double)sim->groups * sim->period /
+	    NERDJACK_CLOCK_RATE;
+	sim->count = 0;
+	sim->scan = 0;
+	sim->started = 1;
+	verb("GETD: %d channels at %.1f Hz, packet every %.3f ms\n",
+	     sim->sampled, (double)NERDJACK_CLOCK_RATE / sim->period,
+	     sim->interval * 1000);
+	sim_reply(sim, 1);
+	sim_schedule(sim);
+}
+
+static void sim_setc(struct sim *sim, const char *arg)
+{
+	char num[6];
+	int count;
+
+	memcpy(num, arg, 5);
+	num[5] = '\0';
+	count = atoi(num);
+
+	/* After a reset there is nothing to resume */
+	if (!sim->started) {
+		verb("SETC %d refused, not started\n", count);
+		sim_reply(sim, 0);
+		return;
+	}
+
+	verb("SETC %d\n", count);
+	sim->count = count;
+	sim->scan = (unsigned long)count * sim->groups;
+	sim_reply(sim, 1);
+	sim_schedule(sim);
+}
+
+static void sim_vers(struct sim *sim)
+{
+	static const char reply[] = SIM_VERSION "OK";
+
+	/* The version string goes out with its NUL, then the connection
+	   is closed to end it */
+	if (send(sim->fd_cmd, reply, sizeof(reply), 0) < 0)
+		verb("can't send version\n");
+	sim_close(sim, &sim->fd_cmd);
+}
+
+/* Handle every complete command in the buffer.  Commands aren't
+   delimited, so their length follows from the first four bytes. */
+static void sim_commands(struct sim *sim)
+{
+	int len;
+
+	while (sim->cmdlen >= 4 && sim->fd_cmd >= 0) {
+		if (memcmp(sim->cmdbuf, "GETD", 4) == 0)
+			len = sizeof(getPacket);
+		else if (memcmp(sim->cmdbuf, "SETC", 4) == 0)
+			len = 9;
+		else
+			len = 4;
+		if (sim->cmdlen < len)
+			return;
+
+		if (memcmp(sim->cmdbuf, "STOP", 4) == 0) {
+			verb("STOP\n");
+			sim->started = 0;
+			sim_close(sim, &sim->fd_data);
+			sim_reply(sim, 1);
+		} else if (len == sizeof(getPacket)) {
+			sim_getd(sim, (getPacket *) sim->cmdbuf);
+		} else if (len == 9) {
+			sim_setc(sim, (char *)sim->cmdbuf + 4);
+		} else if (memcmp(sim->cmdbuf, "VERS", 4) == 0) {
+			sim_vers(sim);
+		} else {
+			verb("unknown command %.4s\n", sim->cmdbuf);
+			sim_reply(sim, 0);
+		}
+
+		sim->cmdlen -= len;
+		memmove(sim->cmdbuf, sim->cmdbuf + len, sim->cmdlen);
+	}
+}
+
+static void sim_command_read(struct sim *sim)
+{
+	ssize_t ret;
+
+	ret = recv(sim->fd_cmd, sim->cmdbuf + sim->cmdlen,
+		   sizeof(sim->cmdbuf) - sim->cmdlen, 0);
+	if (ret <= 0) {
+		sim_close(sim, &sim->fd_cmd);
+		sim->cmdlen = 0;
+		return;
+	}
+	sim->cmdlen += ret;
+	sim_commands(sim);
+}
+
+/* Build the next packet: a sine wave on each channel, each a bit
+   further along in phase */
+static void sim_packet(struct sim *sim, uint8_t * pkt, int behind)
+{
+	uint16_t *data = (uint16_t *) (pkt + 8);
+	double rate = (double)NERDJACK_CLOCK_RATE / sim->period;
+	double step = SIM_WAVE * SIM_HZ / rate;
+	int g, c, i = 0;
+
+	pkt[0] = 0xF0;
+	pkt[1] = 0xAA;
+	*(uint16_t *) (pkt + 2) = htons(sim->count);
+	*(uint16_t *) (pkt + 4) = htons(sim->groups * sim->sampled);
+	*(uint16_t *) (pkt + 6) = htons(behind);
+
+	for (g = 0; g < sim->groups; g++, sim->scan++) {
+		unsigned long phase = (unsigned long)(sim->scan * step);
+		for (c = 0; c < sim->sampled; c++) {
+			int16_t v = sim->wave[(phase + c * SIM_WAVE / 12) %
+					      SIM_WAVE];
+			data[i++] = htons((uint16_t) v);
+		}
+	}
+	for (; i < NERDJACK_NUM_SAMPLES; i++)
+		data[i] = 0;
+}
+
+/* Injected faults, checked after each packet.  Returns 1 if the data
+   connection is gone. */
+static int sim_faults(struct sim *sim)
+{
+	if (sim->reset_every && sim->sent % sim->reset_every == 0) {
+		verb("injecting reset after packet %hu\n", sim->count);
+		sim->started = 0;
+		sim->count = 0;
+		sim_abort(sim, &sim->fd_data);
+		return 1;
+	}
+	if (sim->drop_every && sim->sent % sim->drop_every == 0) {
+		verb("dropping data connection after packet %hu\n",
+		     sim->count);
+		sim_abort(sim, &sim->fd_data);
+		return 1;
+	}
+	if (sim->skip_every && sim->sent % sim->skip_every == 0) {
+		verb("skipping packet %hu\n", sim->count);
+		sim->count++;
+		sim->scan += sim->groups;
+	}
+	return 0;
+}
+
+/* Send every packet that is due, or a burst in fast mode */
+static void sim_send(struct sim *sim)
+{
+	uint8_t pkt[NERDJACK_PACKET_SIZE];
+	struct timeval now, timeout = { 0, 0 };
+	int due, n;
+
+	gettimeofday(&now, NULL);
+	for (due = 0; due < SIM_BURST; due++) {
+		if (!sim->fast && timercmp(&now, &sim->next, <))
+			break;
+		sim_packet(sim, pkt, due);
+		if (send(sim->fd_data, pkt, sizeof(pkt), 0) !=
+		    (ssize_t) sizeof(pkt)) {
+			verb("data connection closed\n");
+			sim_close(sim, &sim->fd_data);
+			return;
+		}
+		sim->count++;
+		sim->sent++;
+		tv_add(&sim->next, sim->interval);
+
+		if (sim->max_packets && sim->sent >= sim->max_packets) {
+			info("sent %lu packets\n", sim->sent);
+			exit(0);
+		}
+		if (sim_faults(sim))
+			return;
+	}
+
+	if (!sim->fast && timercmp(&now, &sim->next, <)) {
+		n = (sim->next.tv_sec - now.tv_sec) * 1000000 +
+		    (sim->next.tv_usec - now.tv_usec);
+		timeout.tv_sec = n / 1000000;
+		timeout.tv_usec = n % 1000000;
+	}
+	evloop_set_timeout(&sim->ev, sim->fd_data, &timeout);
+}
+
+static void sim_data_event(struct sim *sim, int events)
+{
+	char buf[64];
+
+	if (events & EVLOOP_TIMEOUT) {
+		if (sim->started)
+			sim_send(sim);
+		else
+			evloop_set_timeout(&sim->ev, sim->fd_data, NULL);
+		return;
+	}
+
+	/* Nothing is expected from the client, except hanging up */
+	if (recv(sim->fd_data, buf, sizeof(buf), 0) <= 0) {
+		verb("data connection closed\n");
+		sim_close(sim, &sim->fd_data);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim sim;
+	struct evloop_event events[EVLOOP_MAX_FDS];
+	int optind, i, n;
+	char *optarg, *endp;
+	char c;
+	unsigned long *arg;
+	FILE *help = stderr;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.address = "127.0.0.1";
+	sim.fd_cmd = sim.fd_data = -1;
+
+	opt_init(&optind);
+	while ((c = opt_parse(argc, argv, &optind, &optarg, opt)) != 0) {
+		arg = NULL;
+		switch (c) {
+		case 'a':
+			sim.address = optarg;
+			break;
+		case 'f':
+			sim.fast++;
+			break;
+		case 'r':
+			arg = &sim.reset_every;
+			break;
+		case 'd':
+			arg = &sim.drop_every;
+			break;
+		case 's':
+			arg = &sim.skip_every;
+			break;
+		case 'c':
+			arg = &sim.max_packets;
+			break;
+		case 'v':
+			verb_count++;
+			break;
+		case 'h':
+			help = stdout;
+		default:
+ printhelp:
+			fprintf(help, "Usage: %s [options]\n", *argv);
+			opt_help(opt, help);
+			fprintf(help, "Simulate a NerdJack for ethstream -N.\n");
+			return (help == stdout) ? 0 : 1;
+		}
+		if (arg) {
+			*arg = strtoul(optarg, &endp, 0);
+			if (*endp || *arg == 0) {
+				info("bad number: %s\n", optarg);
+				goto printhelp;
+			}
+		}
+	}
+
+	for (i = 0; i < SIM_WAVE; i++)
+		sim.wave[i] = (int16_t)(30000 * sin(2 * M_PI * i / SIM_WAVE));
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (evloop_init(&sim.ev) < 0)
+		return 1;
+	sim.fd_cmd_listen = sim_listen(&sim, NERDJACK_COMMAND_PORT);
+	sim.fd_data_listen = sim_listen(&sim, NERDJACK_DATA_PORT);
+	if (sim.fd_cmd_listen < 0 || sim.fd_data_listen < 0)
+		return 1;
+	evloop_add(&sim.ev, sim.fd_cmd_listen, EVLOOP_READ);
+	evloop_add(&sim.ev, sim.fd_data_listen, EVLOOP_READ);
+	info("NerdJack simulator listening on %s\n", sim.address);
+
+	for (;;) {
+		n = evloop_wait(&sim.ev, events, EVLOOP_MAX_FDS);
+		if (n < 0) {
+			info("wait failed: %s\n", strerror(errno));
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			int fd = events[i].fd;
+
+			if (fd == sim.fd_cmd_listen) {
+				sim_accept(&sim, fd, &sim.fd_cmd);
+				sim.cmdlen = 0;
+			} else if (fd == sim.fd_data_listen) {
+				sim_accept(&sim, fd, &sim.fd_data);
+				if (sim.started)
+					sim_schedule(&sim);
+			} else if (fd == sim.fd_cmd) {
+				sim_command_read(&sim);
+			} else if (fd == sim.fd_data) {
+				sim_data_event(&sim, events[i].events);
+			}
+		}
+	}
+}
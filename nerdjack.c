@@ -24,8 +24,16 @@
 #include "util.h"
 #include "netutil.h"
 #include "ethstream.h"
+#include "binary.h"
+#include "format.h"
+#include "simd.h"
+#include "ring.h"
+#include "prof.h"
+#include "metrics.h"
+#include "shmring.h"
 
 #define NERD_HEADER_SIZE 8
+#define NERDJACK_RING_SLOTS 1024
 #define MAX_SOCKETS 32
 
 typedef struct __attribute__ ((__packed__)) {
@@ -326,12 +334,13 @@ int nerdjack_detect(char *ipAddress)
 }
 
  /*
-  * Get the NerdJack version string and print it
+  * Get the NerdJack version string into version
   */
-int nerd_get_version(const char *address)
+int nerd_get_version(const char *address, char *version, size_t len)
 {
 	int ret, fd_command;
-	char buf[200];
+	char buf[201];
+	size_t n;
 	fd_command = nerd_open(address, NERDJACK_COMMAND_PORT);
 	if (fd_command < 0) {
 		info("Connect failed: %s:%d\n", address, NERDJACK_COMMAND_PORT);
@@ -355,10 +364,14 @@ int nerd_get_version(const char *address)
 		verb("Error receiving command\n");
 		return -1;
 	}
+	buf[ret] = '\0';
+
 	//Slice off the "OK" from the string
-	buf[strlen(buf) - 2] = '\0';
+	n = strlen(buf);
+	if (n >= 2)
+		buf[n - 2] = '\0';
 
-	printf("%s\n", buf);
+	snprintf(version, len, "%s", buf);
 
 	return 0;
 }
@@ -369,53 +382,320 @@ int nerd_get_version(const char *address)
  */
 int nerd_send_command(const char *address, void *command, int length)
 {
-	int ret, fd_command;
+	struct nerd_session ns;
+	int ret;
+
+	nerd_session_init(&ns);
+	ret = nerd_session_command(&ns, address, command, length);
+	nerd_session_close(&ns);
+	return ret;
+}
+
+void nerd_session_init(struct nerd_session *ns)
+{
+	ns->fd = -1;
+	ns->address = NULL;
+	ns->single = 0;
+}
+
+static void session_disconnect(struct nerd_session *ns)
+{
+	if (ns->fd >= 0)
+		nerd_close_conn(ns->fd);
+	ns->fd = -1;
+}
+
+void nerd_session_close(struct nerd_session *ns)
+{
+	session_disconnect(ns);
+	free(ns->address);
+	ns->address = NULL;
+}
+
+/* One attempt at sending the commands on the current connection.
+   *done is set to the number of commands that got a reply. */
+static int session_try(struct nerd_session *ns, int count, void **commands,
+		       int *lengths, int *done)
+{
 	char buf[3];
-	fd_command = nerd_open(address, NERDJACK_COMMAND_PORT);
-	if (fd_command < 0) {
-		info("Connect failed: %s:%d\n", address, NERDJACK_COMMAND_PORT);
-		return -2;
+	int ret, i;
+
+	*done = 0;
+
+	/* Send every request before waiting for any reply */
+	for (i = 0; i < count; i++) {
+		ret = send_all_timeout(ns->fd, commands[i], lengths[i], 0,
+				       &(struct timeval) {
+				       .tv_sec = TIMEOUT});
+		if (ret < 0 || ret != lengths[i]) {
+			verb("short send %d\n", (int)ret);
+			return -2;
+		}
 	}
 
-	/* Send request */
-	ret = send_all_timeout(fd_command, command, length, 0, &(struct timeval) {
-			       .tv_sec = TIMEOUT});
-	if (ret < 0 || ret != length) {
-		verb("short send %d\n", (int)ret);
-		return -1;
+	for (i = 0; i < count; i++) {
+		ret = recv_all_timeout(ns->fd, buf, 3, 0, &(struct timeval) {
+				       .tv_sec = TIMEOUT});
+		if (ret < 0 || ret != 3) {
+			verb("Error receiving OK for command\n");
+			return -2;
+		}
+
+		if (buf[2] != '\0' || 0 != strcmp("OK", buf)) {
+			verb("Did not receive OK.  Received %.2s\n", buf);
+			/* Replies to the rest are still on their way */
+			for (i++; i < count; i++)
+				recv_all_timeout(ns->fd, buf, 3, 0,
+						 &(struct timeval) {
+						 .tv_sec = TIMEOUT});
+			return -4;
+		}
+		*done = i + 1;
 	}
 
-	ret = recv_all_timeout(fd_command, buf, 3, 0, &(struct timeval) {
-			       .tv_sec = TIMEOUT});
+	return 0;
+}
 
-	nerd_close_conn(fd_command);
+int nerd_session_commands(struct nerd_session *ns, const char *address,
+			  int count, void **commands, int *lengths,
+			  int *failed)
+{
+	int reused, ret, n, done, sent = 0;
+
+	if (ns->address && strcmp(ns->address, address) != 0)
+		nerd_session_close(ns);
+
+	while (sent < count) {
+		*failed = sent;
+		reused = (ns->fd >= 0);
+		if (!reused) {
+			ns->fd = nerd_open(address, NERDJACK_COMMAND_PORT);
+			if (ns->fd < 0) {
+				info("Connect failed: %s:%d\n", address,
+				     NERDJACK_COMMAND_PORT);
+				return -2;
+			}
+			if (ns->address == NULL)
+				ns->address = strdup(address);
+		}
 
-	if (ret < 0 || ret != 3) {
-		verb("Error receiving OK for command\n");
-		return -1;
+		n = ns->single ? 1 : count - sent;
+		ret = session_try(ns, n, commands + sent, lengths + sent,
+				  &done);
+		sent += done;
+		*failed = sent;
+		if (ret == 0) {
+			if (ns->single)
+				session_disconnect(ns);
+			continue;
+		}
+		if (ret != -2)
+			return ret;
+
+		session_disconnect(ns);
+		if (done > 0) {
+			/* It answered, then hung up: this NerdJack takes
+			   one command per connection */
+			verb("NerdJack closed the command connection, "
+			     "sending one command per connection\n");
+			ns->single = 1;
+		} else if (!reused) {
+			return -1;
+		} else {
+			/* Idle connection was dropped, try a fresh one */
+			debug("command connection was closed, reconnecting\n");
+		}
 	}
 
-	if (0 != strcmp("OK", buf)) {
-		verb("Did not receive OK.  Received %s\n", buf);
-		return -4;
+	return 0;
+}
+
+int nerd_session_command(struct nerd_session *ns, const char *address,
+			 void *command, int length)
+{
+	int failed;
+
+	return nerd_session_commands(ns, address, 1, &command, &length,
+				     &failed);
+}
+
+/* Plan for picking the requested channels out of a packet.  Built
+   once per stream, so unpacking a packet needs no index math beyond
+   the fixed channel offsets. */
+struct nerd_gather {
+	int channels;		/* channels requested */
+	int stride;		/* channels sampled per group */
+	int groups;		/* groups per packet */
+	int identity;		/* requested channels are 0..N-1 in order */
+	int offset[NERDJACK_CHANNELS];
+	void (*raw) (const struct nerd_gather *, const uint16_t *,
+		     uint16_t *);
+	void (*volts) (const struct nerd_gather *, const double *, double *);
+};
+
+#define NERD_GATHER(name, type)						\
+static void name(const struct nerd_gather *plan, const type *in,	\
+		 type *out)						\
+{									\
+	int g, i;							\
+									\
+	for (g = 0; g < plan->groups; g++) {				\
+		for (i = 0; i < plan->channels; i++)			\
+			out[i] = in[plan->offset[i]];			\
+		in += plan->stride;					\
+		out += plan->channels;					\
+	}								\
+}
+
+/* Same, with the channel count and stride fixed at compile time so
+   the inner loop unrolls into straight-line code */
+#define NERD_GATHER_FIXED(name, type, n)				\
+static void name(const struct nerd_gather *plan, const type *in,	\
+		 type *out)						\
+{									\
+	int g, i;							\
+									\
+	for (g = 0; g < plan->groups; g++) {				\
+		for (i = 0; i < n; i++)					\
+			out[i] = in[plan->offset[i]];			\
+		in += n;						\
+		out += n;						\
+	}								\
+}
+
+NERD_GATHER(gather_raw, uint16_t)
+NERD_GATHER(gather_volts, double)
+NERD_GATHER_FIXED(gather_raw_6, uint16_t, 6)
+NERD_GATHER_FIXED(gather_volts_6, double, 6)
+NERD_GATHER_FIXED(gather_raw_12, uint16_t, 12)
+NERD_GATHER_FIXED(gather_volts_12, double, 12)
+
+static void nerd_gather_plan(struct nerd_gather *plan, int numChannels,
+			     int *channel_list, int numChannelsSampled,
+			     int totalGroups)
+{
+	int i;
+
+	plan->channels = numChannels;
+	plan->stride = numChannelsSampled;
+	plan->groups = totalGroups;
+	plan->identity = (numChannels == numChannelsSampled);
+	for (i = 0; i < numChannels; i++) {
+		plan->offset[i] = channel_list[i];
+		if (channel_list[i] != i)
+			plan->identity = 0;
 	}
 
-	return 0;
+	//Common layouts like -C 0,3,1,4,2,5 get a fixed-size copy
+	if (numChannels == numChannelsSampled && numChannels == 6) {
+		plan->raw = gather_raw_6;
+		plan->volts = gather_volts_6;
+	} else if (numChannels == numChannelsSampled && numChannels == 12) {
+		plan->raw = gather_raw_12;
+		plan->volts = gather_volts_12;
+	} else {
+		plan->raw = gather_raw;
+		plan->volts = gather_volts;
+	}
 }
 
-int
-nerd_data_stream(int data_fd, int numChannels, int *channel_list,
-		 int precision, int convert, int lines, int showmem,
-		 unsigned short *currentcount, unsigned int period,
-		 int wasreset)
+/* Estimate what a reset cost, from the host time between the last
+   packet before it and the first one after.  Both mark the end of a
+   packet's scans, so everything sampled in between is lost except the
+   first packet's scans, less the line that always gets dumped. */
+static void nerd_gap_measure(struct nerd_state *state, struct timeval *now,
+			     double rate, int totalGroups,
+			     unsigned long *packets, unsigned long *scans,
+			     double *seconds)
+{
+	double expected;
+
+	*seconds = (now->tv_sec - state->last.tv_sec) +
+	    (now->tv_usec - state->last.tv_usec) / 1e6;
+	expected = floor(*seconds * rate + 0.5) - (totalGroups - 1);
+	*scans = (expected > 0) ? (unsigned long)expected : 0;
+	*packets = (*scans + totalGroups - 1) / totalGroups;
+}
+
+/* Write "scans" scans of the fill value, to stand in for lost data.
+   Volts output gets "nan", which can't be mistaken for a reading. */
+static int nerd_write_fill(struct output *out, int convert, int numChannels,
+			   uint16_t value, unsigned long scans)
 {
-	//Variables that should persist across retries
-	static dataPacket buf;
-	static int linesleft = 0;
-	static int linesdumped = 0;
+	uint16_t raw[NERDJACK_NUM_SAMPLES];
+	char line[FORMAT_LINE_SIZE(NERDJACK_CHANNELS)];
+	size_t len = 0;
+	int i, n, chunk = NERDJACK_NUM_SAMPLES / numChannels;
+
+	for (i = 0; i < chunk * numChannels; i++)
+		raw[i] = value;
+
+	switch (convert) {
+	case CONVERT_BINARY:
+		while (scans > 0) {
+			n = (scans > (unsigned long)chunk) ? chunk : (int)scans;
+			if (binary_write_data(out, raw, n * numChannels) < 0)
+				return -1;
+			scans -= n;
+		}
+		return 0;
+	case CONVERT_VOLTS:
+		for (i = 0; i < numChannels; i++) {
+			memcpy(line + len, "nan ", 4);
+			len += 4;
+		}
+		line[len++] = '\n';
+		break;
+	case CONVERT_HEX:
+		len = format_scan_hex(line, raw, numChannels);
+		break;
+	default:
+	case CONVERT_DEC:
+		len = format_scan_dec(line, raw, numChannels, 1);
+		break;
+	}
+
+	for (; scans > 0; scans--)
+		if (output_write(out, line, len) < 0)
+			return -1;
+	return 0;
+}
+
+/* State of a stream between nerd_stream_next() calls */
+struct nerd_stream {
+	struct receiver rx;
+	struct nerd_state *state;
+	int numChannels;
+	int volts;
+	int raw;		//raw samples too, for a shared memory ring
+	int showmem;
+	unsigned int period;
+	int totalGroups;
+	int totalSamples;
+	struct nerd_gather plan;
+
+	//Data lost to a reset is accounted for at the first packet
+	int gap;
+
+	//Whole packet, byte-swapped and converted in one pass
+	uint16_t packetraw[NERDJACK_NUM_SAMPLES];
+	double packetvolts[NERDJACK_NUM_SAMPLES];
+	double scale[NERDJACK_NUM_SAMPLES];
+
+	//Requested channels from the packet, as consecutive scans
+	uint16_t gatheredraw[NERDJACK_NUM_SAMPLES];
+	double gatheredvolts[NERDJACK_NUM_SAMPLES];
+
+	struct nerd_block block;
+};
 
-	//Variables essential to packet processing
-	signed short datapoint = 0;
+struct nerd_stream *nerd_stream_begin(int data_fd, int numChannels,
+				      int *channel_list, int precision,
+				      int volts, int showmem,
+				      unsigned int period,
+				      struct nerd_state *state)
+{
+	struct nerd_stream *ns;
 	int i;
 
 	int numChannelsSampled = channel_list[0] + 1;
@@ -427,34 +707,25 @@ nerd_data_stream(int data_fd, int numChannels, int *channel_list,
 			numChannelsSampled = channel_list[i] + 1;
 	}
 
-	double voltline[numChannels];
-
-	unsigned short dataline[numChannels];
+	ns = calloc(1, sizeof(*ns));
+	if (ns == NULL)
+		return NULL;
+	ns->state = state;
+	ns->numChannels = numChannels;
+	ns->volts = volts;
+	ns->raw = !volts || state->shm;
+	ns->showmem = showmem;
+	ns->period = period;
+	ns->block.channels = numChannels;
 
-	unsigned short packetsready = 0;
-	unsigned short adcused = 0;
-	unsigned short tempshort = 0;
-	int charsread = 0;
-
-	int numgroupsProcessed = 0;
-	double volts;
-
-	//The timeout should be the expected time plus 60 seconds
-	//This permits slower speeds to work properly
-	unsigned int expectedtimeout =
-	    (period * NERDJACK_NUM_SAMPLES / NERDJACK_CLOCK_RATE) + 60;
-
-	//Check to see if we're trying to resume
-	//Don't blow away linesleft in that case
-	if (lines != 0 && linesleft == 0) {
-		linesleft = lines;
-	}
 	//If there was a reset, we still need to dump a line because of faulty PDCA start
-	if (wasreset) {
-		linesdumped = 0;
+	if (state->wasreset) {
+		state->linesdumped = 0;
+		state->wasreset = 0;
+		ns->gap = (state->packets > 0);
 	}
 	//If this is the first time called, warn the user if we're too fast
-	if (linesdumped == 0) {
+	if (state->linesdumped == 0) {
 		if (period < (numChannelsSampled * 200 + 600)) {
 			info("You are sampling close to the limit of NerdJack\n");
 			info("Sample fewer channels or sample slower\n");
@@ -462,147 +733,330 @@ nerd_data_stream(int data_fd, int numChannels, int *channel_list,
 	}
 	//Now destination structure array is set as well as numDuplicates.
 
-	int totalGroups = NERDJACK_NUM_SAMPLES / numChannelsSampled;
+	ns->totalGroups = NERDJACK_NUM_SAMPLES / numChannelsSampled;
+	ns->totalSamples = ns->totalGroups * numChannelsSampled;
 
-	//Loop forever to grab data
-	while ((charsread =
-		recv_all_timeout(data_fd, &buf, NERDJACK_PACKET_SIZE, 0,
-				 &(struct timeval) {
-				 .tv_sec = expectedtimeout}))) {
-
-		if (charsread != NERDJACK_PACKET_SIZE) {
-			//There was a problem getting data.  Probably a closed
-			//connection.
-			info("Packet timed out or was too short\n");
-			return -2;
-		}
-		//First check the header info
-		if (buf.headerone != 0xF0 || buf.headertwo != 0xAA) {
-			info("No Header info\n");
-			return -1;
+	nerd_gather_plan(&ns->plan, numChannels, channel_list,
+			 numChannelsSampled, ns->totalGroups);
+
+	//Range of each sample in the packet, for volts conversion
+	for (i = 0; i < ns->totalSamples; i++) {
+		if (i % numChannelsSampled <= 5)
+			ns->scale[i] = (precision & 0x01) ? 5.0 : 10.0;
+		else
+			ns->scale[i] = (precision & 0x02) ? 5.0 : 10.0;
+	}
+
+	//A packet is due every totalGroups scans.  The first one may
+	//take a while longer, since the NerdJack has to fill it first.
+	double interval = (double)ns->totalGroups * period /
+	    NERDJACK_CLOCK_RATE;
+	struct timeval firsttimeout = {
+		.tv_sec = TIMEOUT + (long)(2 * interval),
+	};
+
+	if (receiver_start(&ns->rx, data_fd, NERDJACK_PACKET_SIZE,
+			   NERDJACK_RING_SLOTS, &firsttimeout, interval,
+			   state->capture) < 0) {
+		info("Failed to start receive thread\n");
+		free(ns);
+		return NULL;
+	}
+	return ns;
+}
+
+int nerd_stream_next(struct nerd_stream *ns, struct nerd_block **block)
+{
+	struct nerd_state *state = ns->state;
+	struct nerd_block *b = &ns->block;
+	int numChannels = ns->numChannels;
+	dataPacket *buf;
+	int charsread = 0;
+	unsigned short tempshort;
+	struct timeval now;
+	int first;
+	uint64_t t;
+
+	buf = receiver_next(&ns->rx, &charsread);
+	if (buf == NULL && charsread == 0)
+		return 0;
+
+	//Asked to stop from another thread
+	if (__atomic_load_n(&state->stop, __ATOMIC_RELAXED))
+		return 0;
+
+	if (buf == NULL) {
+		//There was a problem getting data.  Probably a closed
+		//connection.
+		info("Packet timed out or was too short\n");
+		return -2;
+	}
+	//First check the header info
+	t = prof_start();
+	if (buf->headerone != 0xF0 || buf->headertwo != 0xAA) {
+		info("No Header info\n");
+		return -1;
+	}
+	//Check counter info to make sure not out of order
+	tempshort = ntohs(buf->packetNumber);
+	if (tempshort != state->currentcount) {
+		info("Count wrong. Expected %hd but got %hd\n",
+		     state->currentcount, tempshort);
+		return -1;
+	}
+	prof_end(PROF_VERIFY, t);
+
+	//Increment number of packets received
+	state->currentcount++;
+	state->packets++;
+	receiver_time(&ns->rx, &now);
+
+	b->gap = 0;
+	if (ns->gap && !ns->showmem) {
+		ns->gap = 0;
+		b->gap = 1;
+		nerd_gap_measure(state, &now,
+				 (double)NERDJACK_CLOCK_RATE / ns->period,
+				 ns->totalGroups, &b->gap_packets,
+				 &b->gap_scans, &b->gap_seconds);
+		info("Lost %lu packets (%lu samples per channel) over "
+		     "%.3f s\n", b->gap_packets, b->gap_scans,
+		     b->gap_seconds);
+		if (state->metrics)
+			metrics_gap(state->metrics);
+		if (state->shm)
+			shmring_gap(state->shm);
+	}
+	state->last = now;
+
+	b->adcused = ntohs(buf->adcused);
+	b->packetsready = ntohs(buf->packetsready);
+
+	if (state->metrics)
+		metrics_packet(state->metrics,
+			       ns->showmem ? 0 : ns->totalGroups * numChannels,
+			       b->adcused, b->packetsready);
+
+	if (ns->showmem) {
+		receiver_release(&ns->rx);
+		b->scans = 0;
+		*block = b;
+		return 1;
+	}
+
+	//Convert the whole packet at once.  Volts are unpacked
+	//and converted in one go, which counts as converting.
+	t = prof_start();
+	if (ns->volts)
+		simd_unpack_volts((const int16_t *)((char *)buf +
+						    NERD_HEADER_SIZE),
+				  ns->scale, ns->packetvolts,
+				  ns->totalSamples);
+	if (ns->raw)
+		simd_unpack_raw((const int16_t *)((char *)buf +
+						  NERD_HEADER_SIZE),
+				ns->packetraw, ns->totalSamples);
+
+	//Done with the packet itself
+	receiver_release(&ns->rx);
+
+	//Pick the requested channels out into consecutive scans
+	b->raw = NULL;
+	b->volts = NULL;
+	if (ns->volts) {
+		b->volts = ns->packetvolts;
+		if (!ns->plan.identity) {
+			ns->plan.volts(&ns->plan, b->volts, ns->gatheredvolts);
+			b->volts = ns->gatheredvolts;
 		}
-		//Check counter info to make sure not out of order
-		tempshort = ntohs(buf.packetNumber);
-		if (tempshort != *currentcount) {
-			info("Count wrong. Expected %hd but got %hd\n",
-			     *currentcount, tempshort);
-			return -1;
+	}
+	if (ns->raw) {
+		b->raw = ns->packetraw;
+		if (!ns->plan.identity) {
+			ns->plan.raw(&ns->plan, b->raw, ns->gatheredraw);
+			b->raw = ns->gatheredraw;
 		}
-		//Increment number of packets received
-		*currentcount = *currentcount + 1;
+	}
+	prof_end(ns->volts ? PROF_CONVERT : PROF_UNPACK, t);
 
-		adcused = ntohs(buf.adcused);
-		packetsready = ntohs(buf.packetsready);
-		numgroupsProcessed = 0;
+	//We want to dump the first line because it's usually spurious
+	first = 0;
+	if (state->linesdumped == 0) {
+		state->linesdumped = 1;
+		first = 1;
+	}
+	b->scans = ns->totalGroups - first;
+	if (ns->volts)
+		b->volts += first * numChannels;
+	if (ns->raw)
+		b->raw += first * numChannels;
+
+	*block = b;
+	return 1;
+}
+
+void nerd_stream_end(struct nerd_stream *ns)
+{
+	receiver_stop(&ns->rx);
+	free(ns);
+}
+
+int
+nerd_data_stream(int data_fd, int numChannels, int *channel_list,
+		 int precision, int convert, int lines, int showmem,
+		 unsigned int period, struct nerd_state *state,
+		 struct output *out)
+{
+	struct nerd_stream *ns;
+	struct nerd_block *b;
+	int i, g, groups;
+	int retval;
+	uint64_t t;
+
+	//Output buffer space for one decimal or hex line
+	char *textline;
+	size_t linelen;
+
+	//Check to see if we're trying to resume
+	//Don't blow away linesleft in that case
+	if (lines != 0 && state->linesleft == 0) {
+		state->linesleft = lines;
+	}
+
+	ns = nerd_stream_begin(data_fd, numChannels, channel_list, precision,
+			       convert == CONVERT_VOLTS, showmem, period,
+			       state);
+	if (ns == NULL)
+		return -1;
+
+	//Flush while waiting for packets, which can be far apart
+	ns->rx.out = out;
+
+	//Loop forever to grab data
+	while ((retval = nerd_stream_next(ns, &b)) > 0) {
+		retval = 0;
+
+		if (b->gap) {
+			if (convert == CONVERT_BINARY) {
+				if (binary_write_gap(out, b->gap_packets,
+						     b->gap_scans,
+						     (uint64_t)(b->gap_seconds *
+								1e6)) < 0)
+					goto bad;
+			} else if (output_printf(out, "# gap: %lu packets, "
+						 "%lu samples per channel, "
+						 "%.6f s\n", b->gap_packets,
+						 b->gap_scans,
+						 b->gap_seconds) < 0)
+				goto bad;
+
+			if (state->fill) {
+				unsigned long gapscans = b->gap_scans;
+
+				if (lines != 0 &&
+				    gapscans > (unsigned long)state->linesleft)
+					gapscans = state->linesleft;
+				if (nerd_write_fill(out, convert, numChannels,
+						    state->fill_value,
+						    gapscans) < 0)
+					goto bad;
+				if (lines != 0) {
+					state->linesleft -= gapscans;
+					if (state->linesleft == 0)
+						goto out;
+				}
+			}
+		}
 
 		if (showmem) {
-			printf("%hd %hd\n", adcused, packetsready);
+			if (output_printf(out, "%hd %hd\n", b->adcused,
+					  b->packetsready) < 0)
+				goto bad;
+			if (output_poll(out) < 0)
+				goto bad;
 			continue;
 		}
-		//While there is still more data in the packet, process it
-		while (numgroupsProcessed < totalGroups) {
-			//Poison the data structure
-			switch (convert) {
-			case CONVERT_VOLTS:
-				memset(voltline, 0,
-				       numChannels * sizeof(double));
-				break;
-			default:
-			case CONVERT_HEX:
-			case CONVERT_DEC:
-				memset(dataline, 0,
-				       numChannels * sizeof(unsigned char));
-			}
 
-			//Read in each group
-			for (i = 0; i < numChannels; i++) {
-				//Get the datapoint associated with the desired channel
-				datapoint =
-				    ntohs(buf.data[channel_list[i] +
-						   numgroupsProcessed *
-						   numChannelsSampled]);
-
-				//Place it into the line
-				switch (convert) {
-				case CONVERT_VOLTS:
-					if (channel_list[i] <= 5) {
-						volts =
-						    (double)(datapoint /
-							     32767.0) *
-						    ((precision & 0x01) ? 5.0 :
-						     10.0);
-					} else {
-						volts =
-						    (double)(datapoint /
-							     32767.0) *
-						    ((precision & 0x02) ? 5.0 :
-						     10.0);
-					}
-					voltline[i] = volts;
-					break;
-				default:
-				case CONVERT_HEX:
-				case CONVERT_DEC:
-					dataline[i] =
-					    (unsigned short)(datapoint -
-							     INT16_MIN);
-					break;
+		groups = b->scans;
+		if (lines != 0 && groups > state->linesleft)
+			groups = state->linesleft;
+
+		if (state->shm)
+			shmring_publish(state->shm, b->raw, groups);
+
+		//Now print the groups
+		t = prof_start();
+		switch (convert) {
+		case CONVERT_BINARY:
+			if (groups > 0 &&
+			    binary_write_data(out, b->raw,
+					      groups * numChannels) < 0)
+				goto bad;
+			break;
+		case CONVERT_VOLTS:
+			for (g = 0; g < groups; g++) {
+				for (i = 0; i < numChannels; i++) {
+					if (output_printf(out, "%lf ",
+							  b->volts[g *
+								   numChannels
+								   + i]) < 0)
+						goto bad;
 				}
+				if (output_write(out, "\n", 1) < 0)
+					goto bad;
 			}
-			//We want to dump the first line because it's usually spurious
-			if (linesdumped != 0) {
-				//Now print the group
-				switch (convert) {
-				case CONVERT_VOLTS:
-					for (i = 0; i < numChannels; i++) {
-						if (printf("%lf ", voltline[i])
-						    < 0)
-							goto bad;
-					}
-					break;
-				case CONVERT_HEX:
-					for (i = 0; i < numChannels; i++) {
-						if (printf("%04hX", dataline[i])
-						    < 0)
-							goto bad;
-					}
-					break;
-				default:
-				case CONVERT_DEC:
-					for (i = 0; i < numChannels; i++) {
-						if (printf("%hu ", dataline[i])
-						    < 0)
-							goto bad;
-					}
-					break;
-				}
-				if (printf("\n") < 0)
+			break;
+		case CONVERT_HEX:
+			for (g = 0; g < groups; g++) {
+				textline = output_reserve(out,
+						FORMAT_LINE_SIZE(numChannels));
+				if (textline == NULL)
 					goto bad;
-
-				//If we're counting lines, decrement them
-				if (lines != 0) {
-					linesleft--;
-					if (linesleft == 0) {
-						return 0;
-					}
-				}
-
-			} else {
-				linesdumped = linesdumped + 1;
+				linelen = format_scan_hex(textline,
+							  b->raw +
+							  g * numChannels,
+							  numChannels);
+				output_commit(out, linelen);
 			}
+			break;
+		default:
+		case CONVERT_DEC:
+			for (g = 0; g < groups; g++) {
+				textline = output_reserve(out,
+						FORMAT_LINE_SIZE(numChannels));
+				if (textline == NULL)
+					goto bad;
+				linelen = format_scan_dec(textline,
+							  b->raw +
+							  g * numChannels,
+							  numChannels, 1);
+				output_commit(out, linelen);
+			}
+			break;
+		}
+		prof_end(PROF_CONVERT, t);
 
-			//We've processed this group, so advance the counter
-			numgroupsProcessed++;
-
+		//If we're counting lines, decrement them
+		if (lines != 0) {
+			state->linesleft -= groups;
+			if (state->linesleft == 0) {
+				goto out;
+			}
 		}
+
+		if (output_poll(out) < 0)
+			goto bad;
 	}
 
-	return 0;
+	goto out;
 
  bad:
 	info("Output error (disk full?)\n");
-	return -3;
+	retval = -3;
 
+ out:
+	nerd_stream_end(ns);
+	return retval;
 }
 
 /* Open a connection to the NerdJack */
@@ -14,6 +14,11 @@
 #include <stdlib.h>
 
 #include "netutil.h"
+#include "output.h"
+
+struct capture;
+struct metrics;
+struct shmring;
 
 #define NERDJACK_CHANNELS 12
 #define NERDJACK_CLOCK_RATE 66000000
@@ -43,17 +48,102 @@ int nerd_generate_command(getPacket * command, int *channel_list,
 			  int channel_count, int precision,
 			  unsigned long period);
 
-/* Send given command to NerdJack */
+/* Send given command to NerdJack, on a connection of its own */
 int nerd_send_command(const char *address, void *command, int length);
 
-/* Get the version string from NerdJack */
-int nerd_get_version(const char *address);
+/* Command connection that stays open between commands.  It is only
+   reopened when a command fails on it, or for a different address.
+   A NerdJack that hangs up after each reply gets one command per
+   connection from then on. */
+struct nerd_session {
+	int fd;			/* -1 while not connected */
+	char *address;		/* what fd is connected to */
+	int single;		/* one command per connection */
+};
+
+void nerd_session_init(struct nerd_session *ns);
+void nerd_session_close(struct nerd_session *ns);
+
+/* Send "count" commands back to back, then collect the OK or NO reply
+   to each.  Returns 0 if all were OK, -2 if the connection failed, -4
+   if a command got NO, or -1 on other errors.  On failure, *failed is
+   set to the index of the first command that didn't succeed. */
+int nerd_session_commands(struct nerd_session *ns, const char *address,
+			  int count, void **commands, int *lengths,
+			  int *failed);
+
+/* Same, for a single command */
+int nerd_session_command(struct nerd_session *ns, const char *address,
+			 void *command, int length);
+
+/* Get the version string from NerdJack into "version", of size len */
+int nerd_get_version(const char *address, char *version, size_t len);
+
+/* Stream state that carries over when a stream is resumed */
+struct nerd_state {
+	unsigned short currentcount;	/* next expected packet number */
+	int linesleft;
+	int linesdumped;
+	unsigned long packets;	/* packets received, over all streams */
+	struct timeval last;	/* when the last packet arrived */
+	int wasreset;		/* device was reset since the last stream */
+	int stop;		/* set from another thread to end the stream */
+
+	/* Set by the caller: fill the scans lost to a reset with this
+	   raw value, so later samples stay aligned */
+	int fill;
+	uint16_t fill_value;
+
+	/* Set by the caller: capture to record the data connection to,
+	   or to replay instead of it, or NULL */
+	struct capture *capture;
+
+	/* Set by the caller: counters to update, or NULL */
+	struct metrics *metrics;
+
+	/* Set by the caller: shared memory ring to publish the raw scans
+	   to, or NULL */
+	struct shmring *shm;
+};
+
+/* Scans from one packet, as returned by nerd_stream_next() */
+struct nerd_block {
+	int channels;
+	int scans;
+	const uint16_t *raw;	/* scans * channels samples, or NULL */
+	const double *volts;	/* the same in volts, or NULL */
+	unsigned short adcused;
+	unsigned short packetsready;
+
+	/* A reset lost data before these scans */
+	int gap;
+	unsigned long gap_packets;
+	unsigned long gap_scans;
+	double gap_seconds;
+};
+
+/* Pull interface to the stream data.  nerd_stream_begin() starts
+   receiving, with the scans in volts if "volts" is set (and raw too
+   if state->shm is), or without any with "showmem".  Returns NULL on
+   error.  nerd_stream_next() waits for the next packet, and returns
+   1 with *block set, which stays valid until the next call; 0 once
+   the connection is closed or state->stop is set; or < 0 on error.
+   nerd_stream_end() stops receiving and frees ns. */
+struct nerd_stream;
+struct nerd_stream *nerd_stream_begin(int data_fd, int numChannels,
+				      int *channel_list, int precision,
+				      int volts, int showmem,
+				      unsigned int period,
+				      struct nerd_state *state);
+int nerd_stream_next(struct nerd_stream *ns, struct nerd_block **block);
+void nerd_stream_end(struct nerd_stream *ns);
 
-/* Stream data out of the NerdJack */
+/* Stream data out of the NerdJack and write it to out, on top of the
+   above.  When replaying a capture, data_fd is not used. */
 int nerd_data_stream(int data_fd, int numChannels, int *channel_list,
 		     int precision, int convert, int lines, int showmem,
-		     unsigned short *currentcount, unsigned int period,
-		     int wasreset);
+		     unsigned int period, struct nerd_state *state,
+		     struct output *out);
 
 /* Detect the IP Address of the NerdJack and return in ipAddress */
 int nerdjack_detect(char *ipAddress);
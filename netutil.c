@@ -3,6 +3,9 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <stdio.h>
+#ifndef __WIN32__
+#include <poll.h>
+#endif
 
 /* Initialize networking */
 void net_init(void)
@@ -44,16 +47,77 @@ int soblock(int socket, int blocking)
 #endif
 }
 
-/* Like connect(2), but with a timeout.  Socket must be non-blocking. */
-int
-connect_timeout(int s, const struct sockaddr *serv_addr, socklen_t addrlen,
-		struct timeval *timeout)
+/* Wait until socket s is readable (WAIT_READ) or writable
+   (WAIT_WRITE), or the timeout expires.  Returns the events that are
+   ready, with WAIT_ERROR added for errors and hangups, 0 on timeout,
+   or -1 on failure.  Uses poll(2), so unlike select(2) it works for
+   descriptors past FD_SETSIZE and costs the same for any s. */
+#define WAIT_READ 0x01
+#define WAIT_WRITE 0x02
+#define WAIT_ERROR 0x04
+static int wait_fd(int s, int events, struct timeval *timeout)
+{
+#ifdef __WIN32__
+	fd_set readfds, writefds, exceptfds;
+	int ret;
+
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	FD_ZERO(&exceptfds);
+	if (events & WAIT_READ)
+		FD_SET(s, &readfds);
+	if (events & WAIT_WRITE)
+		FD_SET(s, &writefds);
+	FD_SET(s, &exceptfds);
+	ret = select(s + 1, &readfds, &writefds, &exceptfds, timeout);
+	if (ret <= 0)
+		return ret;
+
+	ret = 0;
+	if (FD_ISSET(s, &readfds))
+		ret |= WAIT_READ;
+	if (FD_ISSET(s, &writefds))
+		ret |= WAIT_WRITE;
+	if (FD_ISSET(s, &exceptfds))
+		ret |= WAIT_ERROR;
+	return ret;
+#else
+	struct pollfd p;
+	int ms = -1;
+	int ret;
+
+	if (timeout != NULL)
+		ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+	p.fd = s;
+	p.events = 0;
+	p.revents = 0;
+	if (events & WAIT_READ)
+		p.events |= POLLIN;
+	if (events & WAIT_WRITE)
+		p.events |= POLLOUT;
+	do {
+		ret = poll(&p, 1, ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return ret;
+
+	ret = 0;
+	if (p.revents & POLLIN)
+		ret |= WAIT_READ;
+	if (p.revents & POLLOUT)
+		ret |= WAIT_WRITE;
+	if (p.revents & (POLLERR | POLLHUP | POLLNVAL))
+		ret |= WAIT_ERROR;
+	return ret;
+#endif
+}
+
+/* Start a connect(2) on a non-blocking socket.  Returns 0 if it
+   finished right away, 1 if it is in progress, or -1 on error. */
+int connect_start(int s, const struct sockaddr *serv_addr, socklen_t addrlen)
 {
 	int ret;
-	fd_set writefds;
-	fd_set exceptfds;
-	int optval;
-	socklen_t optlen;
 
 	/* Start connect */
 	ret = connect(s, serv_addr, addrlen);
@@ -73,12 +137,19 @@ connect_timeout(int s, const struct sockaddr *serv_addr, socklen_t addrlen,
 		return -1;
 #endif
 
+	return 1;
+}
+
+/* Wait for a connect started by connect_start() to finish.  Returns
+   -1 on error or timeout. */
+int connect_finish(int s, struct timeval *timeout)
+{
+	int ret;
+	int optval;
+	socklen_t optlen;
+
 	/* In progress, wait for result. */
-	FD_ZERO(&writefds);
-	FD_SET(s, &writefds);
-	FD_ZERO(&exceptfds);
-	FD_SET(s, &exceptfds);
-	ret = select(s + 1, NULL, &writefds, &exceptfds, timeout);
+	ret = wait_fd(s, WAIT_WRITE, timeout);
 	if (ret < 0) {
 		/* Error */
 		return -1;
@@ -102,7 +173,7 @@ connect_timeout(int s, const struct sockaddr *serv_addr, socklen_t addrlen,
 
 	/* On Windows, SO_ERROR sometimes shows no error but the connection
 	   still failed.  Sigh. */
-	if (FD_ISSET(s, &exceptfds) || !FD_ISSET(s, &writefds)) {
+	if ((ret & WAIT_ERROR) || !(ret & WAIT_WRITE)) {
 		errno = EIO;
 		return -1;
 	}
@@ -111,6 +182,19 @@ connect_timeout(int s, const struct sockaddr *serv_addr, socklen_t addrlen,
 	return 0;
 }
 
+/* Like connect(2), but with a timeout.  Socket must be non-blocking. */
+int
+connect_timeout(int s, const struct sockaddr *serv_addr, socklen_t addrlen,
+		struct timeval *timeout)
+{
+	int ret;
+
+	ret = connect_start(s, serv_addr, addrlen);
+	if (ret <= 0)
+		return ret;
+	return connect_finish(s, timeout);
+}
+
 /* Like send(2), but with a timeout.  Socket must be non-blocking.
    The timeout only applies if no data at all is sent -- this function
    may still send less than requested. */
@@ -118,18 +202,15 @@ ssize_t
 send_timeout(int s, const void *buf, size_t len, int flags,
 	     struct timeval * timeout)
 {
-	fd_set writefds;
 	int ret;
 
-	FD_ZERO(&writefds);
-	FD_SET(s, &writefds);
-	ret = select(s + 1, NULL, &writefds, NULL, timeout);
+	ret = wait_fd(s, WAIT_WRITE, timeout);
 	if (ret == 0) {
 		/* Timed out */
 		errno = ETIMEDOUT;
 		return -1;
 	}
-	if (ret != 1) {
+	if (ret < 0) {
 		/* Error */
 		return -1;
 	}
@@ -143,18 +224,15 @@ send_timeout(int s, const void *buf, size_t len, int flags,
 ssize_t
 recv_timeout(int s, void *buf, size_t len, int flags, struct timeval * timeout)
 {
-	fd_set readfds;
 	int ret;
 
-	FD_ZERO(&readfds);
-	FD_SET(s, &readfds);
-	ret = select(s + 1, &readfds, NULL, NULL, timeout);
+	ret = wait_fd(s, WAIT_READ, timeout);
 	if (ret == 0) {
 		/* Timed out */
 		errno = ETIMEDOUT;
 		return -1;
 	}
-	if (ret != 1) {
+	if (ret < 0) {
 		/* Error */
 		return -1;
 	}
@@ -170,18 +248,15 @@ recvfrom_timeout(int s, void *buf, size_t len, int flags,
 		 struct sockaddr * address, socklen_t * address_len,
 		 struct timeval * timeout)
 {
-	fd_set readfds;
 	int ret;
 
-	FD_ZERO(&readfds);
-	FD_SET(s, &readfds);
-	ret = select(s + 1, &readfds, NULL, NULL, timeout);
+	ret = wait_fd(s, WAIT_READ, timeout);
 	if (ret == 0) {
 		/* Timed out */
 		errno = ETIMEDOUT;
 		return -1;
 	}
-	if (ret != 1) {
+	if (ret < 0) {
 		/* Error */
 		return -1;
 	}
@@ -44,6 +44,12 @@ ssize_t recvfrom_timeout(int s, void *buf, size_t len, int flags,
 			 struct sockaddr *address, socklen_t * address_len,
 			 struct timeval *timeout);
 
+/* connect_timeout() in two halves, so that several connections can
+   be in progress at once.  connect_start() returns 0 if connected, 1
+   if in progress, or -1 on error. */
+int connect_start(int s, const struct sockaddr *serv_addr, socklen_t addrlen);
+int connect_finish(int s, struct timeval *timeout);
+
 /* Like send_timeout and recv_timeout, but they retry (with the same timeout)
    in case of partial transfers, in order to try to transfer all data. */
 ssize_t send_all_timeout(int s, const void *buf, size_t len, int flags,
@@ -0,0 +1,317 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifndef __WIN32__
+#include <sys/uio.h>
+#endif
+
+#include "debug.h"
+#include "prof.h"
+#include "output.h"
+
+int output_init(struct output *o, int fd, int flush_ms)
+{
+	int i;
+
+	memset(o, 0, sizeof(*o));
+	o->fd = fd;
+	o->size = OUTPUT_BUFSIZE;
+	o->flush_ms = flush_ms;
+
+	for (i = 0; i < OUTPUT_BUFFERS; i++) {
+#ifdef __WIN32__
+		o->buf[i] = malloc(o->size);
+#else
+		if (posix_memalign((void **)&o->buf[i], 4096, o->size) != 0)
+			o->buf[i] = NULL;
+#endif
+		if (o->buf[i] == NULL) {
+			output_free(o);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void output_free(struct output *o)
+{
+	int i;
+
+	for (i = 0; i < OUTPUT_BUFFERS; i++) {
+		free(o->buf[i]);
+		o->buf[i] = NULL;
+	}
+}
+
+#ifndef __WIN32__
+void output_share(struct output *o, pthread_mutex_t *lock, int tag)
+{
+	o->lock = lock;
+	o->tag = tag;
+}
+#endif
+
+/* Write the first n buffers, of which the last holds lastlen bytes */
+static int write_buffers_now(struct output *o, int n, size_t lastlen)
+{
+	int i;
+	ssize_t ret;
+#ifdef __WIN32__
+	for (i = 0; i < n; i++) {
+		size_t done = (i == 0) ? o->start : 0;
+		size_t len = (i == n - 1) ? lastlen : o->len[i];
+		while (done < len) {
+			ret = write(o->fd, o->buf[i] + done, len - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return -1;
+			done += ret;
+		}
+	}
+	return 0;
+#else
+	struct iovec iov[OUTPUT_BUFFERS];
+	struct iovec *v = iov;
+	int retval = 0;
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = o->buf[i];
+		iov[i].iov_len = (i == n - 1) ? lastlen : o->len[i];
+	}
+	iov[0].iov_base = o->buf[0] + o->start;
+	iov[0].iov_len -= o->start;
+
+	if (o->lock)
+		pthread_mutex_lock(o->lock);
+	while (n > 0) {
+		ret = writev(o->fd, v, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			retval = -1;
+			break;
+		}
+
+		/* Skip over whatever was written */
+		while (n > 0 && (size_t)ret >= v->iov_len) {
+			ret -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n > 0) {
+			v->iov_base = (char *)v->iov_base + ret;
+			v->iov_len -= ret;
+		}
+	}
+	if (o->lock)
+		pthread_mutex_unlock(o->lock);
+	return retval;
+#endif
+}
+
+static int write_buffers(struct output *o, int n, size_t lastlen)
+{
+	uint64_t t = prof_start();
+	size_t bytes = lastlen - ((n == 1) ? o->start : 0);
+	int i, ret;
+
+	for (i = 0; i < n - 1; i++)
+		bytes += o->len[i] - ((i == 0) ? o->start : 0);
+
+	ret = write_buffers_now(o, n, lastlen);
+	prof_end(PROF_WRITE, t);
+
+	/* Read by the metrics server */
+	if (ret == 0)
+		__atomic_store_n(&o->written, o->written + bytes,
+				 __ATOMIC_RELAXED);
+	return ret;
+}
+
+int output_flush(struct output *o)
+{
+	int i;
+
+	if (o->error)
+		return -1;
+
+	if (o->cur > 0 || o->len[0] > o->start) {
+		if (write_buffers(o, o->cur + 1, o->len[o->cur]) < 0) {
+			o->error = 1;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < OUTPUT_BUFFERS; i++)
+		o->len[i] = 0;
+	o->cur = 0;
+	o->start = 0;
+	o->mark_cur = 0;
+	o->mark_len = 0;
+	o->pending = 0;
+	return 0;
+}
+
+/* All buffers are full.  On a shared fd, write only the complete
+   records and rotate the buffers so that the partial one at the end
+   moves to the front.  Otherwise, or if that doesn't free anything,
+   write everything. */
+static int make_room(struct output *o)
+{
+#ifndef __WIN32__
+	char *buf[OUTPUT_BUFFERS];
+	size_t len[OUTPUT_BUFFERS];
+	int i, j;
+
+	if (o->lock && o->mark_cur > 0) {
+		if (write_buffers(o, o->mark_cur + 1, o->mark_len) < 0) {
+			o->error = 1;
+			return -1;
+		}
+
+		for (i = 0; i < OUTPUT_BUFFERS; i++) {
+			j = (i + o->mark_cur) % OUTPUT_BUFFERS;
+			buf[i] = o->buf[j];
+			len[i] = o->len[j];
+		}
+		for (i = 0; i < OUTPUT_BUFFERS; i++) {
+			o->buf[i] = buf[i];
+			o->len[i] = (i <= o->cur - o->mark_cur) ? len[i] : 0;
+		}
+		o->cur -= o->mark_cur;
+		o->start = o->mark_len;
+		o->mark_cur = 0;
+		return 0;
+	}
+	if (o->lock)
+		verb("record larger than the output buffers\n");
+#endif
+	return output_flush(o);
+}
+
+char *output_reserve(struct output *o, size_t len)
+{
+	if (o->error || len > o->size)
+		return NULL;
+
+	if (o->len[o->cur] + len > o->size) {
+		/* Move on to the next buffer, writing them out if
+		   there are none left */
+		if (o->cur == OUTPUT_BUFFERS - 1 && make_room(o) < 0)
+			return NULL;
+		if (o->len[o->cur] + len > o->size)
+			o->cur++;
+	}
+
+	return o->buf[o->cur] + o->len[o->cur];
+}
+
+int output_commit(struct output *o, size_t len)
+{
+	o->len[o->cur] += len;
+
+	/* Arm the latency deadline when the first byte is queued */
+	if (!o->pending && o->flush_ms && len) {
+		gettimeofday(&o->deadline, NULL);
+		o->deadline.tv_usec += (o->flush_ms % 1000) * 1000;
+		o->deadline.tv_sec += o->flush_ms / 1000 +
+		    o->deadline.tv_usec / 1000000;
+		o->deadline.tv_usec %= 1000000;
+		o->pending = 1;
+	}
+
+	return 0;
+}
+
+int output_write(struct output *o, const void *data, size_t len)
+{
+	char *p;
+
+	/* Large writes are split across buffers */
+	while (len > o->size) {
+		if (output_write(o, data, o->size) < 0)
+			return -1;
+		data = (const char *)data + o->size;
+		len -= o->size;
+	}
+
+	p = output_reserve(o, len);
+	if (p == NULL)
+		return -1;
+	memcpy(p, data, len);
+	return output_commit(o, len);
+}
+
+int output_printf(struct output *o, const char *format, ...)
+{
+	va_list ap;
+	char *p;
+	size_t room;
+	int ret;
+
+	if (o->error)
+		return -1;
+
+	room = o->size - o->len[o->cur];
+	p = o->buf[o->cur] + o->len[o->cur];
+	va_start(ap, format);
+	ret = vsnprintf(p, room, format, ap);
+	va_end(ap);
+	if (ret < 0)
+		return -1;
+
+	if ((size_t)ret >= room) {
+		/* Didn't fit, try again in a fresh buffer */
+		p = output_reserve(o, ret + 1);
+		if (p == NULL)
+			return -1;
+		va_start(ap, format);
+		ret = vsnprintf(p, ret + 1, format, ap);
+		va_end(ap);
+	}
+
+	output_commit(o, ret);
+	return ret;
+}
+
+int output_poll(struct output *o)
+{
+	struct timeval now;
+
+	o->mark_cur = o->cur;
+	o->mark_len = o->len[o->cur];
+
+	if (!o->pending)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	if (now.tv_sec > o->deadline.tv_sec ||
+	    (now.tv_sec == o->deadline.tv_sec &&
+	     now.tv_usec >= o->deadline.tv_usec))
+		return output_flush(o);
+
+	return 0;
+}
+
+int output_deadline(struct output *o, struct timeval *deadline)
+{
+	if (!o->pending || o->error)
+		return 0;
+	*deadline = o->deadline;
+	return 1;
+}
@@ -0,0 +1,86 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <sys/time.h>
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
+
+/* Buffered output.  Data is collected in a few large buffers and
+   written with a single writev(2) once they are all full, or once the
+   oldest unwritten byte has waited longer than flush_ms.
+
+   Several outputs can share one fd (see output_share).  They then
+   only ever write whole records, up to the last output_poll(), so
+   records from different devices don't get mixed up. */
+
+#define OUTPUT_BUFFERS 4
+#define OUTPUT_BUFSIZE (64 * 1024)
+#define OUTPUT_FLUSH_MS 50
+
+struct output {
+	int fd;
+	size_t size;
+	char *buf[OUTPUT_BUFFERS];
+	size_t len[OUTPUT_BUFFERS];
+	int cur;
+	size_t start;		/* bytes at the front of buf[0] already written */
+	int mark_cur;		/* end of the last complete record */
+	size_t mark_len;
+	int flush_ms;
+	int pending;		/* deadline is armed */
+	struct timeval deadline;
+	int error;
+	int tag;		/* device number for tagged records */
+	unsigned long long written;	/* bytes written so far */
+#ifndef __WIN32__
+	pthread_mutex_t *lock;	/* held while writing to a shared fd */
+#endif
+};
+
+/* Set up output to fd, with a maximum latency of flush_ms
+   milliseconds (0 to only write full buffers).  Returns < 0 on error. */
+int output_init(struct output *o, int fd, int flush_ms);
+void output_free(struct output *o);
+
+#ifndef __WIN32__
+/* Share o's fd with other outputs that use the same lock.  Records
+   written through o are tagged with device number "tag". */
+void output_share(struct output *o, pthread_mutex_t *lock, int tag);
+#endif
+
+/* Return a pointer to at least len contiguous bytes of buffer space,
+   or NULL on error.  output_commit() then queues the bytes that were
+   actually filled in. */
+char *output_reserve(struct output *o, size_t len);
+int output_commit(struct output *o, size_t len);
+
+/* Queue data for output.  Returns < 0 on error. */
+int output_write(struct output *o, const void *data, size_t len);
+int output_printf(struct output *o, const char *format, ...)
+    __attribute__ ((format(printf, 2, 3)));
+
+/* Write everything that is queued.  Returns < 0 on error. */
+int output_flush(struct output *o);
+
+/* Mark the end of a complete record, and write queued data if the
+   latency deadline has passed.  Call this after each received packet.
+   Returns < 0 on error. */
+int output_poll(struct output *o);
+
+/* Get the time by which queued data has to be written, so that a
+   caller waiting for more input can output_flush() then instead of
+   at the next packet.  Returns 0 if nothing is waiting. */
+int output_deadline(struct output *o, struct timeval *deadline);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "prof.h"
+
+int prof_enabled = 0;
+
+struct prof_hist {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t bucket[PROF_BUCKETS];	/* < 2^i ns */
+};
+
+static struct prof_hist hist[PROF_STAGES];
+
+static const char *stage_name[PROF_STAGES] = {
+	"recv", "verify", "unpack", "convert", "write",
+};
+
+void prof_enable(void)
+{
+	memset(hist, 0, sizeof(hist));
+	prof_enabled = 1;
+}
+
+uint64_t prof_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + 1;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec) * 1000 + 1;
+#endif
+}
+
+void prof_add(int stage, uint64_t start)
+{
+	struct prof_hist *h = &hist[stage];
+	uint64_t ns = prof_now() - start;
+	uint64_t max;
+	int b = 0;
+
+	while (b < PROF_BUCKETS - 1 && (ns >> b) != 0)
+		b++;
+
+	/* Devices stream on their own threads */
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&h->max, &max, ns, 0,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) ;
+}
+
+/* Upper bound of the bucket holding the given fraction of calls, or
+   the maximum if that is lower */
+static uint64_t percentile(struct prof_hist *h, uint64_t count, double p)
+{
+	uint64_t want = (uint64_t)(count * p + 0.5), seen = 0;
+	int b;
+
+	for (b = 0; b < PROF_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= want && seen > 0)
+			return ((uint64_t)1 << b) < h->max ?
+			    ((uint64_t)1 << b) : h->max;
+	}
+	return h->max;
+}
+
+/* The report is formatted by hand, as snprintf() isn't safe to call
+   from a signal handler.  Both append to line, stopping at its end. */
+static size_t put_str(char *line, size_t len, size_t size, const char *str)
+{
+	while (*str && len < size)
+		line[len++] = *str++;
+	return len;
+}
+
+static size_t put_u64(char *line, size_t len, size_t size, uint64_t v)
+{
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n && len < size)
+		line[len++] = digits[--n];
+	return len;
+}
+
+void prof_report(int fd)
+{
+	char line[2048];
+	const size_t size = sizeof(line) - 1;	/* room for the newline */
+	struct prof_hist h;
+	size_t len;
+	int s, b;
+
+	for (s = 0; s < PROF_STAGES; s++) {
+		memcpy(&h, &hist[s], sizeof(h));
+		if (h.count == 0)
+			continue;
+
+		len = put_str(line, 0, size, "prof stage=");
+		len = put_str(line, len, size, stage_name[s]);
+		len = put_str(line, len, size, " count=");
+		len = put_u64(line, len, size, h.count);
+		len = put_str(line, len, size, " total_ns=");
+		len = put_u64(line, len, size, h.total);
+		len = put_str(line, len, size, " mean_ns=");
+		len = put_u64(line, len, size, h.total / h.count);
+		len = put_str(line, len, size, " p50_ns=");
+		len = put_u64(line, len, size, percentile(&h, h.count, 0.5));
+		len = put_str(line, len, size, " p90_ns=");
+		len = put_u64(line, len, size, percentile(&h, h.count, 0.9));
+		len = put_str(line, len, size, " p99_ns=");
+		len = put_u64(line, len, size, percentile(&h, h.count, 0.99));
+		len = put_str(line, len, size, " max_ns=");
+		len = put_u64(line, len, size, h.max);
+		len = put_str(line, len, size, " hist=");
+		for (b = 0; b < PROF_BUCKETS; b++) {
+			if (h.bucket[b] == 0)
+				continue;
+			if (line[len - 1] != '=')
+				len = put_str(line, len, size, ",");
+			len = put_u64(line, len, size, (uint64_t)1 << b);
+			len = put_str(line, len, size, ":");
+			len = put_u64(line, len, size, h.bucket[b]);
+		}
+		line[len++] = '\n';
+		if (write(fd, line, len) < 0)
+			return;
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+
+/* Per-stage timing of the data path.  Each timed call goes into a
+   histogram with power-of-two nanosecond buckets, shared by all
+   devices.  Until prof_enable() is called, timing a stage costs one
+   test of prof_enabled.
+
+   The report has one "prof" line per stage that ran:
+
+     prof stage=NAME count=N total_ns=T mean_ns=M p50_ns=A p90_ns=B
+          p99_ns=C max_ns=D hist=U:N,U:N,...
+
+   (on a single line), where each hist entry is the number of calls N
+   that took less than U nanoseconds, for the buckets that aren't
+   empty.  Percentiles are the upper bound of their bucket, capped at
+   the maximum. */
+
+#define PROF_RECV 0		/* recv() on the data connection */
+#define PROF_VERIFY 1		/* packet checksums, header, counter */
+#define PROF_UNPACK 2		/* samples out of the packet */
+#define PROF_CONVERT 3		/* volts, text or binary records */
+#define PROF_WRITE 4		/* output write() calls */
+#define PROF_STAGES 5
+
+#define PROF_BUCKETS 40
+
+extern int prof_enabled;
+
+void prof_enable(void);
+
+/* Current time in nanoseconds, never 0 */
+uint64_t prof_now(void);
+
+/* Account the time since start to stage */
+void prof_add(int stage, uint64_t start);
+
+/* Write the report to fd.  It is formatted without stdio and written
+   with write(), so that it can be called from a signal handler. */
+void prof_report(int fd);
+
+#define prof_start() (prof_enabled ? prof_now() : 0)
+
+#define prof_end(stage, start) ({ \
+	if (start) \
+		prof_add(stage, start); \
+})
+
+#endif
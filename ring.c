@@ -0,0 +1,481 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "netutil.h"
+#include "debug.h"
+#include "prof.h"
+#include "ring.h"
+
+int ring_init(struct ring *r, size_t slot_size, unsigned int count)
+{
+	memset(r, 0, sizeof(*r));
+
+	r->count = 1;
+	while (r->count < count)
+		r->count <<= 1;
+	r->slot_size = slot_size;
+	r->slots = malloc(r->count * slot_size);
+	if (r->slots == NULL)
+		return -1;
+
+	return 0;
+}
+
+void ring_free(struct ring *r)
+{
+	free(r->slots);
+	r->slots = NULL;
+}
+
+unsigned int ring_used(struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) -
+	    __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+void *ring_slot(struct ring *r)
+{
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (r->head - tail == r->count)
+		return NULL;
+	return r->slots + (r->head & (r->count - 1)) * r->slot_size;
+}
+
+void ring_push(struct ring *r)
+{
+	ring_push_n(r, 1);
+}
+
+void ring_push_n(struct ring *r, unsigned int n)
+{
+	unsigned int used;
+
+	/* Sequentially consistent, so the wakeup check that follows
+	   can't be ordered before it */
+	__atomic_store_n(&r->head, r->head + n, __ATOMIC_SEQ_CST);
+
+	used = r->head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	if (used > r->high_water)
+		r->high_water = used;
+}
+
+void *ring_peek(struct ring *r)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (head == r->tail)
+		return NULL;
+	return r->slots + (r->tail & (r->count - 1)) * r->slot_size;
+}
+
+void ring_pop(struct ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+}
+
+/* The ring, and the receive time of each of its slots */
+static int receiver_ring(struct receiver *rx, size_t packet_size,
+			 unsigned int slots)
+{
+	if (ring_init(&rx->ring, packet_size, slots) < 0)
+		return -1;
+	rx->stamps = calloc(rx->ring.count, sizeof(*rx->stamps));
+	if (rx->stamps == NULL) {
+		ring_free(&rx->ring);
+		return -1;
+	}
+	return 0;
+}
+
+static void receiver_ring_free(struct receiver *rx)
+{
+	ring_free(&rx->ring);
+	free(rx->stamps);
+	rx->stamps = NULL;
+}
+
+void receiver_time(struct receiver *rx, struct timeval *tv)
+{
+	*tv = rx->stamps[rx->ring.tail & (rx->ring.count - 1)];
+}
+
+unsigned int receiver_ready(struct receiver *rx)
+{
+	struct ring *r = &rx->ring;
+	unsigned int used = ring_used(r);
+	unsigned int wrap = r->count - (r->tail & (r->count - 1));
+
+	return (used < wrap) ? used : wrap;
+}
+
+/* Watch the data socket, which gets the receive timeout as its
+   deadline before each wait */
+static int receiver_evloop(struct receiver *rx)
+{
+	if (evloop_init(&rx->ev) < 0)
+		return -1;
+	if (rx->capture && rx->capture->replay)
+		return 0;
+	if (evloop_add(&rx->ev, rx->fd, EVLOOP_READ) < 0) {
+		evloop_free(&rx->ev);
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait until the data socket is readable.  Returns 1 if it is, 0 if
+   receiver_stop() woke us up, or -1 on timeout or error. */
+static int receiver_wait(struct receiver *rx)
+{
+	struct evloop_event events[2];
+	struct timeval timeout;
+	int i, n;
+
+	if (rx->adaptive && rx->started)
+		watchdog_timeout(&rx->wd, &timeout);
+	else
+		timeout = rx->timeout;
+	evloop_set_timeout(&rx->ev, rx->fd, &timeout);
+	n = evloop_wait(&rx->ev, events, 2);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (events[i].fd != rx->fd)
+			return 0;	/* wake pipe */
+		if (events[i].events & EVLOOP_TIMEOUT) {
+			if (rx->started)
+				verb("no data for %ld.%03ld s, stream stalled\n",
+				     (long)timeout.tv_sec,
+				     (long)timeout.tv_usec / 1000);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* Read the next piece of a replayed capture, waiting until it is due
+   if the capture is paced.  Returns like recv(). */
+static ssize_t receiver_replay(struct receiver *rx, void *buf, size_t len,
+			       struct timeval *stamp)
+{
+	uint64_t t = prof_start();
+	ssize_t ret = capture_read(rx->capture, buf, len, stamp);
+	long due;
+
+	prof_end(PROF_RECV, t);
+
+	while (ret > 0 && (due = capture_due(rx->capture, stamp)) > 0) {
+		if (__atomic_load_n(&rx->stop, __ATOMIC_SEQ_CST))
+			return 0;
+		usleep(due > 10000 ? 10000 : due);
+	}
+	return ret;
+}
+
+/* Receive as much as fits with a single recv, straight into the free
+   slots of the ring, and hand over every complete packet.  A partial
+   packet at the end stays where it is and is completed by the next
+   call.  Returns the number of packets added, 0 if the ring is full,
+   or -1 at the end of the stream with rx->result set. */
+static int receiver_fill(struct receiver *rx)
+{
+	struct ring *r = &rx->ring;
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	unsigned int index = r->head & (r->count - 1);
+	unsigned int slots = r->count - (r->head - tail);
+	size_t room;
+	ssize_t ret;
+	unsigned int i, n;
+	struct timeval now;
+
+	/* Only up to the end of the slot array, so that packets never
+	   wrap around */
+	if (slots > r->count - index)
+		slots = r->count - index;
+	if (slots == 0)
+		return 0;
+
+	room = slots * r->slot_size - rx->fill;
+	if (room > RECEIVER_BATCH)
+		room = RECEIVER_BATCH;
+
+	if (rx->capture && rx->capture->replay) {
+		ret = receiver_replay(rx, r->slots + index * r->slot_size +
+				      rx->fill, room, &now);
+	} else {
+		ret = receiver_wait(rx);
+		if (ret > 0) {
+			uint64_t t = prof_start();
+
+			ret = recv(rx->fd, r->slots + index * r->slot_size +
+				   rx->fill, room, 0);
+			prof_end(PROF_RECV, t);
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;	/* spurious wakeup */
+		gettimeofday(&now, NULL);
+	}
+	if (ret <= 0) {
+		/* Same result recv_all_timeout() would have given */
+		rx->result = (ret < 0) ? ret : (int)rx->fill;
+		return -1;
+	}
+
+	if (rx->capture && !rx->capture->replay)
+		capture_write_data(rx->capture, r->slots +
+				   index * r->slot_size + rx->fill, ret, &now);
+	if (rx->adaptive)
+		watchdog_feed(&rx->wd, &now);
+	rx->started = 1;
+
+	rx->fill += ret;
+	n = rx->fill / r->slot_size;
+	rx->fill %= r->slot_size;
+	for (i = 0; i < n; i++)
+		rx->stamps[index + i] = now;
+	if (n)
+		ring_push_n(r, n);
+	return n;
+}
+
+#ifndef __WIN32__
+
+static void *receiver_thread(void *arg)
+{
+	struct receiver *rx = arg;
+	int ret;
+
+	for (;;) {
+		if (__atomic_load_n(&rx->stop, __ATOMIC_SEQ_CST))
+			break;
+
+		ret = receiver_fill(rx);
+		if (ret < 0)
+			break;
+
+		if (ret == 0) {
+			/* Full, wait for the consumer to catch up */
+			pthread_mutex_lock(&rx->lock);
+			__atomic_store_n(&rx->producer_waiting, 1,
+					 __ATOMIC_SEQ_CST);
+			while (ring_slot(&rx->ring) == NULL &&
+			       !__atomic_load_n(&rx->stop, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&rx->cond, &rx->lock);
+			rx->producer_waiting = 0;
+			pthread_mutex_unlock(&rx->lock);
+			continue;
+		}
+
+		if (__atomic_load_n(&rx->consumer_waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&rx->lock);
+			pthread_cond_signal(&rx->cond);
+			pthread_mutex_unlock(&rx->lock);
+		}
+	}
+
+	pthread_mutex_lock(&rx->lock);
+	__atomic_store_n(&rx->done, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&rx->cond);
+	pthread_mutex_unlock(&rx->lock);
+	return NULL;
+}
+
+int receiver_start(struct receiver *rx, int fd, size_t packet_size,
+		   unsigned int slots, struct timeval *timeout,
+		   double interval, struct capture *capture)
+{
+	memset(rx, 0, sizeof(*rx));
+	rx->fd = fd;
+	rx->packet_size = packet_size;
+	rx->timeout = *timeout;
+	rx->adaptive = (interval > 0);
+	rx->capture = capture;
+	watchdog_init(&rx->wd, interval);
+
+	if (receiver_ring(rx, packet_size, slots) < 0)
+		return -1;
+
+	if (receiver_evloop(rx) < 0) {
+		verb("can't set up receive event loop\n");
+		goto fail_ring;
+	}
+	if (pipe(rx->wake) < 0) {
+		verb("can't create receive wakeup pipe\n");
+		goto fail_evloop;
+	}
+	if (evloop_add(&rx->ev, rx->wake[0], EVLOOP_READ) < 0)
+		goto fail_pipe;
+
+	pthread_mutex_init(&rx->lock, NULL);
+	pthread_cond_init(&rx->cond, NULL);
+
+	if (pthread_create(&rx->thread, NULL, receiver_thread, rx) != 0) {
+		verb("can't create receive thread\n");
+		pthread_mutex_destroy(&rx->lock);
+		pthread_cond_destroy(&rx->cond);
+		goto fail_pipe;
+	}
+
+	return 0;
+
+ fail_pipe:
+	close(rx->wake[0]);
+	close(rx->wake[1]);
+ fail_evloop:
+	evloop_free(&rx->ev);
+ fail_ring:
+	receiver_ring_free(rx);
+	return -1;
+}
+
+/* Wait for the receive thread, but not past the output deadline.
+   Called with rx->lock held. */
+static void consumer_wait(struct receiver *rx)
+{
+	struct timeval deadline;
+	struct timespec ts;
+
+	if (rx->out == NULL || !output_deadline(rx->out, &deadline)) {
+		pthread_cond_wait(&rx->cond, &rx->lock);
+		return;
+	}
+
+	ts.tv_sec = deadline.tv_sec;
+	ts.tv_nsec = deadline.tv_usec * 1000;
+	if (pthread_cond_timedwait(&rx->cond, &rx->lock, &ts) != ETIMEDOUT)
+		return;
+
+	/* Nothing came in time.  The write may block, so don't hold up
+	   the receive thread meanwhile; a write error is seen at the
+	   consumer's next output call. */
+	pthread_mutex_unlock(&rx->lock);
+	output_flush(rx->out);
+	pthread_mutex_lock(&rx->lock);
+}
+
+void *receiver_next(struct receiver *rx, int *result)
+{
+	void *pkt = ring_peek(&rx->ring);
+
+	if (pkt != NULL)
+		return pkt;
+
+	/* Empty, wait for the receive thread */
+	pthread_mutex_lock(&rx->lock);
+	__atomic_store_n(&rx->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	while ((pkt = ring_peek(&rx->ring)) == NULL &&
+	       !__atomic_load_n(&rx->done, __ATOMIC_SEQ_CST))
+		consumer_wait(rx);
+	rx->consumer_waiting = 0;
+	pthread_mutex_unlock(&rx->lock);
+
+	/* Packets received before the end are still delivered */
+	if (pkt == NULL)
+		pkt = ring_peek(&rx->ring);
+	if (pkt == NULL)
+		*result = rx->result;
+	return pkt;
+}
+
+void receiver_release(struct receiver *rx)
+{
+	ring_pop(&rx->ring);
+	if (__atomic_load_n(&rx->producer_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&rx->lock);
+		pthread_cond_signal(&rx->cond);
+		pthread_mutex_unlock(&rx->lock);
+	}
+}
+
+void receiver_stop(struct receiver *rx)
+{
+	pthread_mutex_lock(&rx->lock);
+	__atomic_store_n(&rx->stop, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&rx->cond);
+	pthread_mutex_unlock(&rx->lock);
+
+	/* Wake up a wait for data that may never come */
+	if (write(rx->wake[1], "", 1) < 0 && rx->fd >= 0)
+		shutdown(rx->fd, SHUT_RD);
+	pthread_join(rx->thread, NULL);
+
+	/* A replay at full speed always fills the ring */
+	if (rx->ring.high_water > rx->ring.count / 2 &&
+	    !(rx->capture && rx->capture->replay))
+		info("Receive ring high-water mark: %u of %u packets\n",
+		     rx->ring.high_water, rx->ring.count);
+	else
+		verb("receive ring high-water mark: %u of %u packets\n",
+		     rx->ring.high_water, rx->ring.count);
+
+	pthread_mutex_destroy(&rx->lock);
+	pthread_cond_destroy(&rx->cond);
+	close(rx->wake[0]);
+	close(rx->wake[1]);
+	evloop_free(&rx->ev);
+	receiver_ring_free(rx);
+}
+
+#else				/* __WIN32__ */
+
+int receiver_start(struct receiver *rx, int fd, size_t packet_size,
+		   unsigned int slots, struct timeval *timeout,
+		   double interval, struct capture *capture)
+{
+	memset(rx, 0, sizeof(*rx));
+	rx->fd = fd;
+	rx->packet_size = packet_size;
+	rx->timeout = *timeout;
+	rx->adaptive = (interval > 0);
+	rx->capture = capture;
+	watchdog_init(&rx->wd, interval);
+
+	if (receiver_ring(rx, packet_size, slots) < 0)
+		return -1;
+	if (receiver_evloop(rx) < 0) {
+		receiver_ring_free(rx);
+		return -1;
+	}
+	return 0;
+}
+
+void *receiver_next(struct receiver *rx, int *result)
+{
+	void *pkt;
+
+	/* Refill when empty */
+	while ((pkt = ring_peek(&rx->ring)) == NULL) {
+		if (receiver_fill(rx) < 0) {
+			*result = rx->result;
+			return NULL;
+		}
+	}
+	return pkt;
+}
+
+void receiver_release(struct receiver *rx)
+{
+	ring_pop(&rx->ring);
+}
+
+void receiver_stop(struct receiver *rx)
+{
+	evloop_free(&rx->ev);
+	receiver_ring_free(rx);
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <sys/time.h>
+#include "evloop.h"
+#include "watchdog.h"
+#include "capture.h"
+#include "output.h"
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
+
+/* Lock-free ring of fixed-size packets, for exactly one producer
+   thread and one consumer thread.  The slot memory is allocated once
+   up front. */
+struct ring {
+	unsigned char *slots;
+	size_t slot_size;
+	unsigned int count;	/* power of two */
+	unsigned int head;	/* next slot to fill, written by producer */
+	unsigned int tail;	/* next slot to drain, written by consumer */
+	unsigned int high_water;	/* most slots ever in use */
+};
+
+/* Allocate a ring of "count" slots (rounded up to a power of two).
+   Returns < 0 on error. */
+int ring_init(struct ring *r, size_t slot_size, unsigned int count);
+void ring_free(struct ring *r);
+
+/* Producer: get the next free slot, or NULL if the ring is full.
+   ring_push() then hands it to the consumer. */
+void *ring_slot(struct ring *r);
+void ring_push(struct ring *r);
+void ring_push_n(struct ring *r, unsigned int n);
+
+/* Consumer: get the oldest filled slot, or NULL if the ring is empty.
+   ring_pop() then gives it back to the producer. */
+void *ring_peek(struct ring *r);
+void ring_pop(struct ring *r);
+
+/* Number of filled slots */
+unsigned int ring_used(struct ring *r);
+
+/* Receive thread.  Reads fixed-size packets from a socket into a ring,
+   so a slow consumer doesn't stall the socket.  Each recv reads up to
+   RECEIVER_BATCH bytes directly into the ring, which may be many
+   packets.  It waits for the socket once per batch through an evloop,
+   which also watches a pipe that receiver_stop() uses to wake it.  On
+   Windows there are no threads, and the ring is refilled when the
+   consumer finds it empty.
+
+   Until the first packet arrives, each wait gets the full startup
+   timeout.  After that, a watchdog built from the expected time
+   between packets decides when the stream has stalled.
+
+   With a capture being recorded, every recv is also written to it.
+   With one being replayed, data comes from the capture instead of
+   the socket, at full speed or at the recorded pace.
+
+   If the consumer sets "out", a wait for the next packet lasts no
+   longer than out's latency deadline, and whatever is queued there is
+   flushed when it passes, since packets can be much further apart
+   than that at low scan rates.  (Not on Windows, where the wait is in
+   the receive itself.) */
+#define RECEIVER_BATCH (64 * 1024)
+
+struct receiver {
+	int fd;
+	size_t packet_size;
+	size_t fill;		/* bytes of a partial packet at the head */
+	struct timeval timeout;	/* until the first packet */
+	int adaptive;		/* use the watchdog after that */
+	int started;		/* a packet has arrived */
+	struct watchdog wd;
+	struct ring ring;
+	struct timeval *stamps;	/* when each slot was received */
+	struct capture *capture;	/* or NULL */
+	struct evloop ev;
+	int result;		/* recv_all_timeout() result that ended it */
+	int done;		/* producer has finished */
+	int stop;		/* consumer asked producer to finish */
+	struct output *out;	/* set by the consumer, or NULL */
+#ifndef __WIN32__
+	pthread_t thread;
+	int wake[2];		/* pipe written by receiver_stop() */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int consumer_waiting;
+	int producer_waiting;
+#endif
+};
+
+/* Start receiving packets from fd into a ring of "slots" packets.
+   The first read waits at most "timeout".  If "interval" (the
+   expected seconds between packets) is nonzero, later reads stall out
+   after a few intervals; otherwise every read gets "timeout".  If
+   capture is a replay, fd is not used.  Returns < 0 on error. */
+int receiver_start(struct receiver *rx, int fd, size_t packet_size,
+		   unsigned int slots, struct timeval *timeout,
+		   double interval, struct capture *capture);
+
+/* Wait for the next complete packet.  Returns NULL once the stream
+   has ended, with *result set to the recv_all_timeout() return value
+   that ended it (0 for a closed connection, short or < 0 for an
+   error). */
+void *receiver_next(struct receiver *rx, int *result);
+
+/* Number of packets, starting with the one from receiver_next(), that
+   have been received and follow each other in memory */
+unsigned int receiver_ready(struct receiver *rx);
+
+/* When the packet from receiver_next() was received */
+void receiver_time(struct receiver *rx, struct timeval *tv);
+
+/* Give the packet from receiver_next() back to the receive thread */
+void receiver_release(struct receiver *rx);
+
+/* Stop the receive thread and free the ring.  Reports the ring
+   high-water mark. */
+void receiver_stop(struct receiver *rx);
+
+#endif
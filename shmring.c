@@ -0,0 +1,302 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "debug.h"
+#include "compat.h"
+#include "shmring.h"
+
+#ifndef __WIN32__
+
+/* Shared memory names start with a single slash */
+static void shm_name(char *buf, size_t len, const char *name)
+{
+	snprintf(buf, len, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
+
+int shmring_create(struct shmring *r, const char *name, int channels,
+		   int *channel_list, unsigned int capacity)
+{
+	struct shmring_header *hdr;
+	unsigned int cap;
+	void *map;
+	int fd, i;
+
+	memset(r, 0, sizeof(*r));
+	if (channels < 1 || channels > SHMRING_MAX_CHANNELS) {
+		info("Too many channels for a shared memory ring\n");
+		return -1;
+	}
+	for (cap = 1; cap < capacity; cap <<= 1) ;
+	shm_name(r->name, sizeof(r->name), name);
+	r->size = sizeof(*hdr) + (size_t)cap * channels * sizeof(uint16_t);
+
+	/* An object left behind by an earlier run is in the way; readers
+	   still attached to it keep their own copy */
+	shm_unlink(r->name);
+	fd = shm_open(r->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto fail;
+	if (ftruncate(fd, r->size) < 0)
+		goto fail_unlink;
+	map = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail_unlink;
+	close(fd);
+
+	hdr = map;
+	hdr->version = SHMRING_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->channels = channels;
+	hdr->capacity = cap;
+	hdr->pid = getpid();
+	for (i = 0; i < channels; i++)
+		hdr->channel_list[i] = channel_list[i];
+	/* Readers check the magic last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, SHMRING_MAGIC, sizeof(hdr->magic));
+
+	r->hdr = hdr;
+	r->data = (uint16_t *) ((char *)map + hdr->header_size);
+	return 0;
+
+ fail_unlink:
+	close(fd);
+	shm_unlink(r->name);
+ fail:
+	info("Can't create shared memory ring %s: %s\n", r->name,
+	     compat_strerror(errno));
+	return -1;
+}
+
+void shmring_start(struct shmring *r, int device, double rate)
+{
+	__atomic_store_n(&r->hdr->device, device, __ATOMIC_RELAXED);
+	r->hdr->rate = rate;
+}
+
+void shmring_publish(struct shmring *r, const uint16_t * scans, int count)
+{
+	struct shmring_header *hdr = r->hdr;
+	unsigned int channels = hdr->channels;
+	uint64_t seq = hdr->seq;
+	unsigned int slot, n;
+
+	if (count <= 0)
+		return;
+
+	/* Only the last ring's worth of a large block survives anyway */
+	if ((unsigned int)count > hdr->capacity) {
+		scans += (size_t)(count - hdr->capacity) * channels;
+		seq += count - hdr->capacity;
+		count = hdr->capacity;
+	}
+
+	/* Mark the slots as being overwritten before touching them */
+	__atomic_store_n(&hdr->writing, seq + count, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	while (count > 0) {
+		slot = seq & (hdr->capacity - 1);
+		n = hdr->capacity - slot;
+		if (n > (unsigned int)count)
+			n = count;
+		memcpy(r->data + (size_t)slot * channels, scans,
+		       (size_t)n * channels * sizeof(uint16_t));
+		scans += (size_t)n * channels;
+		seq += n;
+		count -= n;
+	}
+
+	__atomic_store_n(&hdr->seq, seq, __ATOMIC_RELEASE);
+}
+
+void shmring_gap(struct shmring *r)
+{
+	struct shmring_header *hdr = r->hdr;
+
+	__atomic_store_n(&hdr->gap_seq, hdr->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->gaps, hdr->gaps + 1, __ATOMIC_RELEASE);
+}
+
+void shmring_close(struct shmring *r)
+{
+	if (!r->hdr)
+		return;
+	munmap(r->hdr, r->size);
+	shm_unlink(r->name);
+	r->hdr = NULL;
+}
+
+int shmring_attach(struct shmring_reader *r, const char *name)
+{
+	const struct shmring_header *hdr;
+	char path[256];
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	shm_name(path, sizeof(path), name);
+	fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		goto fail;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		goto fail;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	hdr = map;
+	if ((size_t)st.st_size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, SHMRING_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != SHMRING_VERSION) {
+		info("%s is not a shared memory ring\n", path);
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if ((size_t)st.st_size < hdr->header_size + (size_t)hdr->capacity *
+	    hdr->channels * sizeof(uint16_t)) {
+		info("Shared memory ring %s is truncated\n", path);
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->hdr = hdr;
+	r->data = (const uint16_t *)((const char *)map + hdr->header_size);
+	r->size = st.st_size;
+	r->cursor = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+	return 0;
+
+ fail:
+	info("Can't attach to shared memory ring %s: %s\n", path,
+	     compat_strerror(errno));
+	return -1;
+}
+
+int shmring_read(struct shmring_reader *r, uint16_t * buf, int max_scans,
+		 uint64_t * lost)
+{
+	const struct shmring_header *hdr = r->hdr;
+	unsigned int channels = hdr->channels;
+	unsigned int capacity = hdr->capacity;
+	uint64_t head, writing, cursor, oldest, skipped = 0;
+	unsigned int slot, n, count, bad;
+	uint16_t *p = buf;
+
+	head = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+	if (head - r->cursor > capacity) {
+		skipped = head - r->cursor - capacity;
+		r->cursor = head - capacity;
+	}
+	if (max_scans < 0)
+		max_scans = 0;
+	count = head - r->cursor;
+	if (count > (unsigned int)max_scans)
+		count = max_scans;
+
+	for (cursor = r->cursor, n = 0; n < count; cursor += slot) {
+		unsigned int first = cursor & (capacity - 1);
+
+		slot = capacity - first;
+		if (slot > count - n)
+			slot = count - n;
+		memcpy(p, r->data + (size_t)first * channels,
+		       (size_t)slot * channels * sizeof(uint16_t));
+		p += (size_t)slot * channels;
+		n += slot;
+	}
+
+	/* Anything the writer started overwriting while we copied is
+	   garbage: drop it from the front */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	writing = __atomic_load_n(&hdr->writing, __ATOMIC_RELAXED);
+	oldest = (writing > capacity) ? writing - capacity : 0;
+	bad = 0;
+	if (oldest > r->cursor) {
+		bad = (oldest - r->cursor < count) ? oldest - r->cursor : count;
+		memmove(buf, buf + (size_t)bad * channels,
+			(size_t)(count - bad) * channels * sizeof(uint16_t));
+		skipped += bad;
+	}
+
+	r->cursor += count;
+	if (lost)
+		*lost = skipped;
+	return count - bad;
+}
+
+void shmring_detach(struct shmring_reader *r)
+{
+	if (!r->hdr)
+		return;
+	munmap((void *)r->hdr, r->size);
+	r->hdr = NULL;
+}
+
+#else				/* __WIN32__ */
+
+int shmring_create(struct shmring *r, const char *name, int channels,
+		   int *channel_list, unsigned int capacity)
+{
+	memset(r, 0, sizeof(*r));
+	info("Shared memory rings are not supported on Windows\n");
+	return -1;
+}
+
+void shmring_start(struct shmring *r, int device, double rate)
+{
+}
+
+void shmring_publish(struct shmring *r, const uint16_t * scans, int count)
+{
+}
+
+void shmring_gap(struct shmring *r)
+{
+}
+
+void shmring_close(struct shmring *r)
+{
+}
+
+int shmring_attach(struct shmring_reader *r, const char *name)
+{
+	memset(r, 0, sizeof(*r));
+	info("Shared memory rings are not supported on Windows\n");
+	return -1;
+}
+
+int shmring_read(struct shmring_reader *r, uint16_t * buf, int max_scans,
+		 uint64_t * lost)
+{
+	return 0;
+}
+
+void shmring_detach(struct shmring_reader *r)
+{
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Ring of scans in POSIX shared memory, published by one ethstream
+   and followed by any number of readers, each at its own pace.  The
+   writer never waits for readers; one that falls more than a ring
+   behind loses the oldest scans, and is told how many.
+
+   The object starts with struct shmring_header, in host byte order.
+   Raw samples follow at header_size, as uint16_t scans of "channels"
+   values, the same values ethstream writes in decimal.  Scan number n
+   (counting from 0 at creation) is at index n % capacity.
+
+   "seq" is the number of scans published.  Before overwriting any
+   slot, the writer raises "writing" to the sequence number the ring
+   will have once it is done, so a reader that has copied scans can
+   tell whether any of them were overwritten meanwhile: every scan
+   below writing - capacity is gone. */
+
+#define SHMRING_MAGIC "ETHSRING"
+#define SHMRING_VERSION 1
+#define SHMRING_MAX_CHANNELS 256
+#define SHMRING_SCANS 65536	/* default capacity, in scans */
+
+struct shmring_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;	/* offset of the samples */
+	uint32_t channels;
+	uint32_t capacity;	/* scans, a power of two */
+	uint32_t device;	/* BINARY_DEVICE_*, 0 before streaming */
+	uint32_t pid;		/* of the writer */
+	double rate;		/* scans per second */
+	uint16_t channel_list[SHMRING_MAX_CHANNELS];
+	uint64_t gaps;		/* restarts that lost data */
+	uint64_t gap_seq;	/* seq at the last gap */
+	uint64_t writing __attribute__ ((aligned(64)));
+	uint64_t seq __attribute__ ((aligned(64)));
+};
+
+/* Writer */
+struct shmring {
+	struct shmring_header *hdr;
+	uint16_t *data;
+	size_t size;
+	char name[256];
+};
+
+/* Create the shared memory object "name" (a leading '/' is added if
+   missing), replacing any left behind.  Returns < 0 on error. */
+int shmring_create(struct shmring *r, const char *name, int channels,
+		   int *channel_list, unsigned int capacity);
+
+/* A stream is starting */
+void shmring_start(struct shmring *r, int device, double rate);
+
+/* Publish "count" scans */
+void shmring_publish(struct shmring *r, const uint16_t * scans, int count);
+
+/* Data was lost between the scans published so far and the next */
+void shmring_gap(struct shmring *r);
+
+/* Unmap and remove the object.  Attached readers keep their mapping. */
+void shmring_close(struct shmring *r);
+
+/* Reader */
+struct shmring_reader {
+	const struct shmring_header *hdr;
+	const uint16_t *data;
+	size_t size;
+	uint64_t cursor;	/* next scan to read */
+};
+
+/* Attach to the ring "name", starting with the next scan published.
+   Returns < 0 on error. */
+int shmring_attach(struct shmring_reader *r, const char *name);
+
+/* Copy up to max_scans of the scans published since the last read
+   into buf, which holds max_scans * channels samples.  Returns the
+   number copied, which is 0 if there is nothing new; this never
+   waits.  *lost (if not NULL) gets the number of scans that were
+   overwritten before they could be read, and skipped. */
+int shmring_read(struct shmring_reader *r, uint16_t * buf, int max_scans,
+		 uint64_t * lost);
+
+void shmring_detach(struct shmring_reader *r);
+
+#endif
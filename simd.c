@@ -0,0 +1,338 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+
+/* The vector versions are only used on x86-64, where the scalar code
+   also does double math in SSE2 registers.  On 32-bit x86 the scalar
+   code may use the x87 FPU, which rounds differently. */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+static inline uint16_t swap16(uint16_t v)
+{
+	return (uint16_t)((v << 8) | (v >> 8));
+}
+
+static inline int16_t load_be16(const int16_t * p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (int16_t)swap16(v);
+}
+
+void simd_unpack_raw_scalar(const int16_t * in, uint16_t * out, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		out[i] = (uint16_t)(load_be16(in + i) - INT16_MIN);
+}
+
+void simd_unpack_volts_scalar(const int16_t * in, const double *scale,
+			      double *out, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		out[i] = (double)(load_be16(in + i) / 32767.0) * scale[i];
+}
+
+void simd_unpack_volts_float_scalar(const int16_t * in, const float *scale,
+				    float *out, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		out[i] = (float)load_be16(in + i) / 32767.0f * scale[i];
+}
+
+/* Normal checksum: bytes 1-5, folded to 8 bits.  Extended checksum:
+   bytes 6-45, in 16 bits. */
+static inline int ue9_packet_ok(const uint8_t * p, unsigned int norm,
+				unsigned int ext)
+{
+	norm = (norm >> 8) + (norm & 0xff);
+	norm = (norm >> 8) + (norm & 0xff);
+	return p[0] == (uint8_t)norm && p[4] == (ext & 0xff) &&
+	    p[5] == ((ext >> 8) & 0xff);
+}
+
+int simd_ue9_verify_scalar(const uint8_t * pkt, int count)
+{
+	unsigned int norm, ext;
+	int i, j;
+
+	for (i = 0; i < count; i++, pkt += SIMD_UE9_PACKET) {
+		norm = ext = 0;
+		for (j = 1; j < 6; j++)
+			norm += pkt[j];
+		for (j = 6; j < SIMD_UE9_PACKET; j++)
+			ext += pkt[j];
+		if (!ue9_packet_ok(pkt, norm, ext))
+			break;
+	}
+	return i;
+}
+
+#ifdef SIMD_X86
+
+/* PSADBW against zero sums each half of a vector's bytes.  Bytes 6-45
+   are loaded from offsets 6, 22 and 30, with the overlap masked off,
+   so no load leaves the packet. */
+static int ue9_verify_sse2(const uint8_t * pkt, int count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i head = _mm_setr_epi8(0, -1, -1, -1, -1, -1, 0, 0,
+					   0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i tail = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+					   -1, -1, -1, -1, -1, -1, -1, -1);
+	int i;
+
+	for (i = 0; i < count; i++, pkt += SIMD_UE9_PACKET) {
+		__m128i a = _mm_loadu_si128((const __m128i *)pkt);
+		__m128i b = _mm_loadu_si128((const __m128i *)(pkt + 6));
+		__m128i c = _mm_loadu_si128((const __m128i *)(pkt + 22));
+		__m128i d = _mm_loadu_si128((const __m128i *)(pkt + 30));
+		__m128i ext;
+
+		a = _mm_sad_epu8(_mm_and_si128(a, head), zero);
+		ext = _mm_add_epi64(_mm_sad_epu8(b, zero),
+				    _mm_sad_epu8(c, zero));
+		ext = _mm_add_epi64(ext, _mm_sad_epu8(_mm_and_si128(d, tail),
+						      zero));
+		ext = _mm_add_epi64(ext, _mm_srli_si128(ext, 8));
+
+		if (!ue9_packet_ok(pkt, _mm_cvtsi128_si32(a),
+				   _mm_cvtsi128_si32(ext)))
+			break;
+	}
+	return i;
+}
+
+/* Swap bytes, then flip the sign bit to get offset binary */
+static void unpack_raw_sse2(const int16_t * in, uint16_t * out, int count)
+{
+	const __m128i sign = _mm_set1_epi16((short)0x8000);
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(v, sign));
+	}
+	simd_unpack_raw_scalar(in + i, out + i, count - i);
+}
+
+static void unpack_volts_sse2(const int16_t * in, const double *scale,
+			      double *out, int count)
+{
+	const __m128d div = _mm_set1_pd(32767.0);
+	int i, j;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i w[2];
+
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		/* Sign-extend to 32 bits */
+		w[0] = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		w[1] = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+		for (j = 0; j < 2; j++) {
+			__m128d lo = _mm_cvtepi32_pd(w[j]);
+			__m128d hi = _mm_cvtepi32_pd(_mm_srli_si128(w[j], 8));
+			double *o = out + i + 4 * j;
+			const double *s = scale + i + 4 * j;
+
+			lo = _mm_mul_pd(_mm_div_pd(lo, div), _mm_loadu_pd(s));
+			hi = _mm_mul_pd(_mm_div_pd(hi, div),
+					_mm_loadu_pd(s + 2));
+			_mm_storeu_pd(o, lo);
+			_mm_storeu_pd(o + 2, hi);
+		}
+	}
+	simd_unpack_volts_scalar(in + i, scale + i, out + i, count - i);
+}
+
+static void unpack_volts_float_sse2(const int16_t * in, const float *scale,
+				    float *out, int count)
+{
+	const __m128 div = _mm_set1_ps(32767.0f);
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128 lo, hi;
+
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v),
+						    16));
+		hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v),
+						    16));
+		lo = _mm_mul_ps(_mm_div_ps(lo, div), _mm_loadu_ps(scale + i));
+		hi = _mm_mul_ps(_mm_div_ps(hi, div),
+				_mm_loadu_ps(scale + i + 4));
+		_mm_storeu_ps(out + i, lo);
+		_mm_storeu_ps(out + i + 4, hi);
+	}
+	simd_unpack_volts_float_scalar(in + i, scale + i, out + i, count - i);
+}
+
+__attribute__ ((target("avx2")))
+static void unpack_raw_avx2(const int16_t * in, uint16_t * out, int count)
+{
+	const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6,
+					      9, 8, 11, 10, 13, 12, 15, 14);
+	const __m256i sign = _mm256_set1_epi16((short)0x8000);
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+		v = _mm256_shuffle_epi8(v, swap);
+		_mm256_storeu_si256((__m256i *)(out + i),
+				    _mm256_xor_si256(v, sign));
+	}
+	unpack_raw_sse2(in + i, out + i, count - i);
+}
+
+__attribute__ ((target("avx2")))
+static void unpack_volts_avx2(const int16_t * in, const double *scale,
+			      double *out, int count)
+{
+	const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					   9, 8, 11, 10, 13, 12, 15, 14);
+	const __m256d div = _mm256_set1_pd(32767.0);
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m256i w;
+		__m256d lo, hi;
+
+		v = _mm_shuffle_epi8(v, swap);
+		w = _mm256_cvtepi16_epi32(v);
+		lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(w));
+		hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(w, 1));
+		lo = _mm256_mul_pd(_mm256_div_pd(lo, div),
+				   _mm256_loadu_pd(scale + i));
+		hi = _mm256_mul_pd(_mm256_div_pd(hi, div),
+				   _mm256_loadu_pd(scale + i + 4));
+		_mm256_storeu_pd(out + i, lo);
+		_mm256_storeu_pd(out + i + 4, hi);
+	}
+	unpack_volts_sse2(in + i, scale + i, out + i, count - i);
+}
+
+__attribute__ ((target("avx2")))
+static void unpack_volts_float_avx2(const int16_t * in, const float *scale,
+				    float *out, int count)
+{
+	const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					   9, 8, 11, 10, 13, 12, 15, 14);
+	const __m256 div = _mm256_set1_ps(32767.0f);
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m256 f;
+
+		v = _mm_shuffle_epi8(v, swap);
+		f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+		f = _mm256_mul_ps(_mm256_div_ps(f, div),
+				  _mm256_loadu_ps(scale + i));
+		_mm256_storeu_ps(out + i, f);
+	}
+	unpack_volts_float_sse2(in + i, scale + i, out + i, count - i);
+}
+
+#endif				/* SIMD_X86 */
+
+struct simd_impl {
+	const char *name;
+	void (*raw) (const int16_t *, uint16_t *, int);
+	void (*volts) (const int16_t *, const double *, double *, int);
+	void (*volts_float) (const int16_t *, const float *, float *, int);
+	int (*ue9_verify) (const uint8_t *, int);
+};
+
+static const struct simd_impl impl_scalar = {
+	"scalar", simd_unpack_raw_scalar, simd_unpack_volts_scalar,
+	simd_unpack_volts_float_scalar, simd_ue9_verify_scalar,
+};
+
+#ifdef SIMD_X86
+/* SSE2 is part of x86-64.  Packets are too short to gain from AVX2 in
+   ue9_verify. */
+static const struct simd_impl impl_sse2 = {
+	"sse2", unpack_raw_sse2, unpack_volts_sse2, unpack_volts_float_sse2,
+	ue9_verify_sse2,
+};
+
+static const struct simd_impl impl_avx2 = {
+	"avx2", unpack_raw_avx2, unpack_volts_avx2, unpack_volts_float_avx2,
+	ue9_verify_sse2,
+};
+#endif
+
+static const struct simd_impl *impl;
+
+/* The implementation for this CPU, picked on first use.  Device
+   threads may get here at the same time; they pick the same table,
+   and only the pointer to it is shared. */
+static const struct simd_impl *simd_impl(void)
+{
+	const struct simd_impl *i = __atomic_load_n(&impl, __ATOMIC_ACQUIRE);
+
+	if (i != NULL)
+		return i;
+
+	i = &impl_scalar;
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	i = __builtin_cpu_supports("avx2") ? &impl_avx2 : &impl_sse2;
+#endif
+	__atomic_store_n(&impl, i, __ATOMIC_RELEASE);
+	return i;
+}
+
+void simd_unpack_raw(const int16_t * in, uint16_t * out, int count)
+{
+	simd_impl()->raw(in, out, count);
+}
+
+void simd_unpack_volts(const int16_t * in, const double *scale,
+		       double *out, int count)
+{
+	simd_impl()->volts(in, scale, out, count);
+}
+
+void simd_unpack_volts_float(const int16_t * in, const float *scale,
+			     float *out, int count)
+{
+	simd_impl()->volts_float(in, scale, out, count);
+}
+
+int simd_ue9_verify(const uint8_t * pkt, int count)
+{
+	return simd_impl()->ue9_verify(pkt, count);
+}
+
+const char *simd_name(void)
+{
+	return simd_impl()->name;
+}
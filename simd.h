@@ -0,0 +1,49 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+/* Bulk sample conversion and packet checking kernels.  The best implementation for this
+   CPU (AVX2, SSE2 or plain C) is chosen on first use; all of them give
+   bit-identical results. */
+
+/* Convert big-endian signed samples to host-order offset binary,
+   i.e. (uint16_t)(sample - INT16_MIN). */
+void simd_unpack_raw(const int16_t * in, uint16_t * out, int count);
+
+/* Convert big-endian signed samples to volts, sample / 32767.0 *
+   scale[i], where scale[i] is the range of sample i. */
+void simd_unpack_volts(const int16_t * in, const double *scale,
+		       double *out, int count);
+void simd_unpack_volts_float(const int16_t * in, const float *scale,
+			     float *out, int count);
+
+/* Plain C versions of the above, for comparison */
+void simd_unpack_raw_scalar(const int16_t * in, uint16_t * out, int count);
+void simd_unpack_volts_scalar(const int16_t * in, const double *scale,
+			      double *out, int count);
+void simd_unpack_volts_float_scalar(const int16_t * in, const float *scale,
+				    float *out, int count);
+
+/* Check the extended and normal checksums of "count" consecutive
+   46-byte UE9 stream packets, without modifying them.  Returns the
+   number of leading packets that are valid, so count if all are.  A
+   packet is accepted exactly when ue9_verify_extended() and
+   ue9_verify_normal(pkt, 6) both accept it. */
+#define SIMD_UE9_PACKET 46
+int simd_ue9_verify(const uint8_t * pkt, int count);
+int simd_ue9_verify_scalar(const uint8_t * pkt, int count);
+
+/* Name of the implementation in use ("avx2", "sse2" or "scalar") */
+const char *simd_name(void);
+
+#endif
@@ -0,0 +1,664 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+/* UE9 simulator.  Listens on the UE9 command and data ports and
+   answers what ethstream sends: FlushBuffer, StreamStop, StreamStart,
+   StreamConfig, TimerConfig, CommConfig and ReadMem for the
+   calibration blocks.  Once started, it sends 46-byte stream packets
+   at the configured scan rate.  Backlog pressure and skipped packet
+   counters can be injected to exercise the abort paths, and StreamStop
+   rejected to exercise the setup's error handling. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <netinet/tcp.h>
+
+#include "debug.h"
+#include "opt.h"
+#include "netutil.h"
+#include "evloop.h"
+#include "ue9.h"
+#include "ue9error.h"
+
+#define SIM_PACKET 46
+#define SIM_SAMPLES 16		/* samples per stream packet */
+#define SIM_WAVE 4096		/* entries in one cycle of the test signal */
+#define SIM_HZ 60.0		/* frequency of the test signal */
+#define SIM_BURST 256		/* most packets sent per wakeup */
+
+struct options opt[] = {
+	{'a', "address", "string", "address to listen on (127.0.0.1)"},
+	{'f', "fast", NULL, "send packets as fast as possible"},
+	{'s', "skip", "n", "skip a packet counter after every n packets"},
+	{'o', "comm-overflow", "n",
+	 "overflow CommBacklog after every n packets"},
+	{'C', "control-overflow", "n",
+	 "max out ControlBacklog after every n packets"},
+	{'p', "pressure", NULL, "report high, but not fatal, backlogs"},
+	{'b', "bad-stop", NULL, "reject StreamStop when no stream is running"},
+	{'c', "count", "n", "exit after sending n packets"},
+	{'v', "verbose", NULL, "be verbose"},
+	{'h', "help", NULL, "this help"},
+	{0, NULL, NULL, NULL}
+};
+
+struct sim {
+	const char *address;
+	int fast;
+	int pressure;
+	int bad_stop;
+	unsigned long skip_every;
+	unsigned long comm_every;
+	unsigned long control_every;
+	unsigned long max_packets;
+
+	struct evloop ev;
+	int fd_cmd_listen, fd_data_listen;
+	int fd_cmd, fd_data;	/* -1 if not connected */
+	uint8_t cmdbuf[1024];
+	int cmdlen;
+
+	/* Stream configuration */
+	int channels;
+	uint8_t channel_list[UE9_MAX_CHANNEL_COUNT];
+	double rate;		/* scans per second */
+	int started;
+
+	/* Stream state */
+	uint8_t counter;	/* next packet counter */
+	unsigned long sample;	/* samples generated so far */
+	unsigned long sent;	/* packets sent, over all streams */
+	double interval;	/* seconds per packet */
+	struct timeval next;	/* when the next packet is due */
+
+	uint16_t wave[SIM_WAVE];
+};
+
+static void tv_add(struct timeval *tv, double seconds)
+{
+	long usec = (long)(seconds * 1e6);
+
+	tv->tv_sec += usec / 1000000;
+	tv->tv_usec += usec % 1000000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+static int sim_listen(struct sim *sim, int port)
+{
+	struct sockaddr_in sa;
+	int fd, one = 1;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = inet_addr(sim->address);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(fd, 4) < 0) {
+		info("can't listen on %s:%d: %s\n", sim->address, port,
+		     strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Replace *fd with a newly accepted connection */
+static void sim_accept(struct sim *sim, int listen_fd, int *fd)
+{
+	int newfd = accept(listen_fd, NULL, NULL);
+	int one = 1;
+
+	if (newfd < 0)
+		return;
+
+	/* Replies to a batch of commands go out right away, without
+	   waiting for the ACK of the previous one */
+	setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (*fd >= 0) {
+		evloop_remove(&sim->ev, *fd);
+		close(*fd);
+	}
+	*fd = newfd;
+	evloop_add(&sim->ev, newfd, EVLOOP_READ);
+}
+
+static void sim_close(struct sim *sim, int *fd)
+{
+	if (*fd < 0)
+		return;
+	evloop_remove(&sim->ev, *fd);
+	close(*fd);
+	*fd = -1;
+}
+
+/* Start sending packets on the data connection, one packet time from
+   now */
+static void sim_schedule(struct sim *sim)
+{
+	struct timeval timeout = { 0, 0 };
+
+	if (sim->fd_data < 0 || !sim->started)
+		return;
+	gettimeofday(&sim->next, NULL);
+	if (!sim->fast) {
+		tv_add(&sim->next, sim->interval);
+		tv_add(&timeout, sim->interval);
+	}
+	evloop_set_timeout(&sim->ev, sim->fd_data, &timeout);
+}
+
+/* Fill in checksums and send a reply */
+static void sim_reply(struct sim *sim, uint8_t * buf, int len)
+{
+	if ((buf[1] & 0x78) == 0x78)
+		ue9_checksum_extended(buf, len);
+	else
+		ue9_checksum_normal(buf, len);
+	if (send(sim->fd_cmd, buf, len, 0) != len)
+		sim_close(sim, &sim->fd_cmd);
+}
+
+/* Inverse of ue9_fp64_to_double */
+static void put_fp64(uint8_t * p, double v)
+{
+	int32_t a = (int32_t) floor(v);
+	uint32_t b = (uint32_t) ((v - a) * 4294967296.0);
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		p[i] = (b >> (8 * i)) & 0xff;
+		p[4 + i] = ((uint32_t) a >> (8 * i)) & 0xff;
+	}
+}
+
+/* ReadMem: calibration blocks hold nominal values for a UE9 */
+static void sim_readmem(struct sim *sim, int block)
+{
+	uint8_t r[136];
+	uint8_t *d = r + 8;
+	int i;
+
+	memset(r, 0, sizeof(r));
+	r[1] = 0xF8;
+	r[2] = 0x41;
+	r[3] = 0x2A;
+
+	switch (block) {
+	case 0:
+		for (i = 0; i < 4; i++) {
+			put_fp64(d + 16 * i, 5.0 / 65536 / (1 << i));
+			put_fp64(d + 16 * i + 8, -0.0116);
+		}
+		break;
+	case 1:
+		put_fp64(d, 10.25 / 65536);
+		put_fp64(d + 8, -5.1875);
+		break;
+	case 2:
+		put_fp64(d, 842.59);
+		put_fp64(d + 8, 0);
+		put_fp64(d + 16, 842.59);
+		put_fp64(d + 24, 0);
+		put_fp64(d + 32, 0.012683);
+		put_fp64(d + 48, 0.012683);
+		put_fp64(d + 64, 298.15);
+		put_fp64(d + 72, 2.43);
+		put_fp64(d + 88, 1.215);
+		put_fp64(d + 96, 9.3e-5);
+		break;
+	case 3:
+	case 4:
+		put_fp64(d, block == 3 ? 5.0 / 65536 : 10.25 / 65536);
+		put_fp64(d + 8, block == 3 ? -0.0116 : -5.1875);
+		break;
+	default:
+		r[6] = INVALID_BLOCK;
+		break;
+	}
+	sim_reply(sim, r, sizeof(r));
+}
+
+/* CommConfig, read only */
+static void sim_commconfig(struct sim *sim)
+{
+	uint8_t r[38];
+	static const uint8_t mac[6] = { 0x09, 0x00, 0x00, 0x5e, 0x00, 0x02 };
+	uint32_t addr = ntohl(inet_addr(sim->address));
+
+	memset(r, 0, sizeof(r));
+	r[1] = 0xF8;
+	r[2] = 0x10;
+	r[3] = 0x01;
+	r[8] = 1;		/* local id */
+	r[10] = addr & 0xff;
+	r[11] = (addr >> 8) & 0xff;
+	r[12] = (addr >> 16) & 0xff;
+	r[13] = addr >> 24;
+	r[18] = r[19] = r[20] = 0xff;	/* 255.255.255.0 */
+	r[22] = UE9_COMMAND_PORT & 0xff;
+	r[23] = UE9_COMMAND_PORT >> 8;
+	r[24] = UE9_DATA_PORT & 0xff;
+	r[25] = UE9_DATA_PORT >> 8;
+	r[27] = 9;		/* product id */
+	memcpy(r + 28, mac, 6);
+	r[34] = 10;		/* hardware 1.10 */
+	r[35] = 1;
+	r[36] = 56;		/* firmware 1.56 */
+	r[37] = 1;
+	sim_reply(sim, r, sizeof(r));
+}
+
+static void sim_streamconfig(struct sim *sim, uint8_t * cmd)
+{
+	uint8_t r[8];
+	int i, n = cmd[6];
+
+	memset(r, 0, sizeof(r));
+	r[1] = 0xF8;
+	r[2] = 0x01;
+	r[3] = 0x11;
+
+	if (sim->started) {
+		r[6] = STREAM_IS_ACTIVE;
+	} else if (n < 1 || n > UE9_MAX_CHANNEL_COUNT || cmd[2] != n + 3) {
+		r[6] = STREAM_CONFIG_INVALID;
+	} else {
+		sim->channels = n;
+		for (i = 0; i < n; i++)
+			sim->channel_list[i] = cmd[12 + 2 * i];
+		sim->rate = ue9_compute_rate(cmd[9], cmd[10] | (cmd[11] << 8));
+		if (sim->rate <= 0)
+			r[6] = STREAM_SCAN_RATE_INVALID;
+		else
+			verb("StreamConfig: %d channels at %.1f Hz\n",
+			     n, sim->rate);
+	}
+	sim_reply(sim, r, sizeof(r));
+}
+
+static void sim_timerconfig(struct sim *sim, uint8_t * cmd)
+{
+	uint8_t r[40];
+
+	memset(r, 0, sizeof(r));
+	r[1] = 0xF8;
+	r[2] = 0x11;
+	r[3] = 0x18;
+	if (sim->started)
+		r[6] = TIMER_STREAM_ACTIVE;
+	else
+		r[7] = cmd[7] & 0x0f;	/* EnableStatus */
+	verb("TimerConfig: %d timers\n", cmd[7] & 0x0f);
+	sim_reply(sim, r, sizeof(r));
+}
+
+static void sim_extended(struct sim *sim, uint8_t * cmd)
+{
+	uint8_t r[8];
+
+	switch (cmd[3]) {
+	case 0x2A:
+		sim_readmem(sim, cmd[7]);
+		break;
+	case 0x01:
+		sim_commconfig(sim);
+		break;
+	case 0x11:
+		sim_streamconfig(sim, cmd);
+		break;
+	case 0x18:
+		sim_timerconfig(sim, cmd);
+		break;
+	default:
+		verb("unknown extended command 0x%02x\n", cmd[3]);
+		memset(r, 0, sizeof(r));
+		r[1] = 0xF8;
+		r[2] = 0x01;
+		r[3] = cmd[3];
+		r[6] = FUNCTION_INVALID;
+		sim_reply(sim, r, sizeof(r));
+		break;
+	}
+}
+
+static void sim_normal(struct sim *sim, uint8_t * cmd)
+{
+	uint8_t r[4] = { 0, 0, 0, 0 };
+
+	switch (cmd[1]) {
+	case 0x08:		/* FlushBuffer */
+		verb("FlushBuffer\n");
+		r[1] = 0x08;
+		sim_reply(sim, r, 2);
+		break;
+	case 0xB0:		/* StreamStop */
+		verb("StreamStop\n");
+		if (sim->bad_stop && !sim->started) {
+			/* Short "bad command" reply */
+			r[1] = 0xB8;
+			sim_reply(sim, r, 2);
+			break;
+		}
+		r[1] = 0xB1;
+		r[2] = sim->started ? 0 : STREAM_NOT_RUNNING;
+		sim->started = 0;
+		sim_reply(sim, r, 4);
+		break;
+	case 0xA8:		/* StreamStart */
+		r[1] = 0xA9;
+		if (sim->started) {
+			r[2] = STREAM_IS_ACTIVE;
+		} else if (sim->channels == 0) {
+			r[2] = STREAM_CONFIG_INVALID;
+		} else {
+			verb("StreamStart\n");
+			sim->started = 1;
+			sim->counter = 0;
+			sim->sample = 0;
+			sim->interval = SIM_SAMPLES /
+			    (sim->channels * sim->rate);
+			sim_schedule(sim);
+		}
+		sim_reply(sim, r, 4);
+		break;
+	default:
+		verb("unknown command 0x%02x\n", cmd[1]);
+		break;
+	}
+}
+
+/* Handle every complete command in the buffer, using the length that
+   each command's header gives */
+static void sim_commands(struct sim *sim)
+{
+	uint8_t *cmd = sim->cmdbuf;
+	int len, extended;
+
+	while (sim->cmdlen >= 2 && sim->fd_cmd >= 0) {
+		extended = ((cmd[1] & 0x78) == 0x78);
+		if (extended && sim->cmdlen < 3)
+			return;
+		len = extended ? 6 + cmd[2] * 2 : 2 + (cmd[1] & 7) * 2;
+		if (len > (int)sizeof(sim->cmdbuf)) {
+			verb("command too long\n");
+			sim_close(sim, &sim->fd_cmd);
+			return;
+		}
+		if (sim->cmdlen < len)
+			return;
+
+		if (extended ? (!ue9_verify_extended(cmd, len) ||
+				!ue9_verify_normal(cmd, 6)) :
+		    !ue9_verify_normal(cmd, len))
+			verb("bad checksum on command 0x%02x\n", cmd[1]);
+		else if (extended)
+			sim_extended(sim, cmd);
+		else
+			sim_normal(sim, cmd);
+
+		sim->cmdlen -= len;
+		memmove(cmd, cmd + len, sim->cmdlen);
+	}
+}
+
+static void sim_command_read(struct sim *sim)
+{
+	ssize_t ret;
+
+	ret = recv(sim->fd_cmd, sim->cmdbuf + sim->cmdlen,
+		   sizeof(sim->cmdbuf) - sim->cmdlen, 0);
+	if (ret <= 0) {
+		sim_close(sim, &sim->fd_cmd);
+		sim->cmdlen = 0;
+		return;
+	}
+	sim->cmdlen += ret;
+	sim_commands(sim);
+}
+
+/* Build the next stream packet.  Analog channels get a sine wave,
+   each a bit further along in phase; others get their channel
+   number. */
+static void sim_packet(struct sim *sim, uint8_t * pkt)
+{
+	double step = SIM_WAVE * SIM_HZ / sim->rate;
+	int i;
+
+	memset(pkt, 0, SIM_PACKET);
+	pkt[1] = 0xF9;
+	pkt[2] = 0x14;
+	pkt[3] = 0xC0;
+	pkt[10] = sim->counter;
+
+	for (i = 0; i < SIM_SAMPLES; i++, sim->sample++) {
+		int c = sim->sample % sim->channels;
+		unsigned long scan = sim->sample / sim->channels;
+		uint16_t v = sim->channel_list[c];
+
+		if (sim->channel_list[c] <= UE9_MAX_ANALOG_CHANNEL)
+			v = sim->wave[((unsigned long)(scan * step) +
+				       c * SIM_WAVE / 16) % SIM_WAVE];
+		pkt[12 + 2 * i] = v & 0xff;
+		pkt[13 + 2 * i] = v >> 8;
+	}
+
+	if (sim->pressure) {
+		pkt[44] = 240;	/* ControlBacklog, bytes */
+		pkt[45] = 120;	/* CommBacklog, 4 kB units */
+	}
+	if (sim->control_every && (sim->sent + 1) % sim->control_every == 0) {
+		verb("maxing out ControlBacklog in packet %d\n", pkt[10]);
+		pkt[44] = 255;
+	}
+	if (sim->comm_every && (sim->sent + 1) % sim->comm_every == 0) {
+		verb("overflowing CommBacklog in packet %d\n", pkt[10]);
+		pkt[45] |= 0x80;
+	}
+
+	ue9_checksum_extended(pkt, SIM_PACKET);
+}
+
+/* Send every packet that is due, or a burst in fast mode */
+static void sim_send(struct sim *sim)
+{
+	uint8_t pkt[SIM_BURST][SIM_PACKET];
+	struct timeval now, timeout = { 0, 0 };
+	int n, len;
+
+	/* In fast mode, don't block in send() once the client stops
+	   reading: commands such as StreamStop would go unanswered */
+	if (sim->fast) {
+		struct pollfd pfd = { sim->fd_data, POLLOUT, 0 };
+
+		if (poll(&pfd, 1, 0) == 0) {
+			timeout.tv_usec = 1000;
+			evloop_set_timeout(&sim->ev, sim->fd_data, &timeout);
+			return;
+		}
+	}
+
+	gettimeofday(&now, NULL);
+	for (n = 0; n < SIM_BURST; n++) {
+		if (!sim->fast && timercmp(&now, &sim->next, <))
+			break;
+		sim_packet(sim, pkt[n]);
+		sim->counter++;
+		sim->sent++;
+		tv_add(&sim->next, sim->interval);
+
+		if (sim->skip_every && sim->sent % sim->skip_every == 0) {
+			verb("skipping packet %d\n", sim->counter);
+			sim->counter++;
+		}
+		if (sim->max_packets && sim->sent >= sim->max_packets) {
+			n++;
+			break;
+		}
+	}
+
+	/* All due packets go out in one send, as a device would put
+	   them in as few segments as it could */
+	len = n * SIM_PACKET;
+	if (len && send(sim->fd_data, pkt, len, 0) != len) {
+		verb("data connection closed\n");
+		sim_close(sim, &sim->fd_data);
+		return;
+	}
+	if (sim->max_packets && sim->sent >= sim->max_packets) {
+		info("sent %lu packets\n", sim->sent);
+		exit(0);
+	}
+
+	if (!sim->fast && timercmp(&now, &sim->next, <)) {
+		n = (sim->next.tv_sec - now.tv_sec) * 1000000 +
+		    (sim->next.tv_usec - now.tv_usec);
+		timeout.tv_sec = n / 1000000;
+		timeout.tv_usec = n % 1000000;
+	}
+	evloop_set_timeout(&sim->ev, sim->fd_data, &timeout);
+}
+
+static void sim_data_event(struct sim *sim, int events)
+{
+	char buf[64];
+
+	if (events & EVLOOP_TIMEOUT) {
+		if (sim->started)
+			sim_send(sim);
+		else
+			evloop_set_timeout(&sim->ev, sim->fd_data, NULL);
+		return;
+	}
+
+	/* Nothing is expected from the client, except hanging up */
+	if (recv(sim->fd_data, buf, sizeof(buf), 0) <= 0) {
+		verb("data connection closed\n");
+		sim_close(sim, &sim->fd_data);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim sim;
+	struct evloop_event events[EVLOOP_MAX_FDS];
+	int optind, i, n;
+	char *optarg, *endp;
+	char c;
+	unsigned long *arg;
+	FILE *help = stderr;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.address = "127.0.0.1";
+	sim.fd_cmd = sim.fd_data = -1;
+
+	opt_init(&optind);
+	while ((c = opt_parse(argc, argv, &optind, &optarg, opt)) != 0) {
+		arg = NULL;
+		switch (c) {
+		case 'a':
+			sim.address = optarg;
+			break;
+		case 'f':
+			sim.fast++;
+			break;
+		case 'p':
+			sim.pressure++;
+			break;
+		case 'b':
+			sim.bad_stop++;
+			break;
+		case 's':
+			arg = &sim.skip_every;
+			break;
+		case 'o':
+			arg = &sim.comm_every;
+			break;
+		case 'C':
+			arg = &sim.control_every;
+			break;
+		case 'c':
+			arg = &sim.max_packets;
+			break;
+		case 'v':
+			verb_count++;
+			break;
+		case 'h':
+			help = stdout;
+		default:
+ printhelp:
+			fprintf(help, "Usage: %s [options]\n", *argv);
+			opt_help(opt, help);
+			fprintf(help, "Simulate a UE9 for ethstream -L.\n");
+			return (help == stdout) ? 0 : 1;
+		}
+		if (arg) {
+			*arg = strtoul(optarg, &endp, 0);
+			if (*endp || *arg == 0) {
+				info("bad number: %s\n", optarg);
+				goto printhelp;
+			}
+		}
+	}
+
+	/* 12-bit samples, left-justified like the UE9's */
+	for (i = 0; i < SIM_WAVE; i++)
+		sim.wave[i] = (uint16_t)(32768 + 30000 *
+					 sin(2 * M_PI * i / SIM_WAVE)) & 0xfff0;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (evloop_init(&sim.ev) < 0)
+		return 1;
+	sim.fd_cmd_listen = sim_listen(&sim, UE9_COMMAND_PORT);
+	sim.fd_data_listen = sim_listen(&sim, UE9_DATA_PORT);
+	if (sim.fd_cmd_listen < 0 || sim.fd_data_listen < 0)
+		return 1;
+	evloop_add(&sim.ev, sim.fd_cmd_listen, EVLOOP_READ);
+	evloop_add(&sim.ev, sim.fd_data_listen, EVLOOP_READ);
+	info("UE9 simulator listening on %s\n", sim.address);
+
+	for (;;) {
+		n = evloop_wait(&sim.ev, events, EVLOOP_MAX_FDS);
+		if (n < 0) {
+			info("wait failed: %s\n", strerror(errno));
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			int fd = events[i].fd;
+
+			if (fd == sim.fd_cmd_listen) {
+				sim_accept(&sim, fd, &sim.fd_cmd);
+				sim.cmdlen = 0;
+			} else if (fd == sim.fd_data_listen) {
+				sim_accept(&sim, fd, &sim.fd_data);
+				sim_schedule(&sim);
+			} else if (fd == sim.fd_cmd) {
+				sim_command_read(&sim);
+			} else if (fd == sim.fd_data) {
+				sim_data_event(&sim, events[i].events);
+			}
+		}
+	}
+}
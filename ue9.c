@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <math.h>
 
 #include "netutil.h"
@@ -25,28 +26,48 @@
 #include "util.h"
 #include "netutil.h"
 #include "ethstream.h"
+#include "ring.h"
+#include "prof.h"
+#include "metrics.h"
+#include "simd.h"
 
-/* Fill checksums in data buffers, with "normal" checksum format */
-void ue9_checksum_normal(uint8_t * buffer, size_t len)
+/* Sum of bytes 1 through len-1, folded to 8 bits */
+static uint8_t normal_sum(const uint8_t * buffer, size_t len)
+{
+	uint16_t sum = 0;
+
+	while (--len >= 1)
+		sum += (uint16_t) buffer[len];
+	sum = (sum / 256) + (sum % 256);
+	sum = (sum / 256) + (sum % 256);
+	return (uint8_t) sum;
+}
+
+/* Sum of bytes 6 through len-1 */
+static uint16_t extended_sum(const uint8_t * buffer, size_t len)
 {
 	uint16_t sum = 0;
 
+	while (--len >= 6)
+		sum += (uint16_t) buffer[len];
+	return sum;
+}
+
+/* Fill checksums in data buffers, with "normal" checksum format */
+void ue9_checksum_normal(uint8_t * buffer, size_t len)
+{
 	if (len < 1) {
 		fprintf(stderr, "ue9_checksum_normal: len too short\n");
 		exit(1);
 	}
 
-	while (--len >= 1)
-		sum += (uint16_t) buffer[len];
-	sum = (sum / 256) + (sum % 256);
-	sum = (sum / 256) + (sum % 256);
-	buffer[0] = (uint8_t) sum;
+	buffer[0] = normal_sum(buffer, len);
 }
 
 /* Fill checksums in data buffers, with "extended" checksum format */
 void ue9_checksum_extended(uint8_t * buffer, size_t len)
 {
-	uint16_t sum = 0;
+	uint16_t sum;
 
 	if (len < 6) {
 		fprintf(stderr, "ue9_checksum_extended: len too short\n");
@@ -54,8 +75,7 @@ void ue9_checksum_extended(uint8_t * buffer, size_t len)
 	}
 
 	/* 16-bit extended checksum */
-	while (--len >= 6)
-		sum += (uint16_t) buffer[len];
+	sum = extended_sum(buffer, len);
 	buffer[4] = (uint8_t) (sum & 0xff);
 	buffer[5] = (uint8_t) (sum >> 8);
 
@@ -64,22 +84,18 @@ void ue9_checksum_extended(uint8_t * buffer, size_t len)
 }
 
 /* Verify checksums in data buffers, with "normal" checksum format. */
-int ue9_verify_normal(uint8_t * buffer, size_t len)
+int ue9_verify_normal(const uint8_t * buffer, size_t len)
 {
-	uint8_t saved, new;
+	uint8_t new;
 
 	if (len < 1) {
 		fprintf(stderr, "ue9_verify_normal: len too short\n");
 		exit(1);
 	}
 
-	saved = buffer[0];
-	ue9_checksum_normal(buffer, len);
-	new = buffer[0];
-	buffer[0] = saved;
-
-	if (new != saved) {
-		verb("got %02x, expected %02x\n", saved, new);
+	new = normal_sum(buffer, len);
+	if (new != buffer[0]) {
+		verb("got %02x, expected %02x\n", buffer[0], new);
 		return 0;
 	}
 
@@ -87,29 +103,26 @@ int ue9_verify_normal(uint8_t * buffer, size_t len)
 }
 
 /* Verify checksums in data buffers, with "extended" checksum format. */
-int ue9_verify_extended(uint8_t * buffer, size_t len)
+int ue9_verify_extended(const uint8_t * buffer, size_t len)
 {
-	uint8_t saved[3], new[3];
+	uint8_t new[6];
+	uint16_t sum;
 
 	if (len < 6) {
 		fprintf(stderr, "ue9_verify_extended: len too short\n");
 		exit(1);
 	}
 
-	saved[0] = buffer[0];
-	saved[1] = buffer[4];
-	saved[2] = buffer[5];
-	ue9_checksum_extended(buffer, len);
-	new[0] = buffer[0];
-	new[1] = buffer[4];
-	new[2] = buffer[5];
-	buffer[0] = saved[0];
-	buffer[4] = saved[1];
-	buffer[5] = saved[2];
+	/* The normal checksum covers the expected extended one */
+	sum = extended_sum(buffer, len);
+	memcpy(new, buffer, 6);
+	new[4] = (uint8_t) (sum & 0xff);
+	new[5] = (uint8_t) (sum >> 8);
+	new[0] = normal_sum(new, 6);
 
-	if (saved[0] != new[0] || saved[1] != new[1] || saved[2] != new[2]) {
+	if (buffer[0] != new[0] || buffer[4] != new[4] || buffer[5] != new[5]) {
 		verb("got %02x %02x %02x, expected %02x %02x %02x\n",
-		     saved[0], saved[1], saved[2], new[0], new[1], new[2]);
+		     buffer[0], buffer[4], buffer[5], new[0], new[4], new[5]);
 		return 0;
 	}
 
@@ -130,55 +143,68 @@ double ue9_binary_to_temperature(struct ue9Calibration *calib, uint16_t data)
 	return data * slope; /* output is in Kelvin */
 }
 
-/* Data conversion.  If calib is NULL, use uncalibrated conversions. */
-double
-ue9_binary_to_analog(struct ue9Calibration *calib,
-		     int gain, uint8_t resolution, uint16_t data)
+/* Pick the calibration slope and offset for the given gain and
+   resolution.  Returns -1 if there is none. */
+static int ue9_calibration_select(struct ue9Calibration *calib, int gain,
+				  uint8_t resolution, double *slope,
+				  double *offset)
 {
-	double slope = 0, offset;
-
-	if (calib == NULL) {
-		double uncal[9] = { 5.08, 2.54, 1.27, 0.63, 0, 0, 0, 0, 10.25 };
-		if (gain >= ARRAY_SIZE(uncal) || uncal[gain] == 0) {
-			fprintf(stderr, "ue9_binary_to_analog: bad gain\n");
-			exit(1);
-		}
-		return data * uncal[gain] / 65536.0;
-	}
+	*slope = 0;
+	*offset = 0;
 
 	if (resolution < 18) {
 		switch (gain) {
 			case 1:
-				slope = calib->unipolarSlope[0];
-				offset = calib->unipolarOffset[0];
+				*slope = calib->unipolarSlope[0];
+				*offset = calib->unipolarOffset[0];
 				break;
 			case 2:
-				slope = calib->unipolarSlope[1];
-				offset = calib->unipolarOffset[1];
+				*slope = calib->unipolarSlope[1];
+				*offset = calib->unipolarOffset[1];
 				break;
 			case 4:
-				slope = calib->unipolarSlope[2];
-				offset = calib->unipolarOffset[2];
+				*slope = calib->unipolarSlope[2];
+				*offset = calib->unipolarOffset[2];
 				break;
 			case 8:
-				slope = calib->unipolarSlope[3];
-				offset = calib->unipolarOffset[3];
+				*slope = calib->unipolarSlope[3];
+				*offset = calib->unipolarOffset[3];
 				break;
 			default:
-				slope = calib->bipolarSlope;
-				offset = calib->bipolarOffset;
+				*slope = calib->bipolarSlope;
+				*offset = calib->bipolarOffset;
 				}
 	} else {
 		if (gain == 0) {
-			slope = calib->hiResUnipolarSlope;
-			offset = calib->hiResUnipolarOffset;
+			*slope = calib->hiResUnipolarSlope;
+			*offset = calib->hiResUnipolarOffset;
 		} else if (gain == 8) {
-			slope = calib->hiResBipolarSlope;
-			offset = calib->hiResBipolarOffset;
+			*slope = calib->hiResBipolarSlope;
+			*offset = calib->hiResBipolarOffset;
 		}
 	}
 
-	if (slope == 0) {
+	return (*slope == 0) ? -1 : 0;
+}
+
+/* Data conversion.  If calib is NULL, use uncalibrated conversions. */
+double
+ue9_binary_to_analog(struct ue9Calibration *calib,
+		     int gain, uint8_t resolution, uint16_t data)
+{
+	double slope, offset;
+
+	if (calib == NULL) {
+		double uncal[9] = { 5.08, 2.54, 1.27, 0.63, 0, 0, 0, 0, 10.25 };
+		if (gain >= ARRAY_SIZE(uncal) || uncal[gain] == 0) {
+			fprintf(stderr, "ue9_binary_to_analog: bad gain\n");
+			exit(1);
+		}
+		return data * uncal[gain] / 65536.0;
+	}
+
+	if (ue9_calibration_select(calib, gain, resolution,
+				   &slope, &offset) < 0) {
 		fprintf(stderr, "ue9_binary_to_analog: bad gain\n");
 		exit(1);
 	}
@@ -186,22 +212,70 @@ ue9_binary_to_analog(struct ue9Calibration *calib,
 	return data * slope + offset;
 }
 
+/* Build per-channel conversions for a scan, so that the calibration
+   lookup is done once instead of for every sample.  Returns -1 on
+   error. */
+int
+ue9_conversion_setup(struct ue9Calibration *calib, int channels,
+		     int *channel_list, int gain_count, int *gain_list,
+		     uint8_t resolution, struct ue9Conversion *conv)
+{
+	int i;
+
+	for (i = 0; i < channels; i++) {
+		if (channel_list[i] <= UE9_MAX_ANALOG_CHANNEL) {
+			conv[i].type = UE9_CONVERSION_ANALOG;
+			if (ue9_calibration_select
+			    (calib, (i < gain_count) ? gain_list[i] : 0,
+			     resolution, &conv[i].slope, &conv[i].offset) < 0) {
+				verb("bad gain for channel %d\n",
+				     channel_list[i]);
+				return -1;
+			}
+		} else if (channel_list[i] == 141 || channel_list[i] == 133) {
+			conv[i].type = UE9_CONVERSION_TEMPERATURE;
+			conv[i].slope = calib->tempSlope;
+			conv[i].offset = 0;
+		} else {
+			/* Digital and timer channels stay as integers */
+			conv[i].type = UE9_CONVERSION_NONE;
+			conv[i].slope = 1;
+			conv[i].offset = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Apply per-channel conversions to one scan */
+void
+ue9_convert_scan(struct ue9Conversion *conv, int channels,
+		 const uint16_t * data, double *out)
+{
+	int i;
+
+	for (i = 0; i < channels; i++)
+		out[i] = data[i] * conv[i].slope + conv[i].offset;
+}
+
 /* Execute a command on the UE9.  Returns -1 on error.  Fills the
    checksums on the outgoing packets, and verifies them on the
    incoming packets.  Data in "out" is transmitted, data in "in" is
    received. */
-int ue9_command(int fd, uint8_t * out, uint8_t * in, int inlen)
+static int command_send(int fd, uint8_t * out, uint8_t * saved_1,
+			uint8_t * saved_3)
 {
-	int extended = 0, outlen;
-	uint8_t saved_1, saved_3;
+	int outlen;
 	ssize_t ret;
 
-	if ((out[1] & 0x78) == 0x78)
-		extended = 1;
-
-	/* Figure out length of data payload, and fill checksums. */
-	if (extended) {
+	/* Figure out length of data payload, and fill checksums.  Save
+	   the bytes the reply is checked against, in case the caller
+	   passes the same buffer for it. */
+	*saved_1 = out[1];
+	*saved_3 = 0;
+	if ((out[1] & 0x78) == 0x78) {
 		outlen = 6 + (out[2]) * 2;
+		*saved_3 = out[3];
 		ue9_checksum_extended(out, outlen);
 	} else {
 		outlen = 2 + (out[1] & 7) * 2;
@@ -216,11 +290,17 @@ int ue9_command(int fd, uint8_t * out, uint8_t * in, int inlen)
 		return -1;
 	}
 
-	/* Save a few bytes that we'll want to compare against later,
-	   in case the caller passed the same buffer twice. */
-	saved_1 = out[1];
-	if (extended)
-		saved_3 = out[3];
+	return 0;
+}
+
+static int command_recv(int fd, uint8_t saved_1, uint8_t saved_3,
+			uint8_t * in, int inlen)
+{
+	int extended = 0;
+	ssize_t ret;
+
+	if ((saved_1 & 0x78) == 0x78)
+		extended = 1;
 
 	/* Receive result */
 	ret = recv_all_timeout(fd, in, inlen, 0, &(struct timeval) {
@@ -249,6 +329,80 @@ int ue9_command(int fd, uint8_t * out, uint8_t * in, int inlen)
 	return -1;
 }
 
+int ue9_command(int fd, uint8_t * out, uint8_t * in, int inlen)
+{
+	uint8_t saved_1, saved_3;
+
+	if (command_send(fd, out, &saved_1, &saved_3) < 0)
+		return -1;
+	return command_recv(fd, saved_1, saved_3, in, inlen);
+}
+
+/* Read and throw away replies that are still on their way, until the
+   command connection has been quiet for UE9_DRAIN_MS */
+static void command_drain(int fd)
+{
+	uint8_t buf[512];
+	ssize_t len;
+
+	while ((len = recv_timeout(fd, buf, sizeof(buf), 0,
+				   &(struct timeval) {
+				   .tv_usec = UE9_DRAIN_MS * 1000})) > 0)
+		debug("discarded %d bytes of old replies\n", (int)len);
+}
+
+/* Execute several commands, sending all of them before reading any
+   reply.  The device handles them in order, so this costs one round
+   trip instead of "count".  Returns the number of commands that
+   completed, which is "count" on success.  If "done" is not NULL, it
+   gets the time each reply arrived.
+
+   On failure, the replies to the commands after the failed one are
+   still in flight.  They are drained, so that the next command on fd
+   doesn't read one of them as its own reply. */
+int ue9_command_batch(int fd, int count, uint8_t ** out, uint8_t ** in,
+		      int *inlen, struct timeval *done)
+{
+	uint8_t saved_1, saved_3;
+	int i;
+
+	/* Replies go to separate buffers, so out[] still holds what
+	   they are checked against */
+	for (i = 0; i < count; i++) {
+		if (command_send(fd, out[i], &saved_1, &saved_3) < 0) {
+			if (i > 0)
+				command_drain(fd);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		uint8_t saved_3 = 0;
+
+		if ((out[i][1] & 0x78) == 0x78)
+			saved_3 = out[i][3];
+		if (command_recv(fd, out[i][1], saved_3, in[i],
+				 inlen[i]) < 0) {
+			command_drain(fd);
+			return i;
+		}
+		if (done)
+			gettimeofday(&done[i], NULL);
+	}
+
+	return count;
+}
+
+/* Fill in a ReadMem request for a memory block */
+static void memory_read_build(uint8_t * sendbuf, int blocknum)
+{
+	sendbuf[1] = 0xf8;
+	sendbuf[2] = 0x01;
+	sendbuf[3] = 0x2a;
+	sendbuf[6] = 0x00;
+	sendbuf[7] = blocknum;
+}
+
 /* Read a memory block from the device.  Returns -1 on error. */
 int ue9_memory_read(int fd, int blocknum, uint8_t * buffer, int len)
 {
@@ -260,11 +414,7 @@ int ue9_memory_read(int fd, int blocknum, uint8_t * buffer, int len)
 	}
 
 	/* Request memory block */
-	sendbuf[1] = 0xf8;
-	sendbuf[2] = 0x01;
-	sendbuf[3] = 0x2a;
-	sendbuf[6] = 0x00;
-	sendbuf[7] = blocknum;
+	memory_read_build(sendbuf, blocknum);
 
 	if (ue9_command(fd, sendbuf, recvbuf, sizeof(recvbuf)) < 0) {
 		verb("command failed\n");
@@ -289,14 +439,17 @@ double ue9_fp64_to_double(uint8_t * data)
 	return (double)a + (double)b / (double)4294967296.0L;
 }
 
-/* Retrieve calibration data from the device.  Returns -1 on error. */
-int ue9_get_calibration(int fd, struct ue9Calibration *calib)
+/* Calibration lives in the first few memory blocks */
+#define CAL_BLOCKS 5
+
+/* Fill in calibration from ReadMem replies for blocks 0 through 4 */
+static void calibration_parse(uint8_t blocks[CAL_BLOCKS][136],
+			      struct ue9Calibration *calib)
 {
-	uint8_t buf[128];
+	uint8_t *buf;
 
 	/* Block 0 */
-	if (ue9_memory_read(fd, 0, buf, 128) < 0)
-		return -1;
+	buf = blocks[0] + 8;
 	calib->unipolarSlope[0] = ue9_fp64_to_double(buf + 0);
 	calib->unipolarOffset[0] = ue9_fp64_to_double(buf + 8);
 	calib->unipolarSlope[1] = ue9_fp64_to_double(buf + 16);
@@ -307,14 +460,12 @@ int ue9_get_calibration(int fd, struct ue9Calibration *calib)
 	calib->unipolarOffset[3] = ue9_fp64_to_double(buf + 56);
 
 	/* Block 1 */
-	if (ue9_memory_read(fd, 1, buf, 128) < 0)
-		return -1;
+	buf = blocks[1] + 8;
 	calib->bipolarSlope = ue9_fp64_to_double(buf + 0);
 	calib->bipolarOffset = ue9_fp64_to_double(buf + 8);
 
 	/* Block 2 */
-	if (ue9_memory_read(fd, 2, buf, 128) < 0)
-		return -1;
+	buf = blocks[2] + 8;
 	calib->DACSlope[0] = ue9_fp64_to_double(buf + 0);
 	calib->DACOffset[0] = ue9_fp64_to_double(buf + 8);
 	calib->DACSlope[1] = ue9_fp64_to_double(buf + 16);
@@ -327,39 +478,93 @@ int ue9_get_calibration(int fd, struct ue9Calibration *calib)
 	calib->VsSlope = ue9_fp64_to_double(buf + 96);
 
 	/* Block 3 */
-	if (ue9_memory_read(fd, 3, buf, 128) < 0)
-		return -1;
+	buf = blocks[3] + 8;
 	calib->hiResUnipolarSlope = ue9_fp64_to_double(buf + 0);
 	calib->hiResUnipolarOffset = ue9_fp64_to_double(buf + 8);
 
 	/* Block 4 */
-	if (ue9_memory_read(fd, 4, buf, 128) < 0)
-		return -1;
+	buf = blocks[4] + 8;
 	calib->hiResBipolarSlope = ue9_fp64_to_double(buf + 0);
 	calib->hiResBipolarOffset = ue9_fp64_to_double(buf + 8);
+}
+
+/* Retrieve calibration data from the device.  Returns -1 on error. */
+int ue9_get_calibration(int fd, struct ue9Calibration *calib)
+{
+	uint8_t sendbuf[CAL_BLOCKS][8], recvbuf[CAL_BLOCKS][136];
+	uint8_t *out[CAL_BLOCKS], *in[CAL_BLOCKS];
+	int inlen[CAL_BLOCKS];
+	int i;
+
+	/* The blocks don't depend on each other; read them all at once */
+	for (i = 0; i < CAL_BLOCKS; i++) {
+		memory_read_build(sendbuf[i], i);
+		out[i] = sendbuf[i];
+		in[i] = recvbuf[i];
+		inlen[i] = sizeof(recvbuf[i]);
+	}
+	if (ue9_command_batch(fd, CAL_BLOCKS, out, in, inlen, NULL) <
+	    CAL_BLOCKS) {
+		verb("command failed\n");
+		return -1;
+	}
+
+	calibration_parse(recvbuf, calib);
 
 	/* All done */
 	return 1;
 }
 
+/* Fill in a CommConfig request that only reads */
+static void comm_config_build(uint8_t * sendbuf)
+{
+	memset(sendbuf, 0, 38);
+	sendbuf[1] = 0xf8;
+	sendbuf[2] = 0x10;
+	sendbuf[3] = 0x01;
+}
+
+/* Fill in comm config from a CommConfig reply */
+static void comm_config_parse(uint8_t * b, struct ue9CommConfig *config)
+{
+	memset(config, 0, sizeof(struct ue9CommConfig));
+
+	/* Addresses are little-endian on the wire */
+	config->local_id = b[8];
+	config->power_level = b[9];
+	config->address = htonl(b[10] | (b[11] << 8) | (b[12] << 16) |
+				((uint32_t) b[13] << 24));
+	config->gateway = htonl(b[14] | (b[15] << 8) | (b[16] << 16) |
+				((uint32_t) b[17] << 24));
+	config->subnet = htonl(b[18] | (b[19] << 8) | (b[20] << 16) |
+			       ((uint32_t) b[21] << 24));
+	config->portA = b[22] | (b[23] << 8);
+	config->portB = b[24] | (b[25] << 8);
+	config->dhcp_enabled = b[26];
+	config->product_id = b[27];
+	memcpy(config->mac_address, b + 28, 6);
+	config->hw_version = b[35] + b[34] / 100.0;
+	config->comm_fw_version = b[37] + b[36] / 100.0;
+}
+
 /* Retrieve comm config, returns -1 on error */
 int ue9_get_comm_config(int fd, struct ue9CommConfig *config)
 {
-	uint8_t sendbuf[18];
-	uint8_t recvbuf[24];
+	uint8_t sendbuf[38];
+	uint8_t recvbuf[38];
 
-	memset(sendbuf, 0, sizeof(sendbuf));
 	memset(config, 0, sizeof(struct ue9CommConfig));
 
-	sendbuf[1] = 0xf8;
-	sendbuf[2] = 0x09;
-	sendbuf[3] = 0x08;
+	/* WriteMask is left at 0, so this only reads */
+	comm_config_build(sendbuf);
 	if (ue9_command(fd, sendbuf, recvbuf, sizeof(recvbuf)) < 0) {
 		verb("command failed\n");
 		return -1;
 	}
-	verb("todo\n");
-	return -1;
+
+	comm_config_parse(recvbuf, config);
+
+	return 0;
 }
 
 /* Retrieve control config, returns -1 on error */
@@ -382,8 +587,9 @@ int ue9_get_control_config(int fd, struct ue9ControlConfig *config)
 	return -1;
 }
 
-/* Open TCP/IP connection to the UE9 */
-int ue9_open(const char *host, int port)
+/* Create a socket and start connecting it to the UE9.  Returns -1
+   on error. */
+static int open_start(const char *host, int port)
 {
 	int fd;
 	struct sockaddr_in address;
@@ -426,20 +632,45 @@ int ue9_open(const char *host, int port)
 	debug("Resolved %s -> %s\n", host, inet_ntoa(address.sin_addr));
 
 	/* Connect */
-	if (connect_timeout(fd, (struct sockaddr *)&address, sizeof(address),
-			    &(struct timeval) {
-			    .tv_sec = TIMEOUT}) < 0) {
+	if (connect_start(fd, (struct sockaddr *)&address,
+			  sizeof(address)) < 0) {
 		verb("connection to %s:%d failed: %s\n",
 		     inet_ntoa(address.sin_addr), port, compat_strerror(errno));
 		close(fd);
 		return -1;
 	}
-	
+
+	return fd;
+}
+
+/* Wait for a connection from open_start() to finish.  Closes it and
+   returns -1 on error. */
+static int open_finish(int fd, const char *host, int port)
+{
+	if (connect_finish(fd, &(struct timeval) {
+			   .tv_sec = TIMEOUT}) < 0) {
+		verb("connection to %s:%d failed: %s\n",
+		     host, port, compat_strerror(errno));
+		close(fd);
+		return -1;
+	}
+
 	debug("Connected to port %d\n", port);
 
 	return fd;
 }
 
+/* Open TCP/IP connection to the UE9 */
+int ue9_open(const char *host, int port)
+{
+	int fd;
+
+	fd = open_start(host, port);
+	if (fd < 0)
+		return -1;
+	return open_finish(fd, host, port);
+}
+
 /* Close connection to the UE9 */
 void ue9_close(int fd)
 {
@@ -619,13 +850,34 @@ ue9_streamconfig_simple(int fd, int *channel_list, int channel_count,
 	return 0;
 }
 
-/* Stream configuration, each Analog Input channel can have its own gain. */
-int
-ue9_streamconfig(int fd, int *channel_list, int channel_count,
-			uint8_t scanconfig, uint16_t scaninterval, int *gain_list, int gain_count)
+/* Map -g gains to StreamConfig gain/bipolar settings */
+static uint8_t streamconfig_gain(int *gain_list, int gain_count, int i)
+{
+	if (i >= gain_count)
+		return UE9_BIPOLAR_GAIN1;
+
+	switch (gain_list[i]) {
+	case 1:
+		return UE9_UNIPOLAR_GAIN1;
+	case 2:
+		return UE9_UNIPOLAR_GAIN2;
+	case 4:
+		return UE9_UNIPOLAR_GAIN4;
+	case 8:
+		return UE9_UNIPOLAR_GAIN8;
+	default:
+		return UE9_BIPOLAR_GAIN1;
+	}
+}
+
+/* Fill in a StreamConfig request.  Channels without a gain are
+   bipolar, gain 1. */
+static void streamconfig_build(uint8_t * buf, int *channel_list,
+			       int channel_count, uint8_t scanconfig,
+			       uint16_t scaninterval, int *gain_list,
+			       int gain_count)
 {
 	int i;
-	uint8_t buf[256];
 
 	/* Set up StreamConfig command with channels and scan options */
 	buf[1] = 0xF8;		/* Extended command */
@@ -640,37 +892,19 @@ ue9_streamconfig(int fd, int *channel_list, int channel_count,
 
 	for (i = 0; i < channel_count; i++) {
 		buf[12 + 2 * i] = channel_list[i];	/* Channel number */
-		if (i < gain_count) {
-			switch (gain_list[i]) {
-				case 0:
-					buf[13 + 2 * i] = UE9_BIPOLAR_GAIN1;
-				break;
-					
-				case 1:
-					buf[13 + 2 * i] = UE9_UNIPOLAR_GAIN1;
-				break;
-			
-				case 2:
-					buf[13 + 2 * i] = UE9_UNIPOLAR_GAIN2;
-				break;
-				
-				case 4:
-					buf[13 + 2 * i] = UE9_UNIPOLAR_GAIN4;
-				break;
-			
-				case 8:
-					buf[13 + 2 * i] = UE9_UNIPOLAR_GAIN8;
-				break;
-				
-				default:
-					buf[13 + 2 * i] = UE9_BIPOLAR_GAIN1;
-			}
-		}
-		else
-		{
-			buf[13 + 2 * i] = UE9_BIPOLAR_GAIN1;
-		}
+		buf[13 + 2 * i] = streamconfig_gain(gain_list, gain_count, i);
 	}
+}
+
+/* Stream configuration, each Analog Input channel can have its own gain. */
+int
+ue9_streamconfig(int fd, int *channel_list, int channel_count,
+			uint8_t scanconfig, uint16_t scaninterval, int *gain_list, int gain_count)
+{
+	uint8_t buf[256];
+
+	streamconfig_build(buf, channel_list, channel_count, scanconfig,
+			   scaninterval, gain_list, gain_count);
 
 	/* Send StreamConfig */
 	if (ue9_command(fd, buf, buf, 8) < 0) {
@@ -686,12 +920,11 @@ ue9_streamconfig(int fd, int *channel_list, int channel_count,
 	return 0;
 }
 
-
-/* Timer configuration */
-int ue9_timer_config(int fd, int *mode_list, int *value_list, int count, int divisor)
+/* Fill in a TimerConfig request.  Returns -1 if count is invalid. */
+static int timer_config_build(uint8_t * buf, int *mode_list, int *value_list,
+			      int count, int divisor)
 {
 	int i;
-	uint8_t buf[256];
 
 	if (count < 0 || count > 6) {
 		verb("invalid count\n");
@@ -723,6 +956,17 @@ int ue9_timer_config(int fd, int *mode_list, int *value_list, int count, int div
 	buf[28] = 0;
 	buf[29] = 0;
 
+	return 0;
+}
+
+/* Timer configuration */
+int ue9_timer_config(int fd, int *mode_list, int *value_list, int count, int divisor)
+{
+	uint8_t buf[256];
+
+	if (timer_config_build(buf, mode_list, value_list, count, divisor) < 0)
+		return -1;
+
 	/* Send StreamConfig */
 	if (ue9_command(fd, buf, buf, 40) < 0) {
 		debug("command failed\n");
@@ -739,84 +983,427 @@ int ue9_timer_config(int fd, int *mode_list, int *value_list, int count, int div
 	return 0;
 }
 
-/* Stream data and pass it to the data callback.  If callback returns
-   negative, stops reading and returns 0.  Returns < 0 on error. */
+/* Discard anything already waiting on a data connection */
+static void data_discard(int fd)
+{
+	uint8_t buf[512];
+	ssize_t len;
+
+	while ((len = recv(fd, (void *)buf, sizeof(buf), 0)) > 0)
+		debug("discarded %d bytes of old stream data\n", (int)len);
+}
+
 int
-ue9_stream_data(int fd, int channels, int *channel_list, int gain_count, int *gain_list, ue9_stream_cb_t callback, void *context)
+ue9_setup_connect(struct ue9_setup *su, const char *host, int cmd_port,
+		  int data_port, int *fd_cmd, int *fd_data)
 {
-	int ret;
-	uint8_t buf[46];
-	uint8_t packet = 0;
-	int channel = 0;
-	int i;
-	uint16_t data[channels];
+	gettimeofday(&su->begin, NULL);
 
-	for (;;) {
-		/* Receive data */
-		ret = recv_all_timeout(fd, buf, 46, 0, &(struct timeval) {
-				       .tv_sec = TIMEOUT});
+	/* Both handshakes are in flight before we wait for either */
+	*fd_cmd = open_start(host, cmd_port);
+	*fd_data = (*fd_cmd < 0) ? -1 : open_start(host, data_port);
 
-		/* Verify packet format */
-		if (ret != 46) {
-			verb("short recv %d\n", (int)ret);
+	if (*fd_cmd >= 0)
+		*fd_cmd = open_finish(*fd_cmd, host, cmd_port);
+	if (*fd_data >= 0)
+		*fd_data = open_finish(*fd_data, host, data_port);
+
+	gettimeofday(&su->connect, NULL);
+
+	if (*fd_cmd < 0 || *fd_data < 0)
+		return -1;
+	return 0;
+}
+
+int ue9_setup_prepare(struct ue9_setup *su, int fd_cmd, int fd_data)
+{
+	uint8_t stopsend[2], stoprecv[4];
+	uint8_t flushsend[2], flushrecv[2];
+	uint8_t commsend[38], commrecv[38];
+	uint8_t *out[3] = { stopsend, flushsend, commsend };
+	uint8_t *in[3] = { stoprecv, flushrecv, commrecv };
+	int inlen[3] = { sizeof(stoprecv), sizeof(flushrecv),
+		sizeof(commrecv) };
+	int done, i;
+
+	stopsend[1] = 0xB0;	/* StreamStop */
+	flushsend[1] = 0x08;	/* FlushBuffer */
+	comm_config_build(commsend);
+
+	done = ue9_command_batch(fd_cmd, 3, out, in, inlen, NULL);
+	if (done > 0 && stoprecv[2] == 0)
+		verb("Stopped previous stream.\n");
+
+	/* StreamStop fails when there is no stream to stop, and that's
+	   fine, as is a failed FlushBuffer.  The commands after the one
+	   that failed go again one at a time; only the CommConfig reply
+	   is needed. */
+	if (done < 3) {
+		if (done < 2)
+			verb("StreamStop or FlushBuffer failed, ignoring\n");
+		for (i = done + 1; i < 2; i++)
+			ue9_command(fd_cmd, out[i], in[i], inlen[i]);
+		if (done == 2 || ue9_command(fd_cmd, commsend, commrecv,
+					      sizeof(commrecv)) < 0) {
+			verb("command failed\n");
 			return -1;
 		}
+	}
+	comm_config_parse(commrecv, &su->comm);
 
-		if (!ue9_verify_extended(buf, 46) || !ue9_verify_normal(buf, 6)) {
-			verb("bad checksum\n");
-			return -2;
-		}
+	/* The data connection was opened before the stop, so it may
+	   have picked up the tail of an old stream */
+	data_discard(fd_data);
 
-		if (buf[1] != 0xF9 || buf[2] != 0x14 || buf[3] != 0xC0) {
-			verb("bad command bytes\n");
-			return -3;
-		}
+	gettimeofday(&su->prepare, NULL);
+	return 0;
+}
 
-		if (buf[11] != 0) {
-			verb("stream error: %s\n", ue9_error(buf[11]));
-			return -4;
+int ue9_setup_start(struct ue9_setup *su, int fd_cmd,
+		    struct ue9Calibration *calib)
+{
+	uint8_t calsend[CAL_BLOCKS][8], calrecv[CAL_BLOCKS][136];
+	uint8_t timersend[40], timerrecv[40];
+	uint8_t configsend[256], configrecv[8];
+	uint8_t startsend[2], startrecv[4];
+	uint8_t *out[CAL_BLOCKS + 3], *in[CAL_BLOCKS + 3];
+	int inlen[CAL_BLOCKS + 3];
+	struct timeval done[CAL_BLOCKS + 3];
+	int i, n = 0, timer = -1, config, start;
+
+	/* Calibration, unless the caller already has it */
+	gettimeofday(&su->calib, NULL);
+	if (calib) {
+		for (i = 0; i < CAL_BLOCKS; i++, n++) {
+			memory_read_build(calsend[i], i);
+			out[n] = calsend[i];
+			in[n] = calrecv[i];
+			inlen[n] = sizeof(calrecv[i]);
 		}
+	}
 
-		/* Check for dropped packets. */
-		if (buf[10] != packet) {
-			verb("expected packet %d, but received packet %d\n",
-			     packet, buf[10]);
-			return -5;
-		}
-		packet++;
+	if (su->timer_mode_count) {
+		if (timer_config_build(timersend, su->timer_mode_list,
+				       su->timer_value_list,
+				       su->timer_mode_count,
+				       su->timer_divisor) < 0)
+			return -1;
+		timer = n++;
+		out[timer] = timersend;
+		in[timer] = timerrecv;
+		inlen[timer] = sizeof(timerrecv);
+	}
+
+	streamconfig_build(configsend, su->channel_list, su->channel_count,
+			   su->scanconfig, su->scaninterval, su->gain_list,
+			   su->gain_count);
+	config = n++;
+	out[config] = configsend;
+	in[config] = configrecv;
+	inlen[config] = sizeof(configrecv);
+
+	startsend[1] = 0xA8;	/* StreamStart */
+	start = n++;
+	out[start] = startsend;
+	in[start] = startrecv;
+	inlen[start] = sizeof(startrecv);
+
+	if (ue9_command_batch(fd_cmd, n, out, in, inlen, done) < n) {
+		verb("command failed\n");
+		return -1;
+	}
 
-		/* Check comm processor backlog (up to 512 kB) */
-		if (buf[45] & 0x80) {
-			verb("buffer overflow in CommBacklog, aborting\n");
-			return -6;
+	if (calib) {
+		calibration_parse(calrecv, calib);
+		su->calib = done[CAL_BLOCKS - 1];
+	}
+
+	if (timer >= 0) {
+		if (timerrecv[6] != 0) {
+			verb("timer config returned error %s\n",
+			     ue9_error(timerrecv[6]));
+			return -1;
 		}
-		if ((buf[45] & 0x7f) > 112)
-			debug("warning: CommBacklog is high (%d bytes)\n",
-			      (buf[45] & 0x7f) * 4096);
-
-		/* Check control processor backlog (up to 256 bytes). */
-		if (buf[44] == 255) {
-			verb("ControlBacklog is maxed out, aborting\n");
-			return -7;
+		debug("timer EnableStatus=0x%02x\n", timerrecv[7]);
+	}
+
+	if (configrecv[6] != 0) {
+		verb("stream config returned error %s\n",
+		     ue9_error(configrecv[6]));
+		return -1;
+	}
+	su->config = done[config];
+
+	if (startrecv[2] != 0) {
+		verb("stream start returned error %s\n",
+		     ue9_error(startrecv[2]));
+		return -1;
+	}
+	su->start = done[start];
+
+	return 0;
+}
+
+static double ms_between(struct timeval *a, struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000.0 +
+	    (b->tv_usec - a->tv_usec) / 1000.0;
+}
+
+void ue9_setup_report(struct ue9_setup *su, struct timeval *first)
+{
+	verb("setup took %.1f ms: connect %.1f, prepare %.1f, calib %.1f, "
+	     "config %.1f, start %.1f, first packet %.1f\n",
+	     ms_between(&su->begin, first),
+	     ms_between(&su->begin, &su->connect),
+	     ms_between(&su->connect, &su->prepare),
+	     ms_between(&su->prepare, &su->calib),
+	     ms_between(&su->calib, &su->config),
+	     ms_between(&su->config, &su->start),
+	     ms_between(&su->start, first));
+}
+
+/* State of a stream between ue9_stream_next() calls */
+struct ue9_stream {
+	struct receiver rx;
+	struct metrics *metrics;
+	uint8_t packet;		/* next expected packet counter */
+	int verified;		/* packets already checked ahead */
+	int error;		/* ended the stream */
+	int fill;		/* samples in data */
+	unsigned long seq;	/* packets so far */
+	unsigned long scan_packet;	/* where the next scan starts */
+	struct ue9_scan_block block;
+	uint16_t data[UE9_BATCH_SAMPLES];
+};
+
+struct ue9_stream *ue9_stream_begin(int fd, struct capture *capture,
+				    struct metrics *metrics,
+				    struct output *out, double rate,
+				    int channels, int *channel_list,
+				    int gain_count, int *gain_list)
+{
+	struct ue9_stream *st;
+
+	/* Each packet holds 16 samples */
+	double interval = (rate > 0) ? 16.0 / channels / rate : 0;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		return NULL;
+	st->metrics = metrics;
+	st->block = (struct ue9_scan_block) {
+		.channels = channels,
+		.channel_list = channel_list,
+		.gain_count = gain_count,
+		.gain_list = gain_list,
+		.data = st->data,
+	};
+
+	/* Packets are received on their own thread */
+	if (receiver_start(&st->rx, fd, 46, UE9_RING_SLOTS, &(struct timeval) {
+			   .tv_sec = TIMEOUT}, interval, capture) < 0) {
+		verb("can't start receive thread\n");
+		free(st);
+		return NULL;
+	}
+	st->rx.out = out;
+	return st;
+}
+
+/* Check one packet.  Returns < 0 on error. */
+static int ue9_stream_check(struct ue9_stream *st, uint8_t * buf)
+{
+	/* Check the checksums of all packets that are waiting in one
+	   go; the scalar versions say what is wrong */
+	if (st->verified == 0)
+		st->verified = simd_ue9_verify(buf, receiver_ready(&st->rx));
+	if (st->verified == 0) {
+		if (ue9_verify_extended(buf, 46))
+			ue9_verify_normal(buf, 6);
+		verb("bad checksum\n");
+		return -2;
+	}
+	st->verified--;
+
+	if (buf[1] != 0xF9 || buf[2] != 0x14 || buf[3] != 0xC0) {
+		verb("bad command bytes\n");
+		return -3;
+	}
+
+	if (buf[11] != 0) {
+		verb("stream error: %s\n", ue9_error(buf[11]));
+		return -4;
+	}
+
+	/* Check for dropped packets. */
+	if (buf[10] != st->packet) {
+		verb("expected packet %d, but received packet %d\n",
+		     st->packet, buf[10]);
+		return -5;
+	}
+	st->packet++;
+
+	/* Check comm processor backlog (up to 512 kB) */
+	if (buf[45] & 0x80) {
+		verb("buffer overflow in CommBacklog, aborting\n");
+		return -6;
+	}
+	if ((buf[45] & 0x7f) > 112)
+		debug("warning: CommBacklog is high (%d bytes)\n",
+		      (buf[45] & 0x7f) * 4096);
+
+	/* Check control processor backlog (up to 256 bytes). */
+	if (buf[44] == 255) {
+		verb("ControlBacklog is maxed out, aborting\n");
+		return -7;
+	}
+	if (buf[44] > 224)
+		debug("warning: ControlBacklog is high (%d bytes)\n", buf[44]);
+
+	return 0;
+}
+
+int ue9_stream_next(struct ue9_stream *st, struct ue9_scan_block **block)
+{
+	struct ue9_scan_block *b = &st->block;
+	int channels = b->channels;
+	int ret, i, used, complete;
+	uint8_t *buf;
+	uint64_t t;
+
+	/* Keep the partial scan after the last block */
+	used = b->scans * channels;
+	st->fill -= used;
+	memmove(st->data, st->data + used, st->fill * sizeof(*st->data));
+	b->scans = 0;
+	b->first_packet = st->scan_packet;
+
+	while (st->error == 0) {
+		/* Receive data */
+		buf = receiver_next(&st->rx, &ret);
+
+		/* Verify packet format */
+		if (buf == NULL) {
+			verb("short recv %d\n", (int)ret);
+			st->error = -1;
+			break;
 		}
-		if (buf[44] > 224)
-			debug("warning: ControlBacklog is high (%d bytes)\n",
-			      buf[44]);
+
+		t = prof_start();
+		st->error = ue9_stream_check(st, buf);
+		if (st->error < 0)
+			break;
+		prof_end(PROF_VERIFY, t);
+
+		if (st->metrics)
+			metrics_packet(st->metrics, 16,
+				       (buf[45] & 0x7f) * 4096, buf[44]);
 
 		/* Read samples from the buffer */
-		for (i = 12; i <= 42; i += 2) {
-			data[channel++] = buf[i] + (buf[i + 1] << 8);
-			if (channel < channels)
-				continue;
-
-			/* Received a full scan, send to callback */
-			channel = 0;
-			if ((*callback) (channels, channel_list, gain_count, gain_list, data, context) < 0) {
-				/* We're done */
-				return 0;
-			}
+		t = prof_start();
+		for (i = 0; i < 16; i++)
+			st->data[st->fill + i] = buf[12 + 2 * i] +
+			    (buf[13 + 2 * i] << 8);
+		prof_end(PROF_UNPACK, t);
+
+		/* Note where the scans end and the next one starts */
+		complete = (st->fill + 16) - (st->fill + 16) % channels;
+		if (complete > st->fill) {
+			b->last_packet = st->seq;
+			b->comm_backlog = (buf[45] & 0x7f) * 4096;
+			b->control_backlog = buf[44];
+			st->scan_packet = (complete < st->fill + 16) ?
+			    st->seq : st->seq + 1;
 		}
+		st->fill += 16;
+		st->seq++;
+
+		receiver_release(&st->rx);
+
+		/* Return what we have once the ring is drained, or the
+		   block can't take another packet */
+		if ((receiver_ready(&st->rx) == 0 ||
+		     st->fill + 16 > UE9_BATCH_SAMPLES) &&
+		    st->fill >= channels)
+			break;
+	}
+
+	/* Scans from the packets before an error still go out first */
+	b->scans = st->fill / channels;
+	if (b->scans > 0) {
+		*block = b;
+		return 1;
 	}
+	return st->error;
+}
+
+void ue9_stream_end(struct ue9_stream *st)
+{
+	receiver_stop(&st->rx);
+	free(st);
+}
+
+int
+ue9_stream_batch(int fd, struct capture *capture, struct metrics *metrics,
+		 struct output *out, double rate, int channels,
+		 int *channel_list, int gain_count, int *gain_list,
+		 ue9_stream_batch_cb_t callback, void *context)
+{
+	struct ue9_stream *st;
+	struct ue9_scan_block *block;
+	int ret;
+
+	st = ue9_stream_begin(fd, capture, metrics, out, rate, channels,
+			      channel_list, gain_count, gain_list);
+	if (st == NULL)
+		return -1;
+
+	while ((ret = ue9_stream_next(st, &block)) > 0) {
+		if ((*callback) (block, context) < 0) {
+			/* We're done */
+			ret = 0;
+			break;
+		}
+	}
+
+	ue9_stream_end(st);
+	return ret;
+}
+
+/* Per-scan callback, on top of the blocks */
+struct ue9_scan_adapter {
+	ue9_stream_cb_t callback;
+	void *context;
+};
+
+static int ue9_scan_adapter(struct ue9_scan_block *block, void *context)
+{
+	struct ue9_scan_adapter *a = context;
+	int i;
+
+	for (i = 0; i < block->scans; i++) {
+		if ((*a->callback) (block->channels, block->channel_list,
+				    block->gain_count, block->gain_list,
+				    (uint16_t *) block->data +
+				    i * block->channels, a->context) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+ue9_stream_data(int fd, struct capture *capture, struct metrics *metrics,
+		double rate, int channels, int *channel_list, int gain_count, int *gain_list, ue9_stream_cb_t callback, void *context)
+{
+	struct ue9_scan_adapter a = {
+		.callback = callback,
+		.context = context,
+	};
+
+	return ue9_stream_batch(fd, capture, metrics, NULL, rate, channels,
+				channel_list, gain_count, gain_list,
+				ue9_scan_adapter, &a);
 }
 
 /*
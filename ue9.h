@@ -68,6 +68,17 @@ struct ue9ControlConfig {
 	uint16_t dac1;
 };
 
+/* Precomputed conversion for one channel of a scan */
+struct ue9Conversion {
+	double slope;
+	double offset;
+	int type;
+};
+
+#define UE9_CONVERSION_NONE 0
+#define UE9_CONVERSION_ANALOG 1
+#define UE9_CONVERSION_TEMPERATURE 2
+
 /* These are correct! 0, 1, 2, 3, 8 */
 #define UE9_UNIPOLAR_GAIN1 0x00
 #define UE9_UNIPOLAR_GAIN2 0x01
@@ -80,13 +91,24 @@ struct ue9ControlConfig {
 #define UE9_MAX_ANALOG_CHANNEL 13
 #define UE9_TIMERS 6
 
+#define UE9_COMMAND_PORT 52360
+#define UE9_DATA_PORT 52361
+
+/* Stream packets buffered between the receive thread and the callback */
+#define UE9_RING_SLOTS 16384
+
+/* How long the command connection has to be quiet after a failed
+   batch before any replies still in flight are given up on */
+#define UE9_DRAIN_MS 200
+
 /* Fill checksums in data buffers */
 void ue9_checksum_normal(uint8_t * buffer, size_t len);
 void ue9_checksum_extended(uint8_t * buffer, size_t len);
 
-/* Verify checksums in data buffers.  Returns 0 on error. */
-int ue9_verify_normal(uint8_t * buffer, size_t len);
-int ue9_verify_extended(uint8_t * buffer, size_t len);
+/* Verify checksums in data buffers, which are not modified.  Returns
+   0 on error.  simd_ue9_verify() checks many stream packets at once. */
+int ue9_verify_normal(const uint8_t * buffer, size_t len);
+int ue9_verify_extended(const uint8_t * buffer, size_t len);
 
 /* Open/close TCP/IP connection to the UE9 */
 int ue9_open(const char *host, int port);
@@ -110,6 +132,18 @@ double ue9_binary_to_analog(struct ue9Calibration *calib,
 /* Temperature conversion.  If calib is NULL, use uncalibrated conversions. */
 double ue9_binary_to_temperature(struct ue9Calibration *calib, uint16_t data);
 
+/* Build per-channel conversions from calibration data, for gains in
+   -g order.  Returns -1 on error. */
+int ue9_conversion_setup(struct ue9Calibration *calib, int channels,
+			 int *channel_list, int gain_count, int *gain_list,
+			 uint8_t resolution, struct ue9Conversion *conv);
+
+/* Convert a scan with the conversions from ue9_conversion_setup.
+   Gives the same results as ue9_binary_to_analog and
+   ue9_binary_to_temperature. */
+void ue9_convert_scan(struct ue9Conversion *conv, int channels,
+		      const uint16_t * data, double *out);
+
 /* Compute scanrate based on the provided values. */
 double ue9_compute_rate(uint8_t scanconfig, uint16_t scaninterval);
 
@@ -133,6 +167,14 @@ int ue9_stream_start(int fd);
    received. */
 int ue9_command(int fd, uint8_t * out, uint8_t * in, int inlen);
 
+/* Execute several commands, sending all of them before reading any
+   reply.  Returns the number of commands that completed, which is
+   "count" on success.  If "done" is not NULL, it gets the time each
+   reply arrived.  "out" and "in" buffers must not overlap.  After a
+   failure, the other replies are drained from fd. */
+int ue9_command_batch(int fd, int count, uint8_t ** out, uint8_t ** in,
+		      int *inlen, struct timeval *done);
+
 /* "Simple" stream configuration, assumes the channels are all 
    configured with the same gain. */
 int ue9_streamconfig_simple(int fd, int *channel_list, int channel_count,
@@ -147,10 +189,116 @@ int ue9_streamconfig(int fd, int *channel_list, int channel_count,
 /* Timer configuration */
 int ue9_timer_config(int fd, int *mode_list, int *value_list, int count, int divisor);
 
+/* Pipelined stream setup.  Independent steps are overlapped, so
+   bringing up a stream takes a few round trips instead of one per
+   command.  The caller fills in the stream parameters, then calls
+   ue9_setup_connect, ue9_setup_prepare and ue9_setup_start in order.
+   Each returns -1 on error. */
+struct ue9_setup {
+	/* Stream parameters */
+	int *channel_list;
+	int channel_count;
+	int *gain_list;
+	int gain_count;
+	uint8_t scanconfig;
+	uint16_t scaninterval;
+	int *timer_mode_list;
+	int *timer_value_list;
+	int timer_mode_count;
+	int timer_divisor;
+
+	/* Read from the device by ue9_setup_prepare */
+	struct ue9CommConfig comm;
+
+	/* When each phase finished */
+	struct timeval begin, connect, prepare, calib, config, start;
+};
+
+/* Open the command and data connections in parallel.  A connection
+   that failed is returned as -1, the other one is left open. */
+int ue9_setup_connect(struct ue9_setup *su, const char *host, int cmd_port,
+		      int data_port, int *fd_cmd, int *fd_data);
+
+/* Stop any previous stream, flush buffers and read the comm config,
+   then discard stale data on the data connection. */
+int ue9_setup_prepare(struct ue9_setup *su, int fd_cmd, int fd_data);
+
+/* Read calibration into calib (unless NULL), configure timers and
+   the stream, and start it.  The stream may have been started even
+   if this fails. */
+int ue9_setup_start(struct ue9_setup *su, int fd_cmd,
+		    struct ue9Calibration *calib);
+
+/* Log the time taken by each phase, given when the first data
+   arrived */
+void ue9_setup_report(struct ue9_setup *su, struct timeval *first);
+
 /* Stream data and pass it to the data callback.  If callback returns
-   negative, stops reading and returns 0.  Returns < 0 on error. */
-typedef int (*ue9_stream_cb_t) (int channels, int *channel_list, int gain_count, int *gain_list, uint16_t * data, void *context);
-int ue9_stream_data(int fd, int channels, int *channel_list, int gain_count, int *gain_list,
+   negative, stops reading and returns 0.  Returns < 0 on error.  At
+   a known scan rate, a stall is detected within a few packet
+   intervals; with rate 0 the receive timeout is TIMEOUT.  If capture
+   is not NULL, the data is recorded to it, or replayed from it
+   instead of fd.  If metrics is not NULL, every packet and the
+   backlogs it reports are counted there.  If out is not NULL, it is
+   flushed when its latency deadline passes while waiting for a packet.
+
+   ue9_stream_batch() calls back with blocks of complete scans: all
+   that the packets waiting in the receive ring hold, up to
+   UE9_BATCH_SAMPLES samples.  ue9_stream_data() calls back once per
+   scan.  Both are built on ue9_stream_begin(), ue9_stream_next() and
+   ue9_stream_end(), which let the caller pull the blocks instead. */
+struct capture;
+struct metrics;
+struct output;
+
+#define UE9_BATCH_SAMPLES 4096
+
+struct ue9_scan_block {
+	int channels;
+	int *channel_list;
+	int gain_count;
+	int *gain_list;
+	const uint16_t *data;	/* scans * channels samples */
+	int scans;
+	/* Packets the scans came from, counted from 0 at the start of
+	   the stream; the low 8 bits are the device's packet counter */
+	unsigned long first_packet;
+	unsigned long last_packet;
+	/* Backlogs reported by the last packet */
+	int comm_backlog;	/* bytes */
+	int control_backlog;	/* bytes */
+};
+
+/* Start receiving the stream.  Returns NULL on error. */
+struct ue9_stream;
+struct ue9_stream *ue9_stream_begin(int fd, struct capture *capture,
+				    struct metrics *metrics,
+				    struct output *out, double rate,
+				    int channels, int *channel_list,
+				    int gain_count, int *gain_list);
+
+/* Wait for the next block of scans.  Returns 1 with *block set, which
+   stays valid until the next call, or < 0 once the stream has ended,
+   as ue9_stream_batch() would. */
+int ue9_stream_next(struct ue9_stream *st, struct ue9_scan_block **block);
+
+/* Stop receiving and free st */
+void ue9_stream_end(struct ue9_stream *st);
+
+typedef int (*ue9_stream_batch_cb_t) (struct ue9_scan_block *block,
+				      void *context);
+int ue9_stream_batch(int fd, struct capture *capture,
+		     struct metrics *metrics, struct output *out,
+		     double rate, int channels, int *channel_list,
+		     int gain_count, int *gain_list,
+		     ue9_stream_batch_cb_t callback, void *context);
+
+typedef int (*ue9_stream_cb_t) (int channels, int *channel_list,
+				int gain_count, int *gain_list,
+				uint16_t * data, void *context);
+int ue9_stream_data(int fd, struct capture *capture,
+		    struct metrics *metrics, double rate, int channels,
+		    int *channel_list, int gain_count, int *gain_list,
 		    ue9_stream_cb_t callback, void *context);
 
 #endif
@@ -0,0 +1,246 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "debug.h"
+#include "compat.h"
+#include "ue9cache.h"
+
+#define CACHE_MAGIC "ethstream-ue9-calibration 1"
+
+#define CALIB(x) { #x, offsetof(struct ue9Calibration, x) }
+
+/* Every field of struct ue9Calibration, in file order */
+static const struct {
+	const char *name;
+	size_t offset;
+} fields[] = {
+	CALIB(unipolarSlope[0]), CALIB(unipolarOffset[0]),
+	CALIB(unipolarSlope[1]), CALIB(unipolarOffset[1]),
+	CALIB(unipolarSlope[2]), CALIB(unipolarOffset[2]),
+	CALIB(unipolarSlope[3]), CALIB(unipolarOffset[3]),
+	CALIB(bipolarSlope), CALIB(bipolarOffset),
+	CALIB(DACSlope[0]), CALIB(DACOffset[0]),
+	CALIB(DACSlope[1]), CALIB(DACOffset[1]),
+	CALIB(tempSlope), CALIB(tempSlopeLow), CALIB(calTemp),
+	CALIB(Vref), CALIB(VrefDiv2), CALIB(VsSlope),
+	CALIB(hiResUnipolarSlope), CALIB(hiResUnipolarOffset),
+	CALIB(hiResBipolarSlope), CALIB(hiResBipolarOffset),
+};
+
+#define FIELD(calib, i) ((double *)((char *)(calib) + fields[i].offset))
+#define NFIELDS (sizeof(fields) / sizeof(fields[0]))
+
+static int make_dir(const char *path)
+{
+#ifdef __WIN32__
+	if (mkdir(path) == 0 || errno == EEXIST)
+#else
+	if (mkdir(path, 0777) == 0 || errno == EEXIST)
+#endif
+		return 0;
+	return -1;
+}
+
+/* Build the cache file name for a device, creating the directory if
+   create is set.  Returns < 0 if the cache is disabled or unusable. */
+static int cache_path(struct ue9CommConfig *config, char *path, size_t len,
+		      int create)
+{
+	const char *dir = getenv("ETHSTREAM_CACHE");
+	const char *home = getenv("HOME");
+	uint8_t *m = config->mac_address;
+	char base[1024];
+
+	if (dir != NULL) {
+		if (*dir == '\0')
+			return -1;
+		snprintf(base, sizeof(base), "%s", dir);
+		if (create && make_dir(base) < 0)
+			return -1;
+	} else {
+		if (home == NULL)
+			return -1;
+		snprintf(base, sizeof(base), "%s/.cache", home);
+		if (create && make_dir(base) < 0)
+			return -1;
+		snprintf(base, sizeof(base), "%s/.cache/ethstream", home);
+		if (create && make_dir(base) < 0)
+			return -1;
+	}
+
+	snprintf(path, len, "%s/ue9-%02x%02x%02x%02x%02x%02x", base,
+		 m[0], m[1], m[2], m[3], m[4], m[5]);
+	return 0;
+}
+
+int ue9_cache_load(struct ue9CommConfig *config, struct ue9Calibration *calib)
+{
+	char path[1100], line[256], name[64];
+	char *end;
+	unsigned int i;
+	int found = 0;
+	FILE *f;
+
+	if (cache_path(config, path, sizeof(path), 0) < 0)
+		return -1;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	if (fgets(line, sizeof(line), f) == NULL ||
+	    strncmp(line, CACHE_MAGIC, strlen(CACHE_MAGIC)) != 0) {
+		verb("ignoring %s: not a calibration cache\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%63s", name) != 1)
+			continue;
+		for (i = 0; i < NFIELDS; i++) {
+			if (strcmp(name, fields[i].name) != 0)
+				continue;
+			*FIELD(calib, i) = strtod(line + strlen(name), &end);
+			if (end != line + strlen(name))
+				found++;
+			break;
+		}
+	}
+	fclose(f);
+
+	if (found != NFIELDS) {
+		verb("ignoring %s: incomplete\n", path);
+		return -1;
+	}
+
+	debug("loaded calibration from %s\n", path);
+	return 0;
+}
+
+int ue9_cache_save(struct ue9CommConfig *config, struct ue9Calibration *calib)
+{
+	char path[1100], tmp[1200];
+	unsigned int i;
+	FILE *f;
+	int ret;
+
+	if (cache_path(config, path, sizeof(path), 1) < 0)
+		return -1;
+
+	/* Write a new file and rename it over the old one, so readers
+	   never see half of it */
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		verb("can't write %s: %s\n", tmp, compat_strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, "%s\n", CACHE_MAGIC);
+	fprintf(f, "# product %d, hardware %.2f, comm firmware %.2f\n",
+		config->product_id, config->hw_version,
+		config->comm_fw_version);
+	for (i = 0; i < NFIELDS; i++)
+		fprintf(f, "%s %.17g\n", fields[i].name, *FIELD(calib, i));
+	ret = fclose(f);
+
+#ifdef __WIN32__
+	/* rename() won't replace an existing file */
+	unlink(path);
+#endif
+	if (ret != 0 || rename(tmp, path) != 0) {
+		verb("can't write %s: %s\n", path, compat_strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	debug("saved calibration to %s\n", path);
+	return 0;
+}
+
+static void *refresh_thread(void *arg)
+{
+	struct ue9_refresh *r = arg;
+	int ret;
+
+	ret = ue9_get_calibration(r->fd, &r->calib);
+	__atomic_store_n(&r->fd_done, 1, __ATOMIC_RELEASE);
+	if (ret < 0) {
+		verb("failed to refresh calibration\n");
+		r->result = -1;
+		return NULL;
+	}
+
+	if (memcmp(&r->calib, &r->cached, sizeof(r->calib)) == 0) {
+		r->result = 0;
+		return NULL;
+	}
+
+	info("Cached calibration was out of date, updating it\n");
+	ue9_cache_save(&r->config, &r->calib);
+	if (r->changed)
+		r->changed(&r->calib, r->context);
+	r->result = 1;
+	return NULL;
+}
+
+int ue9_refresh_start(struct ue9_refresh *r, int fd,
+		      struct ue9CommConfig *config,
+		      struct ue9Calibration *cached,
+		      void (*changed) (struct ue9Calibration *, void *),
+		      void *context)
+{
+	memset(r, 0, sizeof(*r));
+#ifndef __WIN32__
+	r->fd = fd;
+	r->config = *config;
+	r->cached = *cached;
+	r->changed = changed;
+	r->context = context;
+
+	if (pthread_create(&r->thread, NULL, refresh_thread, r) != 0) {
+		verb("can't create calibration refresh thread\n");
+		r->fd_done = 1;
+		return -1;
+	}
+	r->running = 1;
+#endif
+	return 0;
+}
+
+void ue9_refresh_release(struct ue9_refresh *r)
+{
+#ifndef __WIN32__
+	struct timespec ts = {.tv_sec = 0,.tv_nsec = 10000000 };
+
+	while (!__atomic_load_n(&r->fd_done, __ATOMIC_ACQUIRE))
+		nanosleep(&ts, NULL);
+#endif
+}
+
+int ue9_refresh_finish(struct ue9_refresh *r)
+{
+#ifndef __WIN32__
+	if (r->running)
+		pthread_join(r->thread, NULL);
+	r->running = 0;
+#endif
+	return r->result;
+}
@@ -0,0 +1,64 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef UE9CACHE_H
+#define UE9CACHE_H
+
+#include "ue9.h"
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
+
+/* On-disk cache of UE9 calibration data and identity, one file per
+   device, named after its MAC address.  The files live in
+   $ETHSTREAM_CACHE, or ~/.cache/ethstream if that isn't set.  Setting
+   ETHSTREAM_CACHE to an empty string disables the cache. */
+
+/* Load the cached calibration for the device described by config.
+   Returns < 0 if there is no usable entry. */
+int ue9_cache_load(struct ue9CommConfig *config, struct ue9Calibration *calib);
+
+/* Store calibration for the device.  Returns < 0 on error. */
+int ue9_cache_save(struct ue9CommConfig *config, struct ue9Calibration *calib);
+
+/* Re-read the calibration from the device in the background, while
+   streaming from a cached copy.  If it differs from the cached copy,
+   the cache is rewritten and changed() is called with the new data,
+   from the refresh thread.  ue9_refresh_finish() must be called
+   before fd is used again.  On Windows the cache is trusted as is. */
+struct ue9_refresh {
+	int fd;
+	struct ue9CommConfig config;
+	struct ue9Calibration cached;
+	struct ue9Calibration calib;
+	void (*changed) (struct ue9Calibration * calib, void *context);
+	void *context;
+	int result;		/* 1 if changed, 0 if not, < 0 on error */
+	int running;
+	int fd_done;		/* the thread is finished with fd */
+#ifndef __WIN32__
+	pthread_t thread;
+#endif
+};
+
+int ue9_refresh_start(struct ue9_refresh *r, int fd,
+		      struct ue9CommConfig *config,
+		      struct ue9Calibration *cached,
+		      void (*changed) (struct ue9Calibration *, void *),
+		      void *context);
+
+/* Wait until the refresh thread is done with fd, without joining it,
+   so that fd can be used from a signal handler or another thread.
+   ue9_refresh_finish() is still needed. */
+void ue9_refresh_release(struct ue9_refresh *r);
+
+/* Wait for the refresh to finish.  Returns its result. */
+int ue9_refresh_finish(struct ue9_refresh *r);
+
+#endif
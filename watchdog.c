@@ -0,0 +1,75 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "watchdog.h"
+
+void watchdog_init(struct watchdog *w, double interval)
+{
+	memset(w, 0, sizeof(*w));
+	w->expected = interval;
+}
+
+void watchdog_feed(struct watchdog *w, struct timeval *now)
+{
+	double gap, err;
+
+	if (w->samples++ == 0) {
+		w->last = *now;
+		return;
+	}
+
+	gap = (now->tv_sec - w->last.tv_sec) +
+	    (now->tv_usec - w->last.tv_usec) / 1e6;
+	w->last = *now;
+
+	if (w->samples == 2) {
+		w->srtt = gap;
+		w->rttvar = gap / 2;
+		return;
+	}
+
+	/* RFC 6298 gains: 1/8 for the mean, 1/4 for the deviation */
+	err = gap - w->srtt;
+	w->srtt += err / 8;
+	w->rttvar += (fabs(err) - w->rttvar) / 4;
+}
+
+void watchdog_timeout(struct watchdog *w, struct timeval *timeout)
+{
+	double t = WATCHDOG_MIN_MS / 1000.0;
+
+	if (w->expected * WATCHDOG_INTERVALS > t)
+		t = w->expected * WATCHDOG_INTERVALS;
+	if (w->samples > 2 && w->srtt + 4 * w->rttvar > t)
+		t = w->srtt + 4 * w->rttvar;
+
+	timeout->tv_sec = (long)t;
+	timeout->tv_usec = (long)((t - timeout->tv_sec) * 1e6);
+}
+
+void backoff_reset(struct backoff *b)
+{
+	b->delay_ms = BACKOFF_MIN_MS;
+}
+
+int backoff_next(struct backoff *b)
+{
+	int delay = b->delay_ms;
+
+	if (delay < BACKOFF_MIN_MS)
+		delay = BACKOFF_MIN_MS;
+	b->delay_ms = delay * 2;
+	if (b->delay_ms > BACKOFF_MAX_MS)
+		b->delay_ms = BACKOFF_MAX_MS;
+	return delay;
+}
@@ -0,0 +1,59 @@
+/*
+ * Labjack Tools
+ * Copyright (c) 2003-2007 Jim Paris <jim@jtan.com>
+ *
+ * This is free software; you can redistribute it and/or modify it and
+ * it is provided under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation; see COPYING.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <sys/time.h>
+
+/* Stall detection for a stream of packets.  The expected time between
+   packets follows from the configured rate.  The time between
+   receives is also tracked as it happens, like a TCP retransmit timer
+   (smoothed mean plus four deviations), so a link that delivers
+   packets in bursts doesn't trip it.  A stall is declared after the
+   larger of WATCHDOG_INTERVALS expected intervals, the observed bound,
+   and WATCHDOG_MIN_MS. */
+
+#define WATCHDOG_INTERVALS 4
+#define WATCHDOG_MIN_MS 100
+
+struct watchdog {
+	double expected;	/* seconds between packets, 0 if unknown */
+	double srtt;		/* smoothed time between receives */
+	double rttvar;		/* and its mean deviation */
+	int samples;
+	struct timeval last;
+};
+
+/* "interval" is the expected time between packets, in seconds */
+void watchdog_init(struct watchdog *w, double interval);
+
+/* Record that data arrived at "now" */
+void watchdog_feed(struct watchdog *w, struct timeval *now);
+
+/* How long to wait for the next packet before declaring a stall */
+void watchdog_timeout(struct watchdog *w, struct timeval *timeout);
+
+/* Delay between reconnect attempts.  Starts at BACKOFF_MIN_MS and
+   doubles after each attempt that didn't get any data, up to
+   BACKOFF_MAX_MS. */
+
+#define BACKOFF_MIN_MS 20
+#define BACKOFF_MAX_MS 5000
+
+struct backoff {
+	int delay_ms;		/* next delay */
+};
+
+void backoff_reset(struct backoff *b);
+
+/* Return the delay to use now, and double the next one */
+int backoff_next(struct backoff *b);
+
+#endif